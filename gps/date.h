@@ -0,0 +1,13 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// dateDays converts a UTC date in NMEA's DDMMYY format into days since 2000-01-01, the base of
+// the fix times of FixFields (logger/fix-fields.h) and FixBatch (lora/fix-batch.h).
+
+#pragma once // shared by logger/fix-fields.h and lora/fix-batch.h
+
+static inline int dateDays(int32_t ddmmyy) {
+    int d = ddmmyy / 10000, m = ddmmyy / 100 % 100, y = 2000 + ddmmyy % 100;
+    // days since 0000-03-01 with March as the first month, so leap days come last
+    if (m <= 2) { y--; m += 9; } else m -= 3;
+    return 365*y + y/4 - y/100 + y/400 + (153*m + 2)/5 + d - 1 - 730425;
+}
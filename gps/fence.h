@@ -1,8 +1,10 @@
 // Copyright (c) 2018 by Thorsten von Eicken
 //
-// Geo-fences for GPS
+// Geo-fences for GPS: pointInPolygon for a polygon in float degrees and FenceSet for dozens of
+// them in NMEAfix's minutes*1E4, and FenceMonitor to watch them along a track, see geo.h for
+// distances and courses.
 
-#include <math.h>
+#include "geo.h"
 
 //  Determine whether a point is in a polygon.
 //  Adapted from http://alienryderflex.com/polygon/
@@ -35,60 +37,261 @@ bool pointInPolygon(int vertices, float polyX[], float polyY[], float x, float y
     return oddNodes;
 }
 
-// geoDistance returns the distance in meters between two positions specified
-// using fixed-point minutes*1000 lat/lon.
-// The great-circle distance computation uses the Vincenty formula from
-// https://en.wikipedia.org/wiki/Great-circle_distance
-// The earth is approximated as a sphere of radius 6371m.
-uint32_t geoDistance(uint32_t lat1, uint32_t lon1, uint32_t lat2, uint32_t lon2) {
-    constexpr double m2r = 3.14159265359 / 180 / 60 / 1000; // minutes*1E3 to radians
-    // for longitudes we only the delta between the two
-    double rlon1 = (double)lon1 * m2r;
-    double rlon2 = (double)lon2 * m2r;
-    double delta_lon = rlon1 - rlon2;
-    double sin_dlon = sin(delta_lon);
-    double cos_dlon = cos(delta_lon);
-    // for latitudes we need sin/cos for each
-    double rlat1 = (double)lat1 * m2r;
-    double sin_lat1 = sin(rlat1);
-    double cos_lat1 = cos(rlat1);
-    double rlat2 = (double)lat2 * m2r;
-    double sin_lat2 = sin(rlat2);
-    double cos_lat2 = cos(rlat2);
-    // numerator of the Vincenty formula
-    double num1 = cos_lat2 * sin_dlon;
-    double num2 = cos_lat1 * sin_lat2 - sin_lat1 * cos_lat2 * cos_dlon;
-    double num = sqrt(num1*num1 + num2*num2);
-    double denom = sin_lat1 * sin_lat2 + cos_lat1 * cos_lat2 * cos_dlon;
-    return uint32_t(6371 * atan2(num, denom) + 0.5);
-}
+// FenceSet answers which of up to F fences a position is in, quickly enough to check dozens of
+// them on every fix. A fence is a polygon in minutes*1E4 as in NMEAfix, which stays where the
+// caller has it, e.g. a const array in flash, the set only keeps its bounding box and an index of
+// its edges by horizontal slabs of 2^shift 1E-4 minutes of latitude, about one slab per 4
+// vertices and at most S. A query skips the fences whose box the position is outside of, and for
+// the others casts a ray east through the edges listed in the position's slab, with integer
+// math. E is the room for the edge lists in all: an edge is listed in each slab it spans, so
+// that's a little more than the vertices for fences that aren't long and thin. Fences must not
+// cross the antimeridian.
+template< int F, int E, int S=16 >
+struct FenceSet {
+    static_assert(F <= 32, "inside returns a bit per fence");
+    static_assert(S < 256, "slabs is a uint8_t");
 
-#if 0
-// https://www.igismap.com/formula-to-find-bearing-or-heading-angle-between-two-points-latitude-longitude
-double courseTo(double lat1, double long1, double lat2, double long2)
-{
-  // returns course in degrees (North=0, West=270) from position 1 to position 2,
-  // both specified as signed decimal-degrees latitude and longitude.
-  // Because Earth is no exact sphere, calculated course may be off by a tiny fraction.
-  // Courtesy of Maarten Lamers
-  double dlon = radians(long2-long1);
-  lat1 = radians(lat1);
-  lat2 = radians(lat2);
-  double a1 = sin(dlon) * cos(lat2);
-  double a2 = sin(lat1) * cos(lat2) * cos(dlon);
-  a2 = cos(lat1) * sin(lat2) - a2;
-  a2 = atan2(a1, a2);
-  if (a2 < 0.0)
-  {
-    a2 += TWO_PI;
-  }
-  return degrees(a2);
-}
+    struct Fence {
+        const int32_t (*pts)[2]; // vertices, {lat, lon} each
+        int n;
+        int32_t minLat, maxLat, minLon, maxLon; // bounding box
+        uint16_t slab;          // first slab in slabStart
+        uint8_t shift;          // slabs are 2^shift high
+        uint8_t slabs;          // number of slabs
+    };
 
-const char *TinyGPSPlus::cardinal(double course)
-{
-  static const char* directions[] = {"N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE", "S", "SSW", "SW", "WSW", "W", "WNW", "NW", "NNW"};
-  int direction = (int)((course + 11.25f) / 22.5f);
-  return directions[direction % 16];
-}
-#endif
+    Fence fences[F];
+    int nFences;
+    uint16_t slabStart[F*(S+1)]; // first entry in edges of each slab, followed by the end
+    int nSlabs;
+    uint16_t edges[E];          // vertex an edge starts at, for each slab
+    int nEdges;
+
+    void init() { nFences = nSlabs = nEdges = 0; }
+
+    // add adds the fence with the n vertices pts and returns its number or -1 if there's no room.
+    int add(const int32_t (*pts)[2], int n) {
+        if (nFences == F || n < 3 || n > 65535) return -1;
+        Fence &f = fences[nFences];
+        f.pts = pts;
+        f.n = n;
+        f.minLat = f.maxLat = pts[0][0];
+        f.minLon = f.maxLon = pts[0][1];
+        for (int i=1; i<n; i++) {
+            if (pts[i][0] < f.minLat) f.minLat = pts[i][0];
+            if (pts[i][0] > f.maxLat) f.maxLat = pts[i][0];
+            if (pts[i][1] < f.minLon) f.minLon = pts[i][1];
+            if (pts[i][1] > f.maxLon) f.maxLon = pts[i][1];
+        }
+        int want = n/4 < 1 ? 1 : n/4 > S ? S : n/4;
+        uint32_t range = f.maxLat - f.minLat;
+        for (f.shift = 0; (range >> f.shift) >= (uint32_t)want; f.shift++) ;
+        f.slabs = (range >> f.shift) + 1;
+        f.slab = nSlabs;
+
+        // count the edges of each slab, an edge is in the slabs of lat from above its low end up
+        // to its high end, as pointInPolygon and contains count it
+        uint16_t *start = slabStart + nSlabs;
+        memset(start, 0, (f.slabs+1) * sizeof(uint16_t));
+        int total = 0;
+        for (int i=0; i<n; i++) {
+            int lo, hi;
+            if (!span(f, i, lo, hi)) continue;
+            for (int s=lo; s<=hi; s++) start[s+1]++;
+            total += hi - lo + 1;
+        }
+        if (nEdges + total > E) return -1;
+        start[0] = nEdges;
+        for (int s=0; s<f.slabs; s++) start[s+1] += start[s];
+        // fill them in, counting start[s] up and then moving it back
+        for (int i=0; i<n; i++) {
+            int lo, hi;
+            if (!span(f, i, lo, hi)) continue;
+            for (int s=lo; s<=hi; s++) edges[start[s]++] = i;
+        }
+        for (int s=f.slabs; s>0; s--) start[s] = start[s-1];
+        start[0] = nEdges;
+        nEdges += total;
+        nSlabs += f.slabs + 1;
+        return nFences++;
+    }
+
+    // span is an internal function that sets lo and hi to the first and last slab of edge i of
+    // fence f, it returns false for an east-west edge, which no ray east crosses.
+    static bool span(Fence &f, int i, int &lo, int &hi) {
+        int32_t a = f.pts[i][0], b = f.pts[i+1 < f.n ? i+1 : 0][0];
+        if (a == b) return false;
+        lo = ((a < b ? a : b) + 1 - f.minLat) >> f.shift;
+        hi = ((a < b ? b : a) - f.minLat) >> f.shift;
+        return true;
+    }
+
+    // contains returns true if lat, lon is in fence f, on an edge it may or may not be.
+    bool contains(int f, int32_t lat, int32_t lon) {
+        Fence &fc = fences[f];
+        if (lat <= fc.minLat || lat > fc.maxLat || lon < fc.minLon || lon > fc.maxLon)
+            return false;
+        const uint16_t *start = slabStart + fc.slab + ((lat - fc.minLat) >> fc.shift);
+        bool in = false;
+        for (int k=start[0]; k<start[1]; k++) {
+            int i = edges[k], j = i+1 < fc.n ? i+1 : 0;
+            int32_t y1 = fc.pts[i][0], x1 = fc.pts[i][1], y2 = fc.pts[j][0], x2 = fc.pts[j][1];
+            if (y1 > y2) {
+                int32_t t = y1; y1 = y2; y2 = t;
+                t = x1; x1 = x2; x2 = t;
+            }
+            if (lat <= y1 || lat > y2) continue;
+            if (x1 <= lon && x2 <= lon) continue;   // west of the position
+            // the edge crosses lat east of the position if x1 + (lat-y1)*(x2-x1)/(y2-y1) > lon
+            if ((x1 > lon && x2 > lon) ||
+                    (int64_t)(x1 - lon) * (y2 - y1) + (int64_t)(lat - y1) * (x2 - x1) > 0)
+                in = !in;
+        }
+        return in;
+    }
+
+    // inside returns the fences lat, lon is in, fence i is bit i.
+    uint32_t inside(int32_t lat, int32_t lon) {
+        uint32_t in = 0;
+        for (int f=0; f<nFences; f++)
+            if (contains(f, lat, lon)) in |= 1u << f;
+        return in;
+    }
+};
+
+// FenceMonitor watches the fences of a FenceSet along a track and reports when it enters or
+// exits one, at almost no cost per fix away from the fences. When it evaluates a fence it finds
+// the distance to its nearest edge, and since being inside or not can't change before the track
+// has moved that far, it leaves the fence alone until it has. The distance moved is added up fix
+// by fix, rounded up, so the cost of a fix that's not due anywhere is one step and one compare.
+// An event takes hyst meters past the edge, so GPS noise along an edge doesn't make a string of
+// them: the monitor reports an exit from a fence it's in once the track is more than hyst outside
+// and an entry once it's more than hyst inside, which also pushes back the next evaluation by
+// hyst. At the first evaluation of a fence the monitor takes on whether the track is in it
+// without an event. Distances are in 1E-4 minutes of latitude (0.1852m) and the longitudes are
+// scaled by the cosine of the latitude of the first fix, as in simplify.h. FS is a FenceSet with
+// all its fences added before init.
+template< typename FS >
+struct FenceMonitor {
+    FS *set;
+    int32_t hyst;       // distance past an edge for an event
+    int32_t cosLat;     // cosine of the latitude of the first fix, Q15
+    bool started;
+    int32_t lat, lon;   // last fix
+    uint32_t odo;       // distance moved, rounded up
+    uint32_t due[32];   // odo at which each fence is evaluated again
+    uint32_t next;      // the earliest of them
+    uint32_t in;        // fences the track is in, bit i is fence i
+    uint32_t known;     // fences evaluated at least once
+    uint32_t entered, exited; // events of the last fix
+    uint32_t fixes;     // fixes seen
+    uint32_t evals;     // fences evaluated
+
+    // init starts monitoring the fences of s with events hyst meters past their edges.
+    void init(FS &s, int meters) {
+        set = &s;
+        hyst = meters * 10000 / 1852;
+        started = false;
+        cosLat = lat = lon = 0;
+        odo = next = 0;
+        in = known = entered = exited = 0;
+        fixes = evals = 0;
+    }
+
+    // update moves the track to lat, lon and returns true if it entered or exited a fence, the
+    // fences are in entered and exited.
+    bool update(int32_t la, int32_t lo) {
+        entered = exited = 0;
+        fixes++;
+        if (!started) {
+            started = true;
+            cosLat = fixCos(geoAngle(la)) >> 15;
+            for (int f=0; f<set->nFences; f++) due[f] = 0;
+        } else {
+            // an octagon around the step, which is at most 12% longer than the step
+            uint32_t dx = local(lo - lon), dy = la > lat ? la - lat : lat - la;
+            odo += dx > dy ? dx + dy/2 + 1 : dy + dx/2 + 1;
+        }
+        lat = la;
+        lon = lo;
+        if ((int32_t)(odo - next) < 0) return false;
+        next = odo + 0x7fffffff;
+        for (int f=0; f<set->nFences; f++) {
+            if ((int32_t)(odo - due[f]) >= 0) evaluate(f);
+            if ((int32_t)(due[f] - next) < 0) next = due[f];
+        }
+        return (entered | exited) != 0;
+    }
+
+    // local is an internal function that returns the absolute east-west distance of dlon.
+    uint32_t local(int32_t dlon) {
+        int64_t x = (int64_t)dlon * cosLat >> 15;
+        return x < 0 ? -x : x;
+    }
+
+    // evaluate is an internal function that decides whether the track is in fence f, reports an
+    // event if that changed by more than hyst, and sets when to evaluate the fence again.
+    void evaluate(int f) {
+        evals++;
+        typename FS::Fence &fc = set->fences[f];
+        uint32_t bit = 1u << f;
+        // the distance to the bounding box is how far outside the track is at least, once that's
+        // more than hyst it's outside enough
+        uint32_t dx = lon < fc.minLon ? local(fc.minLon - lon) :
+            lon > fc.maxLon ? local(lon - fc.maxLon) : 0;
+        uint32_t dy = lat < fc.minLat ? fc.minLat - lat : lat > fc.maxLat ? lat - fc.maxLat : 0;
+        uint32_t out = dx > dy ? dx : dy;
+        int32_t d;      // distance to the nearest edge, positive inside
+        if (out > (uint32_t)hyst) {
+            d = -(int32_t)out;
+        } else {
+            d = nearest(fc, out);
+            if (!set->contains(f, lat, lon)) d = -d;
+        }
+        if (!(known & bit)) {
+            known |= bit;
+            if (d > 0) in |= bit;
+        } else if ((in & bit) && d < -hyst) {
+            in &= ~bit;
+            exited |= bit;
+        } else if (!(in & bit) && d > hyst) {
+            in |= bit;
+            entered |= bit;
+        }
+        due[f] = odo + (in & bit ? d + hyst : hyst - d);
+    }
+
+    // nearest is an internal function that returns the distance from the track to the nearest
+    // edge of fc, rounded down, at least lb which the caller knows it to be.
+    uint32_t nearest(typename FS::Fence &fc, uint32_t lb) {
+        uint32_t best = 0xffffffff;
+        int64_t ax = 0, ay = 0;
+        for (int i=0; i<=fc.n; i++) {
+            const int32_t *p = fc.pts[i < fc.n ? i : 0];
+            int64_t bx = (int64_t)(p[1] - lon) * cosLat >> 15, by = p[0] - lat;
+            if (i > 0) {
+                // skip the edge if it's farther away than best along either axis
+                int64_t lox = ax < bx ? ax : bx, hix = ax < bx ? bx : ax;
+                int64_t loy = ay < by ? ay : by, hiy = ay < by ? by : ay;
+                if (lox < best && -hix < best && loy < best && -hiy < best) {
+                    uint32_t d = segment(ax, ay, bx, by);
+                    if (d < best) best = d;
+                }
+            }
+            ax = bx;
+            ay = by;
+        }
+        return best > lb ? best : lb;
+    }
+
+    // segment is an internal function that returns the distance from the track, at 0,0, to the
+    // segment from a to b, rounded down.
+    static uint32_t segment(int64_t ax, int64_t ay, int64_t bx, int64_t by) {
+        int64_t dx = bx - ax, dy = by - ay;
+        int64_t t = -(ax*dx + ay*dy), len2 = dx*dx + dy*dy;
+        if (t <= 0) return isqrt64(ax*ax + ay*ay);
+        if (t >= len2) return isqrt64(bx*bx + by*by);
+        int64_t cross = ax*by - ay*bx;
+        return (cross < 0 ? -cross : cross) / (isqrt64(len2) + 1);
+    }
+};
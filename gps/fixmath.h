@@ -0,0 +1,114 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Fixed-point sin, cos, atan2 and square root for the Cortex-M0+, which has no FPU and takes
+// thousands of cycles for a double sin or atan2 in software. Angles are binary: a uint32_t where
+// 2^32 is a full turn, so they wrap around for free and -90 degrees is the same as 270. Sines and
+// cosines are Q30 (1.0 is 1<<30) from a table of 64 steps per quarter turn and a 4th-order Taylor
+// step, within 3E-9. fixAtan2 is a 30-step CORDIC on the vector scaled to 30 bits, within 2E-8
+// radians, and isqrt64 is the bit by bit integer square root. The code only uses integer adds,
+// shifts and multiplies.
+
+// sine of 0..90 degrees in 64 steps, Q30
+static const int32_t fixSinTab[65] = {
+    0, 26350943, 52686014, 78989349, 105245103, 131437462, 157550647, 183568930, 209476638,
+    235258165, 260897982, 286380643, 311690799, 336813204, 361732726, 386434353, 410903207,
+    435124548, 459083786, 482766489, 506158392, 529245404, 552013618, 574449320, 596538995,
+    618269338, 639627258, 660599890, 681174602, 701339000, 721080937, 740388522, 759250125,
+    777654384, 795590213, 813046808, 830013654, 846480531, 862437520, 877875009, 892783698,
+    907154608, 920979082, 934248793, 946955747, 959092290, 970651112, 981625251, 992008094,
+    1001793390, 1010975242, 1019548121, 1027506862, 1034846671, 1041563127, 1047652185,
+    1053110176, 1057933813, 1062120190, 1065666786, 1068571464, 1070832474, 1072448455,
+    1073418433, 1073741824,
+};
+
+// atan(2^-i) as binary angles, the CORDIC rotations
+static const int32_t fixAtanTab[30] = {
+    536870912, 316933406, 167458907, 85004756, 42667331, 21354465, 10679838, 5340245, 2670163,
+    1335087, 667544, 333772, 166886, 83443, 41722, 20861, 10430, 5215, 2608, 1304, 652, 326, 163,
+    81, 41, 20, 10, 5, 3, 1,
+};
+
+static constexpr int32_t fixOne = 1 << 30;
+static constexpr uint32_t fixQuarter = 1u << 30; // 90 degrees
+
+// fixSinCos sets s and c to the sine and cosine of the angle a in Q30.
+void fixSinCos(uint32_t a, int32_t &s, int32_t &c) {
+    uint32_t r = a & (fixQuarter-1);
+    int i = r >> 24;
+    int32_t s0 = fixSinTab[i], c0 = fixSinTab[64-i];
+    // the rest of the angle in radians Q30, up to 0.0245
+    int64_t d = ((int64_t)(r & 0xffffff) * 1686629713 + (1 << 29)) >> 30; // * pi/2
+    int64_t d2 = (d*d + (1 << 29)) >> 31;           // d^2/2, Q30
+    int64_t d3 = (((d2*d + (1 << 29)) >> 30) * 21845 + (1 << 15)) >> 16; // d^3/6, Q30
+    int64_t d4 = (d3*d + (1u << 31)) >> 32;         // d^4/24, Q30
+    // sin(x+d) = sin x + d cos x - d^2/2 sin x - d^3/6 cos x + d^4/24 sin x, the cosine likewise
+    int32_t ss = s0 + ((d*c0 - d2*s0 - d3*c0 + d4*s0 + (1 << 29)) >> 30);
+    int32_t cc = c0 + ((-d*s0 - d2*c0 + d3*s0 + d4*c0 + (1 << 29)) >> 30);
+    switch (a >> 30) {
+    case 0: s = ss; c = cc; break;
+    case 1: s = cc; c = -ss; break;
+    case 2: s = -ss; c = -cc; break;
+    default: s = -cc; c = ss; break;
+    }
+}
+
+int32_t fixSin(uint32_t a) { int32_t s, c; fixSinCos(a, s, c); return s; }
+int32_t fixCos(uint32_t a) { int32_t s, c; fixSinCos(a, s, c); return c; }
+
+// fixAtan2 returns the angle of the vector x, y, 0 if both are 0. Any scale works, e.g. two Q30
+// values or the products of Q30 values.
+uint32_t fixAtan2(int64_t y, int64_t x) {
+    uint64_t ax = x < 0 ? -x : x, ay = y < 0 ? -y : y, m = ax > ay ? ax : ay;
+    if (m == 0) return 0;
+    // scale to 2^29..2^30 so small vectors don't lose precision, x grows by the CORDIC gain of
+    // 1.65 to up to 2^31.3 but stays positive so it fits a uint32_t
+    int sh = 0;
+    while (m >= (1u << 30)) { m >>= 1; sh++; }
+    while (m < (1u << 29)) { m <<= 1; sh--; }
+    int64_t x0 = sh >= 0 ? x >> sh : x * ((int64_t)1 << -sh);
+    int32_t yy = sh >= 0 ? y >> sh : y * ((int64_t)1 << -sh);
+    uint32_t z = 0;
+    if (x0 < 0) { // rotate by 180 degrees to start in the right half
+        x0 = -x0;
+        yy = -yy;
+        z = 1u << 31;
+    }
+    uint32_t xx = x0;
+    // rotate towards y=0 by atan(2^-i) each step, without branches, s is -1 if y is below
+    for (int i=0; i<30; i++) {
+        int32_t s = yy >> 31, t = xx >> i;
+        xx += ((yy >> i) ^ s) - s;
+        yy -= (t ^ s) - s;
+        z += (fixAtanTab[i] ^ s) - s;
+    }
+    return z;
+}
+
+// isqrt64 returns the square root of v rounded down, with 32-bit operations if v fits. The root
+// of a Q2n value is Qn, e.g. Q60 to Q30.
+uint32_t isqrt64(uint64_t v) {
+    if (v >> 32 == 0) {
+        uint32_t w = v, r = 0, b = 1u << 30;
+        while (b > w) b >>= 2;
+        for (; b; b >>= 2) {
+            if (w >= r + b) {
+                w -= r + b;
+                r = (r >> 1) + b;
+            } else {
+                r >>= 1;
+            }
+        }
+        return r;
+    }
+    uint64_t r = 0, b = (uint64_t)1 << 62;
+    while (b > v) b >>= 2;
+    for (; b; b >>= 2) {
+        if (v >= r + b) {
+            v -= r + b;
+            r = (r >> 1) + b;
+        } else {
+            r >>= 1;
+        }
+    }
+    return r;
+}
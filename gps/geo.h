@@ -0,0 +1,78 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Fixed-point distances and courses between GPS positions using fixmath.h, cheap enough on the
+// Cortex-M0+ to run on every fix. stepDistance is the equirectangular approximation at the mean
+// latitude for positions up to 10km apart, within 0.01% of the great-circle distance, so a track
+// can add up its length fix by fix. geoDistance and courseTo are the great-circle distance
+// (haversine formula) and initial course between any two positions, e.g. to a waypoint, to the
+// meter and within 0.02 degrees from 100m on (0.1 degrees at 10m). All on a sphere of 6371km,
+// positions are in minutes*1E4 as in NMEAfix.
+
+#pragma once // shared by track.h, simplify.h and fence.h
+
+#include "fixmath.h"
+
+static constexpr int32_t geoDeg = 600000;   // one degree in minutes*1E4
+
+// geoAngle returns the angle of m minutes*1E4 as a binary angle.
+uint32_t geoAngle(int32_t m) {
+    return ((int64_t)m * 333599972 + (1 << 23)) >> 24; // * 2^32 / (360 * 60 * 10000)
+}
+
+// stepDistance returns the distance in mm between two positions up to 10km apart.
+uint32_t stepDistance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) {
+    int32_t dlon = lon2 - lon1;
+    if (dlon > 180*geoDeg) dlon -= 360*geoDeg; // across the antimeridian
+    if (dlon < -180*geoDeg) dlon += 360*geoDeg;
+    // everything is rounded, with a step of a meter or two truncating would shorten a track
+    int64_t dy = (int64_t)(lat2 - lat1) << 8; // in 1/256 of 1E-4 minutes
+    int64_t dx = ((int64_t)dlon * fixCos(geoAngle(lat1/2 + lat2/2)) + (1 << 21)) >> 22;
+    uint64_t d2 = dx*dx + dy*dy;
+    uint32_t d = isqrt64(d2);
+    if (d2 - (uint64_t)d*d > d) d++;
+    return ((uint64_t)d * 47443 + 32768) >> 16; // 1E-4 minutes of a great circle are 185.325mm
+}
+
+// geoDistance returns the great-circle distance in m between two positions.
+uint32_t geoDistance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) {
+    int32_t s1, c1, s2, c2, sy, cy, sx, cx;
+    fixSinCos(geoAngle(lat1), s1, c1);
+    fixSinCos(geoAngle(lat2), s2, c2);
+    fixSinCos((int32_t)geoAngle(lat2 - lat1) / 2, sy, cy);
+    fixSinCos(geoAngle(lon2 - lon1) / 2, sx, cx); // sin^2 is the same across the antimeridian
+    // haversine: a = sin^2(dlat/2) + cos lat1 cos lat2 sin^2(dlon/2), in Q60
+    int64_t cc = ((int64_t)c1 * c2 + (1 << 29)) >> 30;
+    int64_t ccs = (cc * sx + (1 << 29)) >> 30;
+    uint64_t a = (int64_t)sy * sy + ccs * sx;
+    if (a > (uint64_t)1 << 60) a = (uint64_t)1 << 60;
+    // the distance is 2 asin(sqrt(a)) radians, which is 2 sqrt(a) within 2mm up to 12km
+    uint32_t q = isqrt64(a);
+    if (q < 1 << 20) return ((uint64_t)q * 12742000 + (1 << 29)) >> 30; // * 2 * 6371000
+    uint32_t h = fixAtan2(q, isqrt64(((uint64_t)1 << 60) - a)); // up to 90 degrees
+    return ((uint64_t)h * 80060347 + (1u << 31)) >> 32; // * 2 * 2pi * 6371000 / 2^32
+}
+
+// courseTo returns the initial course from the first position to the second in degrees*100
+// (0..35999, north is 0, east 9000) as in NMEAfix, 0 if they're the same.
+uint32_t courseTo(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) {
+    int32_t s1, c1, s2, c2, sy, cy, sx, cx, sh, ch;
+    fixSinCos(geoAngle(lat1), s1, c1);
+    fixSinCos(geoAngle(lat2), s2, c2);
+    fixSinCos(geoAngle(lat2 - lat1), sy, cy);
+    fixSinCos(geoAngle(lon2 - lon1), sx, cx);
+    fixSinCos(geoAngle(lon2 - lon1) / 2, sh, ch);
+    // atan2(sin dlon cos lat2, cos lat1 sin lat2 - sin lat1 cos lat2 cos dlon) with the second
+    // term as sin dlat + 2 sin lat1 cos lat2 sin^2(dlon/2) so nearby positions don't cancel out,
+    // in Q60
+    int64_t y = (int64_t)sx * c2;
+    int64_t scs = (((((int64_t)s1 * c2 + (1 << 29)) >> 30) * sh + (1 << 29)) >> 30) * sh;
+    int64_t x = ((int64_t)sy << 30) + 2 * scs;
+    return (((uint64_t)fixAtan2(y, x) * 36000 + (1u << 31)) >> 32) % 36000;
+}
+
+// cardinal returns the compass point of course in degrees*100, e.g. "NNE".
+const char *cardinal(uint32_t course) {
+    static const char *points[] = { "N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE", "S", "SSW",
+        "SW", "WSW", "W", "WNW", "NW", "NNW" };
+    return points[(course + 1125) / 2250 % 16];
+}
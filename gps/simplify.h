@@ -0,0 +1,126 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// TrackSimplifier thins out a track as the fixes come in so only the points needed to follow it
+// within a maximum cross-track error are kept, e.g. on a straight leg little more than its ends.
+// It's the opening-window algorithm: the last kept point is the anchor and the fixes since then
+// are buffered, as long as all of them are within the error of the segment from the anchor to
+// the newest fix that fix extends the segment, else the fix before it is kept and becomes the
+// anchor. At most M fixes are buffered and the previous fix is kept when the buffer is full, or
+// when the newest fix is more than 6km from the anchor, so the RAM used is fixed (4 bytes per
+// fix) and a point is kept at most M fixes after it came in.
+//
+// Positions are in minutes*1E4 as in NMEAfix. The longitudes are scaled by the cosine of the
+// latitude at the first fix so both axes are in 1E-4 minutes of latitude, 0.1852m, which is
+// plenty accurate over the length of a segment. The distance of a buffered fix is to the segment,
+// not the line through it, so doubling back on a leg isn't lost. T is whatever the caller wants
+// passed through for the kept points, e.g. a LogEntry.
+
+#include "geo.h"
+
+template< typename T, int M=64 >
+struct TrackSimplifier {
+    struct Point { int16_t x, y; }; // position relative to the anchor
+
+    int32_t maxErr;     // cross-track error allowed in 1E-4 minutes
+    int32_t cosLat;     // cosine of the latitude of the first fix, Q15
+    int32_t lat0, lon0; // anchor
+    Point buf[M];       // fixes since the anchor, the last is prev
+    int n;
+    T prev;             // last fix, kept if the next one doesn't fit
+    int32_t prevLat, prevLon;
+    bool started;
+    uint32_t fixes;     // fixes added
+    uint32_t kept;      // fixes kept
+
+    // init starts a new track with a maximum error of meters.
+    void init(int meters) {
+        maxErr = meters * 10000 / 1852;
+        started = false;
+        cosLat = lat0 = lon0 = prevLat = prevLon = 0;
+        prev = T();
+        n = 0;
+        fixes = kept = 0;
+    }
+
+    // add adds the fix e at lat, lon and returns true if a fix is kept, which is copied to out:
+    // the first fix, or the one before e if e doesn't fit the segment.
+    bool add(const T &e, int32_t lat, int32_t lon, T &out) {
+        fixes++;
+        if (!started) {
+            started = true;
+            cosLat = fixCos(geoAngle(lat)) >> 15;
+            anchor(lat, lon);
+            prev = e;
+            prevLat = lat;
+            prevLon = lon;
+            out = e;
+            return true;
+        }
+        // with nothing buffered prev is the anchor and already kept, a fix out of range of it,
+        // e.g. a GPS jump after a cold start, is buffered clamped and kept with the next fix
+        Point p;
+        bool inRange = rel(lat, lon, p);
+        bool keep = n > 0 && (n == M || !inRange || !fits(p));
+        if (keep) {
+            out = prev;
+            anchor(prevLat, prevLon);
+            rel(lat, lon, p); // a jump of more than 6km between two fixes is clamped
+        }
+        buf[n++] = p;
+        prev = e;
+        prevLat = lat;
+        prevLon = lon;
+        return keep;
+    }
+
+    // flush keeps the last fix if it isn't yet, e.g. at the end of the track, and returns true
+    // if it did, copying it to out.
+    bool flush(T &out) {
+        if (n == 0) return false;
+        out = prev;
+        anchor(prevLat, prevLon);
+        return true;
+    }
+
+    // anchor is an internal function to make lat, lon the last kept point.
+    void anchor(int32_t lat, int32_t lon) {
+        lat0 = lat;
+        lon0 = lon;
+        n = 0;
+        kept++;
+    }
+
+    // rel is an internal function to set p to lat, lon relative to the anchor, it returns false
+    // if that's out of range.
+    bool rel(int32_t lat, int32_t lon, Point &p) {
+        int32_t x = (int64_t)(lon - lon0) * cosLat >> 15, y = lat - lat0;
+        bool ok = x >= -32767 && x <= 32767 && y >= -32767 && y <= 32767;
+        p.x = x < -32767 ? -32767 : x > 32767 ? 32767 : x;
+        p.y = y < -32767 ? -32767 : y > 32767 ? 32767 : y;
+        return ok;
+    }
+
+    // fits is an internal function that returns true if all the fixes buffered are within maxErr
+    // of the segment from the anchor to p.
+    bool fits(Point p) {
+        int64_t dx = p.x, dy = p.y, err2 = (int64_t)maxErr * maxErr;
+        int64_t len2 = dx*dx + dy*dy;
+        int64_t len = isqrt64(len2);
+        for (int i=0; i<n; i++) {
+            int64_t qx = buf[i].x, qy = buf[i].y;
+            int64_t dot = qx*dx + qy*dy;
+            if (dot <= 0) {
+                if (qx*qx + qy*qy > err2) return false;     // behind the anchor
+            } else if (dot >= len2) {
+                qx -= dx;
+                qy -= dy;
+                if (qx*qx + qy*qy > err2) return false;     // beyond p
+            } else {
+                int64_t cross = qx*dy - qy*dx;
+                if (cross < 0) cross = -cross;
+                if (cross > maxErr * len) return false;     // off to the side
+            }
+        }
+        return true;
+    }
+};
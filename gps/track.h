@@ -1,8 +1,10 @@
 // Copyright (c) 2018 by Thorsten von Eicken
 //
-// GPS track recorder and optimizer.
+// GPS track recorder and optimizer, see simplify.h for thinning out a track as it's recorded.
 
 #include <jee/util-date.h>
+#include "simplify.h"
+#include "geo.h"
 
 struct Track {
     Track();
@@ -14,15 +16,21 @@ struct Track {
     uint32_t time; // track duration in seconds
 
     long start_t; // start time (secs since 1/1/2000
+    int32_t lat, lon; // last point, minutes*1E4
+    uint32_t dist_mm; // track distance in mm, adding up the steps in m would lose too much
 };
 
-Track::Track() : speed(0), course(0), distance(0), time(0), start_t(0) {
+Track::Track() : speed(0), course(0), distance(0), time(0), start_t(0), lat(0), lon(0),
+    dist_mm(0) {
 }
 
 void Track::addPoint(NMEAfix &nmea) {
     speed = (uint32_t)nmea.knots * 100000 / 19438; // knots -> mm/s (* 0.0514444)
     course = nmea.course;
-    distance = 0;
+    if (start_t != 0) dist_mm += stepDistance(lat, lon, nmea.lat, nmea.lon);
+    lat = nmea.lat;
+    lon = nmea.lon;
+    distance = dist_mm / 1000;
     DateTime now = DateTime(
             nmea.date % 100, (uint8_t)(nmea.date / 10000), (uint8_t)(nmea.date / 100 % 100),
             (uint8_t)(nmea.time / 100), (uint8_t)(nmea.time % 100), (uint8_t)(nmea.msecs/1000));
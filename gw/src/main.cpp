@@ -1,14 +1,25 @@
 // Copyright (c) 2018 by Thorsten von Eicken
 //
 // Test GW to measure performance
+//
+// Everything the GW outputs goes to the host as binary records in frames (see lora/gw-out.h),
+// queued in RAM and fed to the UART from the main loop so a burst of output never holds up
+// receiving and ACKing, `gwhost -d` turns them back into text. Lines printed with printf go out
+// as text records.
 
 int printf(const char* fmt, ...); // forward decl to allow .h files to print for debug
 
 #include <jee.h>
 #include <string.h>
 #include <jee/spi-rf96lora.h>
-
-LoRaConfig &lora_conf = lora_bw125cr47sf10;
+#include "lora/fix-batch.h"
+#include "lora/window.h"
+#include "lora/rate.h"
+#include "lora/duty.h"
+#include "lora/link-stats.h"
+#include "lora/gw-core.h"
+#include "lora/frame.h"
+#include "lora/gw-out.h"
 
 // ===== GPIO pins and hardware peripherals
 
@@ -18,16 +29,36 @@ UartBufDev< PinA<9>, PinA<10>, 80 > console;              // usart1 on FTDI conn
 
 SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinA<4>, 0 > spiRf;   // spi1 with radio select
 RF96lora< decltype(spiRf) > radio;                        // radio driver
+GwCore< decltype(radio) > gw;                             // protocol state
+GwOut< 512 > out;                                         // frames waiting for the UART
 
 // ===== Helper functions for peripherals
 
 // Console
 
+char line[100];     // line being printed
+int lineLen;
+
+// linePutc collects the characters printed into a line and queues it as a text record.
+void linePutc(int c) {
+    if (c == '\r') return;
+    if (c != '\n') line[lineLen++] = c;
+    if (c == '\n' || lineLen == (int)sizeof(line)) {
+        out.text(line, lineLen);
+        lineLen = 0;
+    }
+}
+
 int printf(const char* fmt, ...) {
-    va_list ap; va_start(ap, fmt); veprintf(console.putc, fmt, ap); va_end(ap);
+    va_list ap; va_start(ap, fmt); veprintf(linePutc, fmt, ap); va_end(ap);
     return 0;
 }
 
+// flush waits until the queued frames have gone to the UART, for use outside the main loop.
+void flush() {
+    while (out.avail()) out.drain(console);
+}
+
 // Set-up
 
 void setup() {
@@ -38,41 +69,37 @@ void setup() {
     uint32_t hz = fullSpeedClock();
     console.init();
     console.baud(115200, hz);
+    out.init();
+    console.putc(0); // end whatever the host received so far as a frame
     wait_ms(10);
     printf("\r\n===== Test GW starting ====\r\n\n");
+    flush();
     wait_ms(100);
 
     printf("LoRa radio =====\r\n");
     spiRf.init();
-    radio.init(61, 0xcb, lora_conf, 433600);
+    radio.init(61, 0xcb, *RateCtl::conf(RateCtl::homeSF), 433600);
     radio.txPower(12); // <================================== !
     printf("Noise: %ddB\r\n", radio.noiseFloor());
+    gw.init(radio, 433600);
+    flush();
     led = 1;
 }
 
-int16_t noise = -100;
+uint32_t statsLast = 0;
+static constexpr uint32_t statsInterval = 60000; // ms between node statistics
 
 void loop() {
-    uint8_t packet[256];
-    int len = radio.receive(packet, sizeof(packet));
-    if (len < 2) return; // nothing...
-
-    int16_t r_margin = 0, r_fei = 0;
-    if (len > 4 && packet[1] & 0x80) {
-        r_margin = packet[len-2] & 0x3f;
-        r_fei = packet[len-1]*128;
-        radio.adjustPow(r_margin);
+    out.drain(console);
+    if (ticks - statsLast >= statsInterval) {
+        statsLast = ticks;
+        out.nodes(gw, ticks);
+        out.links(gw);
     }
-
-    uint8_t hdr = 0xC0 | (packet[0]&0x1f); // ACK from GW
-    packet[0] = 0x80; // packet type 0, got info trailer
-    packet[1] = (uint8_t)(-radio.rssi);
-    radio.addInfo(packet+2);
-    radio.send(hdr, packet, 4);
+    int len = gw.poll(ticks);
+    if (len == 0) return;
+    out.packet(gw, len);
     led = 1-led;
-
-    printf("RX %2d from %2d (%02x) %ddB: local %ddB (%ddBm) %dHz, TX @%ddBm\r\n",
-        len, packet[0]&0x1f, packet[0], r_margin, radio.margin, radio.rssi, radio.fei, radio.txpow);
 }
 
 int main () {
@@ -0,0 +1,350 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Linux build of the GW: runs the GW's protocol core (lora/gw-core.h) on packets read from a file
+// or a pipe instead of a radio, e.g. a trace written by `lorabench -t` or the packets another
+// receiver hears, and prints the fixes as they come out followed by the table of nodes. Each line
+// of the input is one packet received: the time in ms, the RSSI in dBm, the margin in dB, and the
+// packet including its header byte in hex. Empty lines and lines starting with # are skipped.
+//
+// Usage: gwhost [-a|-b|-d|-m|-f] [file], reads stdin if there's no file, -a prints the ACKs the GW
+// sends. The fixes are printed as CSV: node, kind (live or fix), date, time, lat, lon, alt, speed,
+// course, sats, hdop, hr.
+//
+// With -b gwhost writes the binary frames the GW board sends over its serial line (see
+// lora/gw-out.h) instead, and with -d it reads such frames, e.g. from the board's serial port,
+// and prints the fixes as above, the packets and node statistics as # comments, and the text
+// lines as they are. With -m it measures the serial output the packets of a trace cause and the
+// packet rate the GW can take, with the old printf text output that waits for the UART and with
+// the frames queued in RAM, at 115200 baud. With -f it tests the framing: records of every length
+// up to Frame::maxRecord must come back out of the Deframer the same, and random bytes on the line
+// must be dropped without overrunning anything, which is best checked built with
+// -fsanitize=address.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lora/sim-radio.h" // LoRaConfig
+#include "lora/fix-batch.h"
+#include "lora/window.h"
+#include "lora/rate.h"
+#include "lora/duty.h"
+#include "lora/link-stats.h"
+#include "lora/gw-core.h"
+#include "lora/frame.h"
+#include "lora/gw-out.h"
+
+// LineRadio has the part of RF96lora's interface GwCore uses and receives the packets from the
+// lines of a file.
+struct LineRadio {
+    FILE *in;
+    bool printAcks;     // print the packets sent
+    LoRaConfig conf;
+    int txpow;          // TX power in dBm
+    int rssi;           // RSSI of the last packet received in dBm
+    int margin;         // margin of the last packet received in dB
+    int fei;            // frequency error, always 0
+    uint32_t at;        // time of the next packet in ms
+    uint8_t buf[256];   // next packet
+    int len;            // its length, 0 if there's none
+    int line;           // line number, for errors
+
+    bool init(uint8_t, uint8_t, LoRaConfig &c, uint32_t) {
+        conf = c;
+        return true;
+    }
+
+    void txPower(int p) { txpow = p; }
+    void adjustPow(int) {}
+
+    void addInfo(uint8_t *b) {
+        b[0] = margin < 0 ? 0 : margin > 63 ? 63 : margin;
+        b[1] = 0;
+    }
+
+    // next reads the next packet and returns false at the end of the input.
+    bool next() {
+        char text[600];
+        while (fgets(text, sizeof(text), in)) {
+            line++;
+            if (text[0] == '#' || text[0] == '\n') continue;
+            unsigned long ms;
+            int r, m, pos;
+            if (sscanf(text, "%lu %d %d %n", &ms, &r, &m, &pos) != 3) {
+                fprintf(stderr, "line %d: bad packet\n", line);
+                continue;
+            }
+            len = 0;
+            unsigned b;
+            for (char *p = text+pos; len < (int)sizeof(buf) && sscanf(p, "%2x", &b) == 1; p += 2)
+                buf[len++] = b;
+            at = ms;
+            rssi = r;
+            margin = m;
+            return true;
+        }
+        return false;
+    }
+
+    // receive returns the packet read by next, once.
+    int receive(uint8_t *b, int max) {
+        int n = len < max ? len : max;
+        memcpy(b, buf, n);
+        len = 0;
+        return n;
+    }
+
+    void send(uint8_t hdr, const uint8_t *b, int l) {
+        if (!printAcks) return;
+        printf("# %u ack %02x", at, hdr);
+        for (int i=0; i<l; i++) printf("%02x", b[i]);
+        printf("\n");
+    }
+};
+
+static LineRadio radio;
+static GwCore< LineRadio > gw;
+
+static void printFix(int node, const char *kind, const int32_t *v) {
+    RadioFix f = FixBatch::fix(v);
+    printf("%d,%s,%06d,%07d,%d,%d,%d,%d,%d,%d,%d,%d\n", node, kind, f.date, f.time, f.lat, f.lon,
+            f.alt, f.speed, f.course, f.sats, f.hdop, f.hr);
+}
+
+static constexpr int outSize = 512; // size of the GW board's output queue
+static GwOut< outSize > out;
+
+// FileUart feeds the GW's output to a file, it's never full.
+struct FileUart {
+    FILE *f;
+    bool writable() { return true; }
+    void putc(int c) { fputc(c, f); }
+};
+
+static uint32_t get32(const uint8_t *b) { return b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24; }
+
+// decode reads frames from in and prints the records in them.
+static int decode(FILE *in) {
+    Deframer d;
+    d.init();
+    uint8_t rec[Frame::maxRecord];
+    uint32_t records = 0, fixes = 0;
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        int n = d.feed(c, rec);
+        if (n == 0) continue;
+        records++;
+        if (rec[0] == out.textRec) {
+            printf("%.*s\n", n-1, (char *)rec+1);
+        } else if (rec[0] == out.packetRec && n >= 12) {
+            uint8_t fl = rec[10];
+            printf("# RX %d from %d: type %02x #%d:%d %ddBm %ddB remote %ddB SF%d, %d fixes%s%s%s%s\n",
+                rec[5], rec[1], rec[2], rec[3], rec[4], -rec[6], (int8_t)rec[7], (int8_t)rec[8],
+                rec[9], rec[11], fl & out.hasLive ? " + live" : "",
+                fl & out.isRebuilt ? ", rebuilt" : "",
+                fl & out.isData && !(fl & out.isFresh) ? ", dup" : "",
+                fl & out.isBad ? ", bad batch" : "");
+        } else if (rec[0] == out.fixRec && n >= 4) {
+            int32_t rows[64][FixBatch::vals];
+            int m = FixBatch::decode(rec+3, n-3, rows, 64);
+            if (m < 0) fprintf(stderr, "bad fix record\n");
+            for (int i=0; i<m; i++) printFix(rec[1], rec[2] ? "live" : "fix", rows[i]);
+            if (m > 0) fixes += m;
+        } else if (rec[0] == out.nodeRec && n >= 31) {
+            printf("# node %d: %d pkts %d dups %d rebuilt %d fixes seq %d:%d SF%d %ddBm %ddB "
+                "(p10 %ddB, p50 %ddB) remote %ddB %ds ago\n", rec[1], get32(rec+2), get32(rec+6),
+                get32(rec+10), get32(rec+14), rec[18], rec[19], rec[20],
+                (int16_t)(rec[21] | rec[22] << 8), (int8_t)rec[23], rec[29], rec[30],
+                (int8_t)rec[24], get32(rec+25));
+        } else if (rec[0] == out.linkRec && n >= 11) {
+            printf("# SF%d: margin p10/50/90 %d/%d/%ddB, RSSI %d/%d/%ddBm, FEI p50 %dHz, %d%% dups\n",
+                rec[1], rec[2], rec[3], rec[4], -rec[5], -rec[6], -rec[7],
+                (int16_t)(rec[8] | rec[9] << 8), rec[10]);
+        } else {
+            fprintf(stderr, "unknown record %02x of %d bytes\n", rec[0], n);
+        }
+    }
+    printf("# %d records, %d fixes, %d bad frames\n", records, fixes, d.bad);
+    return 0;
+}
+
+// oldText returns the number of characters the GW's printf output used to have for the packet
+// it just received, rxLen is what poll returned.
+static int oldText(int rxLen) {
+    char b[200];
+    int n = 0;
+    if (gw.data && gw.fixes < 0)
+        return snprintf(b, sizeof(b), "RX %2d from %2d: bad batch\r\n", rxLen, gw.node);
+    if (gw.data) {
+        n += snprintf(b, sizeof(b), "RX #%d from %2d: %d fixes%s%s%s\r\n", gw.packet[3], gw.node,
+            gw.fixes, gw.live ? " + live" : "", gw.recovered ? ", rebuilt" : "",
+            gw.fresh ? "" : ", dup");
+        for (int i=0; i<gw.fixes+gw.live; i++) {
+            RadioFix f = FixBatch::fix(i < gw.fixes ? gw.rows[i] : gw.liveRow);
+            n += snprintf(b, sizeof(b),
+                "  %s %06d %07d %d %d alt=%d spd=%d crs=%d sats=%d hdop=%d hr=%d\r\n",
+                i < gw.fixes ? "fix" : "live", f.date, f.time, f.lat, f.lon, f.alt, f.speed,
+                f.course, f.sats, f.hdop, f.hr);
+        }
+    }
+    n += snprintf(b, sizeof(b), "RX %2d from %2d (%02x) %ddB: local %ddB (%ddBm) %dHz, TX @%ddBm, SF%d\r\n",
+        rxLen, gw.node, gw.packet[1], gw.margin, radio.margin, radio.rssi, radio.fei, radio.txpow, gw.listenSF);
+    return n;
+}
+
+// measure runs the packets through the GW and models its serial output at 115200 baud, 10 bits
+// per byte, both ways on the same packets. With printf the GW waits whenever the UART's 80-byte
+// buffer is full, so a packet that comes in meanwhile waits in the radio, and is ACKed too late
+// if that's more than the tracker's 100ms ACK wait, and a second one is lost. With the frames
+// queued the GW never waits, a frame is dropped if the queue is full. The capacity is the packet
+// rate at which the UART keeps up with the output.
+static int measure() {
+    const double bytesPerMs = 11.52;
+    const int uartBuf = 80;
+    uint32_t packets = 0, fixes = 0;
+    uint64_t textBytes = 0, frameBytes = 0;
+    double last = 0;
+    double queued = 0, busyUntil = 0, stall = 0; // printf: bytes in the UART, GW busy until
+    uint32_t late = 0, lost = 0;
+    bool waiting = false;
+    double ring = 0, maxRing = 0; // frames: bytes in the queue and the UART
+    while (radio.next()) {
+        double t = radio.at;
+        double drained = (t - last) * bytesPerMs;
+        last = t;
+        int len = gw.poll(radio.at);
+        if (len == 0) continue;
+        packets++;
+        if (gw.data && gw.fixes >= 0) fixes += gw.fixes + gw.live;
+
+        // printf: the GW gets to the packet when it's done printing the previous ones
+        if (t < busyUntil) {
+            if (waiting) lost++;
+            else if (busyUntil - t > 100) late++;
+            waiting = true;
+        } else {
+            waiting = false;
+        }
+        double start = t > busyUntil ? t : busyUntil;
+        queued -= drained;
+        if (queued < 0) queued = 0;
+        int n = oldText(len);
+        textBytes += n;
+        queued += n;
+        if (queued > uartBuf) {
+            double w = (queued - uartBuf) / bytesPerMs;
+            busyUntil = start + w;
+            stall += w;
+            queued = uartBuf;
+        }
+
+        // frames: queued in RAM, only the fill level matters
+        ring -= drained;
+        if (ring < 0) ring = 0;
+        int h = out.head;
+        uint32_t f = out.frames;
+        out.packet(gw, len);
+        int m = (out.head - h + outSize) % outSize;
+        out.tail = out.head;
+        frameBytes += m;
+        if (ring + m > outSize) out.dropped += out.frames - f; // all of them, roughly
+        else ring += m;
+        if (ring > maxRing) maxRing = ring;
+    }
+    double tb = packets ? (double)textBytes/packets : 0, fb = packets ? (double)frameBytes/packets : 0;
+    printf("%d packets, %d fixes in %.0fs\n", packets, fixes, last/1000);
+    printf("printf: %.1f bytes/packet, capacity %.1f packets/s, GW waited %.1fs, "
+        "%d packets ACKed late, %d lost\n", tb, tb ? bytesPerMs*1000/tb : 0, stall/1000, late, lost);
+    printf("frames: %.1f bytes/packet, capacity %.1f packets/s, GW waited 0s, "
+        "queue max %.0f of %d bytes, %d frames dropped\n", fb, fb ? bytesPerMs*1000/fb : 0,
+        maxRing, outSize, out.dropped);
+    return 0;
+}
+
+// testFrames round-trips records of every length through Frame::encode and a Deframer, with
+// random bytes, all zeros and no zeros, checks that a longer record is refused, and feeds a
+// megabyte of noise to a Deframer, of which a frame passes the CRC once in 65536 or so. It
+// returns 1 if a record didn't come back right.
+static int testFrames() {
+    uint32_t seed = 1;
+    int errs = 0;
+    Deframer d;
+    d.init();
+    uint8_t rec[Frame::maxRecord+1], f[Frame::maxFrame], got[Frame::maxRecord];
+    for (int kind=0; kind<3; kind++)
+        for (int len=0; len<=Frame::maxRecord; len++) {
+            for (int i=0; i<len; i++) {
+                seed = seed * 1103515245 + 12345;
+                rec[i] = kind == 0 ? seed >> 16 : kind == 1 ? 0 : 1 + (seed >> 16) % 255;
+            }
+            int n = Frame::encode(rec, len, f), m = 0;
+            if (n == 0 || n > Frame::maxFrame) {
+                errs++;
+                continue;
+            }
+            for (int i=0; i<n; i++) {
+                int r = d.feed(f[i], got);
+                if (r > 0) m = r;
+            }
+            // an empty record can't be told from an empty frame, it isn't used
+            if (len > 0 && (m != len || memcmp(rec, got, len) != 0)) errs++;
+        }
+    if (Frame::encode(rec, Frame::maxRecord+1, f) != 0) errs++;
+    uint32_t decoded = 0;
+    d.init();
+    for (int i=0; i<1000000; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint8_t c = seed >> 16;
+        if (c < 2) c = 0; // a frame every 128 bytes on average
+        if (d.feed(c, got) > 0) decoded++;
+    }
+    printf("framing: %d records of up to %d bytes round-tripped, %d wrong, noise decoded into "
+        "%d records, %d frames dropped%s\n", 3*Frame::maxRecord, Frame::maxRecord, errs, decoded,
+        d.bad, errs ? "  ERR" : "");
+    return errs ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+    int a = 1;
+    char mode = argc > a && argv[a][0] == '-' ? argv[a++][1] : 0;
+    if (mode == 'f') return testFrames();
+    radio.printAcks = mode == 'a';
+    radio.in = argc > a ? fopen(argv[a], mode == 'd' ? "rb" : "r") : stdin;
+    if (!radio.in) {
+        fprintf(stderr, "cannot open %s\n", argv[a]);
+        return 1;
+    }
+    if (mode == 'd') return decode(radio.in);
+    gw.init(radio, 433600);
+    out.init();
+    if (mode == 'm') return measure();
+    FileUart uart = { stdout };
+
+    uint32_t packets = 0, fixes = 0, bad = 0;
+    while (radio.next()) {
+        packets++;
+        int len = gw.poll(radio.at);
+        if (mode == 'b' && len > 0) {
+            out.packet(gw, len);
+            out.drain(uart);
+        }
+        if (len == 0 || !gw.data || mode == 'b') continue;
+        if (gw.fixes < 0) {
+            bad++;
+            continue;
+        }
+        if (gw.live) printFix(gw.node, "live", gw.liveRow);
+        for (int i=0; i<gw.fixes; i++) printFix(gw.node, "fix", gw.rows[i]);
+        fixes += gw.fixes + gw.live;
+    }
+
+    if (mode == 'b') {
+        out.nodes(gw, radio.at);
+        out.links(gw);
+        out.drain(uart);
+        return 0;
+    }
+    printf("# %d packets, %d fixes, %d bad batches\n", packets, fixes, bad);
+    gw.printNodes(radio.at);
+    return 0;
+}
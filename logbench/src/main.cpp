@@ -0,0 +1,547 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Logger benchmark, runs the flash logger on the host against a simulated W25Q128 and reports
+// throughput plus SPI, erase and EEPROM traffic per 1000 entries.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "logger/sim-flash.h"
+
+// host stand-in for JeeH's NMEAfix, same field sizes
+struct NMEAfix {
+    uint32_t date;      // DDMMYY
+    uint16_t time;      // HHMM
+    uint16_t msecs;     // SSsss
+    int32_t lat, lon;   // minutes*1E4
+    int32_t alt;        // m*10
+    uint16_t knots;     // knots*100
+    uint16_t course;    // degrees*100
+    uint16_t hdop;      // *100
+    uint8_t sats;
+};
+
+// same as track1
+typedef struct {
+    NMEAfix fix;
+    uint8_t hr;
+} LogEntry;
+#include "logger/logger.h"
+#include "logger/packed-logger.h"
+#include "logger/fix-fields.h"
+
+Logger< SimFlash > logger;                  // writes each entry straight to flash
+Logger< SimFlash, true > loggerBuf;         // collects entries in a page buffer
+PackedLogger< SimFlash, FixFields > loggerPacked; // compressed variable-length records
+PackedLogger< SimFlash, FixFields, 2 > loggerTwo; // uplink and download readers
+typedef SimFlashT<64> SmallFlash;           // 16 sectors, to fill the flash quickly
+PackedLogger< SmallFlash, FixFields, 2 > loggerSmall;
+
+// ===== Helpers
+
+static uint64_t hostNsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// makeEntry produces the i-th fix of a synthetic 1Hz track heading NE at ~8 knots, with a bit
+// of jitter in the position like a real GPS
+static void makeEntry(int i, LogEntry &le) {
+    memset(&le, 0, sizeof(le));
+    le.fix.date = 10718;
+    le.fix.time = 1200 + (i/60)%60 + (i/3600)*100;
+    le.fix.msecs = (i%60)*1000;
+    le.fix.lat = 21*600000 + 1234*i + (i*7)%5 - 2;
+    le.fix.lon = -157*600000 + 987*i + (i*3)%5 - 2;
+    le.fix.alt = 15 + i%7;
+    le.fix.knots = 800 + i%50;
+    le.fix.course = 4500 + (i*37)%300;
+    le.fix.hdop = 90 + i%20;
+    le.fix.sats = 9;
+    le.hr = 120 + i%30;
+}
+
+static bool checkEntry(int i, LogEntry &le) {
+    LogEntry exp;
+    makeEntry(i, exp);
+    return memcmp(&exp, &le, sizeof(le)) == 0;
+}
+
+// OpStat tracks the simulated time taken by one kind of operation
+struct OpStat {
+    const char* name;
+    uint32_t count;
+    uint64_t usecs, maxUsecs;
+    uint64_t hostNs;
+
+    void add(uint64_t us, uint64_t ns) {
+        count++;
+        usecs += us;
+        if (us > maxUsecs) maxUsecs = us;
+        hostNs += ns;
+    }
+    void print() {
+        if (count == 0) return;
+        printf("  %-12s %7d ops  avg %6dus  max %6dus  %8d ops/s sim  %6dns host\n",
+                name, count, (int)(usecs/count), (int)maxUsecs,
+                usecs ? (int)(count*1000000ull/usecs) : 0, (int)(hostNs/count));
+    }
+};
+
+static OpStat opPush, opFirst, opShift;
+static int errors;
+
+template< typename LOG >
+static void doPush(LOG &logger, int i) {
+    LogEntry le;
+    makeEntry(i, le);
+    uint64_t t0 = SimClock::usecs, h0 = hostNsecs();
+    logger.pushEntry(le);
+    opPush.add(SimClock::usecs - t0, hostNsecs() - h0);
+}
+
+// waitIdle lets a background erase finish as if the main loop were doing other work
+template< typename LOG >
+static void waitIdle(LOG &logger) {
+    while (logger.busy()) {
+        SimClock::advance(100);
+        logger.poll();
+    }
+}
+
+template< typename LOG >
+static void doFirstShift(LOG &logger, int i) {
+    LogEntry le;
+    waitIdle(logger);
+    uint64_t t0 = SimClock::usecs, h0 = hostNsecs();
+    bool ok = logger.firstEntry(&le);
+    opFirst.add(SimClock::usecs - t0, hostNsecs() - h0);
+    if (!ok || !checkEntry(i, le)) {
+        if (errors++ < 10) printf("ERR[%d]: %s\n", i, ok ? "mismatch" : "empty");
+    }
+    t0 = SimClock::usecs; h0 = hostNsecs();
+    logger.shiftEntry();
+    opShift.add(SimClock::usecs - t0, hostNsecs() - h0);
+}
+
+template< typename LOG >
+static void reset(LOG &logger) {
+    SimFlash::init();
+    memset(EEPROM::mem, 0, sizeof(EEPROM::mem));
+    logger.init(32);
+    SimFlash::stats.clear();
+    memset(&opPush, 0, sizeof(opPush)); opPush.name = "pushEntry";
+    memset(&opFirst, 0, sizeof(opFirst)); opFirst.name = "firstEntry";
+    memset(&opShift, 0, sizeof(opShift)); opShift.name = "shiftEntry";
+    errors = 0;
+}
+
+static void report(const char* name, int entries) {
+    SimStats &s = SimFlash::stats;
+    printf("== %s: %d entries of %d bytes, %d errors\n", name, entries, (int)sizeof(LogEntry), errors);
+    opPush.print();
+    opFirst.print();
+    opShift.print();
+    double k = 1000.0 / entries;
+    printf("  per 1000 entries: %.0f SPI txns, %.0f SPI bytes, %.0f reads, %.0f programs, "
+            "%.1f erases, %.1f EEPROM writes, %.0fms busy\n",
+            s.spiTxns*k, s.spiBytes*k, s.reads*k, s.programs*k, s.erases*k, s.eepromWrites*k,
+            s.busyUsecs*k/1000);
+    if (s.stalls) printf("  %d flash accesses stalled by an erase\n", s.stalls);
+    if (s.overwrites || s.pageWraps)
+        printf("  ERR: %d bytes programmed without erase, %d page wraps\n", s.overwrites, s.pageWraps);
+    printf("\n");
+}
+
+// ===== Benchmarks
+
+// steady state: the uplink keeps up, each entry is pushed and then sent and shifted
+template< typename LOG >
+static void benchSteady(LOG &logger, const char* name, int n) {
+    reset(logger);
+    for (int i=0; i<n; i++) {
+        doPush(logger, i);
+        doFirstShift(logger, i);
+    }
+    report(name, n);
+}
+
+// backlog: n entries accumulate (e.g. out of radio range) and are then drained
+template< typename LOG >
+static void benchBacklog(LOG &logger, const char* name, int n) {
+    reset(logger);
+    for (int i=0; i<n; i++) doPush(logger, i);
+    for (int i=0; i<n; i++) doFirstShift(logger, i);
+    report(name, n);
+}
+
+// bulk backlog: like backlog but drained in batches using readEntries/shiftEntries
+template< typename LOG >
+static void benchBulk(LOG &logger, const char* name, int n, int batch) {
+    reset(logger);
+    for (int i=0; i<n; i++) doPush(logger, i);
+    LogEntry les[batch];
+    for (int i=0; i<n; ) {
+        waitIdle(logger);
+        uint64_t t0 = SimClock::usecs, h0 = hostNsecs();
+        int got = logger.readEntries(les, batch, 0);
+        opFirst.add(SimClock::usecs - t0, hostNsecs() - h0);
+        if (got == 0 && errors++ < 10) printf("ERR[%d]: empty\n", i);
+        for (int j=0; j<got; j++)
+            if (!checkEntry(i+j, les[j]) && errors++ < 10) printf("ERR[%d]: mismatch\n", i+j);
+        t0 = SimClock::usecs; h0 = hostNsecs();
+        logger.shiftEntries(got);
+        opShift.add(SimClock::usecs - t0, hostNsecs() - h0);
+        i += got > 0 ? got : 1;
+    }
+    opFirst.name = "readEntries";
+    opShift.name = "shiftEntries";
+    report(name, n);
+}
+
+// recovery: entries are logged with an uplink that falls behind, then the tracker "crashes"
+// (the logger is re-initialized from eeprom and flash without a flush, optionally with the
+// eeprom contents lost) and the log is checked: it must hold consecutive entries ending with
+// the last one that made it into flash.
+template< typename LOG >
+static void benchRecovery(LOG &logger, const char* name, int n, bool loseEeprom) {
+    reset(logger);
+    for (int i=0; i<n; i++) {
+        doPush(logger, i);
+        if (i%3 == 0) doFirstShift(logger, i/3);
+    }
+    waitIdle(logger);
+    int sent = (n+2)/3, cnt = logger.count();
+    uint64_t t0 = SimClock::usecs;
+    SimFlash::stats.clear();
+    if (loseEeprom) memset(EEPROM::mem, 0, sizeof(EEPROM::mem));
+    logger.init(32);
+    uint64_t boot = SimClock::usecs - t0;
+    SimStats bs = SimFlash::stats;
+    int resend = 0, lost = 0, last = -1;
+    for (int k = 0; logger.count() > 0; k++) {
+        LogEntry le = {};
+        waitIdle(logger);
+        if (!logger.firstEntry(&le)) break;
+        int i = (le.fix.lat - 21*600000 + 617) / 1234;
+        if (k == 0) resend = sent - i;
+        else if (i != last+1 && errors++ < 10) printf("ERR[%d]: got %d\n", last+1, i);
+        if (!checkEntry(i, le) && errors++ < 10) printf("ERR[%d]: mismatch\n", i);
+        last = i;
+        logger.shiftEntry();
+    }
+    lost = n-1 - last;
+    printf("== %s: %d pushed, %d sent, %d queued at crash, %d errors\n", name, n, sent, cnt, errors);
+    printf("  boot %dms with %d flash reads and %d EEPROM writes, %d entries to re-send, "
+            "%d unflushed entries lost\n\n", (int)(boot/1000), bs.reads, bs.eepromWrites,
+            resend, lost);
+}
+
+// checkLog reads the whole log without shifting and verifies that it holds consecutive entries,
+// numbered in fix.date, ending with last. Returns the number of entries.
+template< typename LOG >
+static int checkLog(LOG &logger, uint32_t last) {
+    LogEntry les[64];
+    int cnt = logger.count();
+    uint32_t exp = last+1 - cnt;
+    for (int i=0; i<cnt; ) {
+        waitIdle(logger);
+        int got = logger.readEntries(les, 64, i);
+        if (got == 0) {
+            if (errors++ < 10) printf("ERR[%d]: empty\n", i);
+            break;
+        }
+        for (int j=0; j<got; j++, exp++)
+            if (les[j].fix.date != exp && errors++ < 10)
+                printf("ERR[%d]: got %d expected %d\n", i+j, les[j].fix.date, exp);
+        i += got;
+    }
+    return cnt;
+}
+
+// wrap: fills the full flash laps times over with per entries each without anything being sent,
+// so the oldest sector keeps getting dropped, and checks the log after each lap, after a crash
+// and after losing the eeprom. The entries held after a lap are the capacity of the flash.
+template< typename LOG >
+static void benchWrap(LOG &logger, const char* name, int laps, int per) {
+    reset(logger);
+    int n = laps * per;
+    printf("== %s: %d laps of %d entries, %d sectors\n", name, laps, per, logger.sectors);
+    uint32_t i = 0;
+    for (int lap=0; lap<laps; lap++) {
+        for (int k=0; k<per; k++, i++) {
+            LogEntry le;
+            makeEntry(i, le);
+            le.fix.date = i;
+            uint64_t t0 = SimClock::usecs, h0 = hostNsecs();
+            logger.pushEntry(le);
+            opPush.add(SimClock::usecs - t0, hostNsecs() - h0);
+        }
+        int cnt = checkLog(logger, i-1);
+        printf("  lap %d: %d entries, %d sectors dropped\n", lap, cnt, logger.dropped);
+    }
+    logger.flush();
+    int cnt = logger.count();
+    logger.init(32);
+    printf("  crash: %d entries before, %d after\n", cnt, checkLog(logger, i-1));
+    memset(EEPROM::mem, 0, sizeof(EEPROM::mem));
+    logger.init(32);
+    printf("  eeprom lost: %d entries after\n", checkLog(logger, i-1));
+    report(name, n);
+}
+
+// header crash: the power goes out after the header of a new sector was programmed but before
+// its first entry, which is simulated by erasing that entry again. The logger restarts from
+// eeprom, logs some more, and restarts without the eeprom, which needs the sector headers to be
+// intact. Only for Logger, PackedLogger has no per-sector headers.
+template< typename LOG >
+static void benchHdrCrash(LOG &logger, const char* name) {
+    reset(logger);
+    uint32_t i = 0;
+    for (; i < (uint32_t)LOG::perSect+1; i++) {
+        LogEntry le;
+        makeEntry(i, le);
+        le.fix.date = i;
+        logger.pushEntry(le);
+    }
+    logger.flush();
+    memset(SimFlash::mem + LOG::addrOf(LOG::perSect), 0xff, sizeof(LogEntry));
+    i--;
+    logger.init(32);
+    for (int k=0; k<100; k++, i++) {
+        LogEntry le;
+        makeEntry(i, le);
+        le.fix.date = i;
+        logger.pushEntry(le);
+    }
+    logger.flush();
+    int cnt = logger.count();
+    memset(EEPROM::mem, 0, sizeof(EEPROM::mem));
+    logger.init(32);
+    printf("== %s: %d entries before, %d after, %d errors\n", name, cnt, checkLog(logger, i-1),
+            errors);
+    if (SimFlash::stats.overwrites)
+        printf("  ERR: %d bytes programmed without erase\n", SimFlash::stats.overwrites);
+    printf("\n");
+}
+
+// seek: a long track is logged and then entries are looked up by time using seek followed by
+// readEntries, as a download of one session would start. Reports the flash traffic per lookup.
+template< typename LOG >
+static void benchSeek(LOG &logger, const char* name, int n, int seeks) {
+    reset(logger);
+    for (int i=0; i<n; i++) doPush(logger, i);
+    waitIdle(logger);
+    LogEntry le;
+    int32_t f[FixFields::count];
+    makeEntry(0, le);
+    FixFields::split(le, f);
+    uint32_t t0 = FixFields::time(f);
+    int span = logger.next.addr - logger.readers[0].pos.addr;
+    SimFlash::stats.clear();
+    uint64_t sum = 0;
+    for (int k=0; k<seeks; k++) {
+        int i = (k * 7919 + 13) % n;
+        sum += i;
+        uint64_t u0 = SimClock::usecs, h0 = hostNsecs();
+        int skip = logger.seek(t0 + i);
+        bool ok = logger.readEntries(&le, 1, skip) == 1;
+        opFirst.add(SimClock::usecs - u0, hostNsecs() - h0);
+        if ((skip != i || !ok || !checkEntry(i, le)) && errors++ < 10)
+            printf("ERR[%d]: seek got %d\n", i, skip);
+    }
+    opFirst.name = "seek+read";
+    SimStats &s = SimFlash::stats;
+    printf("== %s: %d lookups in %d entries (%dKB of flash), %d errors\n",
+            name, seeks, n, span/1024, errors);
+    opFirst.print();
+    printf("  per lookup: %.1f reads, %.0f SPI bytes, walking from first would read %.0fKB\n\n",
+            (double)s.reads/seeks, (double)s.spiBytes/seeks, (double)span*sum/n/seeks/1024);
+}
+
+// readers: a backlog of n entries builds up while the gateway is out of reach, then the uplink
+// drains it one entry per ACK while fixes keep coming once a second, and at the same time a
+// serial download reads everything in chunks of 64 through a second reader. Each reader must see
+// every entry exactly once and in order. Reports the flash traffic per entry read.
+template< typename LOG >
+static void benchReaders(LOG &logger, const char* name, int n) {
+    reset(logger);
+    logger.setReader(0, "uplink", false);
+    logger.setReader(1, "download", false);
+    for (int i=0; i<n; i++) doPush(logger, i);
+    waitIdle(logger);
+    SimFlash::stats.clear();
+    constexpr uint32_t airtime = 400000; // send+ACK at SF10
+    constexpr uint32_t chunkTime = 64 * 40 * 10 * 1000000ull / 115200; // 64 entries as text
+    uint64_t nextFix = SimClock::usecs, radioDone = 0, serialDone = 0;
+    int pushed = n, up = 0, down = 0;
+    bool radioBusy = false;
+    while (up < pushed || down < pushed) {
+        if (SimClock::usecs >= nextFix && up < pushed) {
+            doPush(logger, pushed++);
+            nextFix += 1000000;
+        }
+        logger.poll();
+        LogEntry les[64];
+        if (radioBusy && SimClock::usecs >= radioDone) {
+            logger.shiftEntry(0);
+            up++;
+            radioBusy = false;
+        }
+        if (!radioBusy && logger.count(0) > 0 && logger.firstEntry(les, 0)) {
+            if (!checkEntry(up, les[0]) && errors++ < 10) printf("ERR[%d]: uplink mismatch\n", up);
+            radioBusy = true;
+            radioDone = SimClock::usecs + airtime;
+        }
+        if (SimClock::usecs >= serialDone && logger.count(1) > 0) {
+            int got = logger.readEntries(les, 64, 0, 1);
+            for (int j=0; j<got; j++)
+                if (!checkEntry(down+j, les[j]) && errors++ < 10)
+                    printf("ERR[%d]: download mismatch\n", down+j);
+            logger.shiftEntries(got, 1);
+            down += got;
+            serialDone = SimClock::usecs + chunkTime;
+        }
+        SimClock::advance(10000);
+    }
+    if (logger.count(0) != 0 || logger.count(1) != 0) errors++;
+    SimStats &s = SimFlash::stats;
+    printf("== %s: %d backlog + %d live entries, uplink got %d, download got %d, %d errors\n",
+            name, n, pushed-n, up, down, errors);
+    printf("  per entry read: %.2f reads, %.1f SPI bytes, %d EEPROM writes in all\n\n",
+            (double)s.reads/(up+down), (double)s.spiBytes/(up+down), s.eepromWrites);
+}
+
+// full: the flash fills up while the uplink keeps up but a download reader isn't being read.
+// If the download holds its entries new ones are refused once the flash is full and are
+// accepted again after it has read everything, else the oldest entries are dropped and the
+// download is told how many it lost. Either way what it reads must be consecutive entries.
+template< typename LOG >
+static void benchFull(LOG &logger, const char* name, bool holds) {
+    SmallFlash::init();
+    reset(logger);
+    logger.setReader(0, "uplink", false);
+    logger.setReader(1, "download", holds);
+    int n = 30000, accepted = 0; // about 3 times what the flash holds
+    for (int i=0; i<n; i++) {
+        LogEntry le;
+        makeEntry(i, le);
+        if (logger.pushEntry(le)) accepted++;
+        logger.shiftEntry(0);
+        SimClock::advance(50000);
+        logger.poll();
+    }
+    int held = logger.count(1), first = logger.readers[1].dropped;
+    int i = first;
+    while (logger.count(1) > 0) {
+        LogEntry les[64];
+        waitIdle(logger);
+        int got = logger.readEntries(les, 64, 0, 1);
+        for (int j=0; j<got; j++, i++)
+            if (!checkEntry(i, les[j]) && errors++ < 10) printf("ERR[%d]: download mismatch\n", i);
+        logger.shiftEntries(got, 1);
+    }
+    if (i != accepted) errors++;
+    LogEntry le;
+    makeEntry(n, le);
+    bool again = logger.pushEntry(le);
+    printf("== %s: %d pushed, %d refused, download held %d and lost %d, "
+            "push after download %s, %d errors\n\n",
+            name, n, logger.refused, held, first, again ? "OK" : "refused", errors);
+}
+
+// mainLoop simulates track1's main loop for n seconds: a fix is logged every second, the uplink
+// sends the first entry whenever the radio is idle and shifts it on ACK, and each iteration does
+// 1ms of other work. It reports the worst-case time the logger adds to one loop iteration,
+// which is what determines whether the 200-byte GPS uart buffer (52ms at 38400 baud) overflows.
+// With lowBat set the page buffer is flushed every 500ms as track1 does when the battery is low.
+template< typename LOG >
+static void benchMainLoop(LOG &logger, const char* name, int n, bool blocking,
+        bool lowBat=false) {
+    reset(logger);
+    SimFlash::blockingErase = blocking;
+    constexpr uint32_t airtime = 400000; // send+ACK at SF10
+    constexpr uint32_t uartFill = 200 * 10 * 1000000 / 38400;
+    uint64_t start = SimClock::usecs, nextFix = start, nextFlush = start, radioDone = 0;
+    bool radioBusy = false;
+    int pushed = 0, sent = 0;
+    uint32_t iters = 0, overruns = 0;
+    uint64_t maxLat = 0, sumLat = 0;
+    while (pushed < n) {
+        uint64_t t0 = SimClock::usecs;
+        if (SimClock::usecs >= nextFix) {
+            LogEntry le;
+            makeEntry(pushed++, le);
+            logger.pushEntry(le);
+            nextFix += 1000000;
+        }
+        logger.poll();
+        if (lowBat && SimClock::usecs >= nextFlush) {
+            logger.flushIdle();
+            nextFlush += 500000;
+        }
+        if (radioBusy && SimClock::usecs >= radioDone) {
+            logger.shiftEntry();
+            sent++;
+            radioBusy = false;
+        }
+        LogEntry le;
+        if (!radioBusy && logger.count() > 0 && logger.firstEntry(&le)) {
+            if (!checkEntry(sent, le) && errors++ < 10) printf("ERR[%d]: mismatch\n", sent);
+            radioBusy = true;
+            radioDone = SimClock::usecs + airtime;
+        }
+        uint64_t lat = SimClock::usecs - t0;
+        if (lat > maxLat) maxLat = lat;
+        if (lat > uartFill) overruns++;
+        sumLat += lat;
+        iters++;
+        SimClock::advance(1000);
+    }
+    SimStats &s = SimFlash::stats;
+    printf("== %s, %s erase: %d fixes, %d sent, %d errors\n",
+            name, blocking ? "blocking" : "background", n, sent, errors);
+    printf("  logger time per loop iteration: avg %dus, max %dus, %d iterations over %dus "
+            "(GPS uart overrun)\n", (int)(sumLat/iters), (int)maxLat, overruns, uartFill);
+    printf("  %d erases, %d flash accesses stalled by an erase, %d SPI txns, %d programs\n\n",
+            s.erases, s.stalls, s.spiTxns, s.programs);
+    SimFlash::blockingErase = false;
+}
+
+int main() {
+    printf("===== Logger benchmark, simulated %dKB flash, SPI at %dMHz\n\n",
+            SimFlash::size(), SimFlash::spiHz/1000000);
+
+    benchSteady(logger, "steady push/first/shift", 10000);
+    benchSteady(loggerBuf, "steady push/first/shift, page buffer", 10000);
+    benchSteady(loggerPacked, "steady push/first/shift, packed", 10000);
+    benchBacklog(logger, "backlog push then drain", 500);
+    benchBacklog(loggerBuf, "backlog push then drain, page buffer", 500);
+    benchBacklog(loggerPacked, "backlog push then drain, packed", 500);
+    benchBulk(logger, "backlog push then bulk drain by 16", 500, 16);
+    benchBulk(loggerBuf, "backlog push then bulk drain by 16, page buffer", 500, 16);
+    benchBulk(loggerPacked, "backlog push then bulk drain by 16, packed", 500, 16);
+    benchRecovery(logger, "crash recovery", 603, false);
+    benchRecovery(loggerBuf, "crash recovery, page buffer", 603, false);
+    benchRecovery(logger, "crash recovery, eeprom lost", 603, true);
+    benchRecovery(loggerPacked, "crash recovery, packed", 3003, false);
+    benchRecovery(loggerPacked, "crash recovery, packed, eeprom lost", 3003, true);
+    benchWrap(logger, "full flash wrap", 5, logger.total + 12345); // laps end at different places
+    benchWrap(loggerBuf, "full flash wrap, page buffer", 5, loggerBuf.total + 12345);
+    benchWrap(loggerPacked, "full flash wrap, packed", 3, 2300000);
+    benchHdrCrash(logger, "crash after a sector header");
+    benchHdrCrash(loggerBuf, "crash after a sector header, page buffer");
+    benchSeek(loggerPacked, "seek by time, packed", 500000, 1000);
+    benchReaders(loggerTwo, "uplink and download readers, packed", 20000);
+    benchFull(loggerSmall, "full flash, download drops, packed 64KB", false);
+    benchFull(loggerSmall, "full flash, download holds, packed 64KB", true);
+    benchMainLoop(logger, "main loop", 3600, true);
+    benchMainLoop(logger, "main loop", 3600, false);
+    benchMainLoop(loggerBuf, "main loop, page buffer", 3600, false);
+    benchMainLoop(loggerPacked, "main loop, packed", 3600, false);
+    benchMainLoop(loggerPacked, "main loop, packed, low battery", 3600, false, true);
+
+    return 0;
+}
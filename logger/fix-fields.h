@@ -0,0 +1,42 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// FixFields tells PackedLogger how to split a LogEntry holding an NMEAfix and a heart rate into
+// the integer fields it compresses, see packed-logger.h, and into the values sent over the radio,
+// see lora/fix-batch.h. It has to be included after LogEntry is defined.
+
+#include "gps/date.h"
+
+struct FixFields {
+    static constexpr int count = 11;
+    static constexpr uint32_t linear = 0x1e; // time, msecs, lat, lon
+
+    static void split(const LogEntry &le, int32_t *f) {
+        const NMEAfix &x = le.fix;
+        int32_t v[count] = { (int32_t)x.date, x.time, x.msecs, x.lat, x.lon, x.alt, x.knots,
+            x.course, x.hdop, x.sats, le.hr };
+        memcpy(f, v, sizeof(v));
+    }
+
+    static void join(const int32_t *f, LogEntry &le) {
+        memset(&le, 0, sizeof(le));
+        NMEAfix &x = le.fix;
+        x.date = f[0]; x.time = f[1]; x.msecs = f[2]; x.lat = f[3]; x.lon = f[4]; x.alt = f[5];
+        x.knots = f[6]; x.course = f[7]; x.hdop = f[8]; x.sats = f[9]; le.hr = f[10];
+    }
+
+    // values converts the entry into the 10 values sent over the radio: UTC date (DDMMYY), time
+    // (dHHMMSS, d=deciseconds), lat [deg*1E6], lon [deg*1E6], alt [m*10], horiz-speed [m/s*1E2],
+    // course [deg*1E2], sats, hdop [*1E2], hr
+    static void values(const LogEntry &le, int32_t *vals) {
+        const NMEAfix &x = le.fix;
+        int32_t time = x.time*100 + x.msecs/1000 + x.msecs/100%10*1000000;
+        int32_t v[10] = { (int32_t)x.date, time, x.lat*5/3, x.lon*5/3, x.alt, x.knots*514/1000,
+            x.course, x.sats, x.hdop, le.hr };
+        memcpy(vals, v, sizeof(v));
+    }
+
+    // time returns the time of the fix in seconds since 2000-01-01.
+    static uint32_t time(const int32_t *f) {
+        return (uint32_t)dateDays(f[0]) * 86400 + (f[1]/100*60 + f[1]%100) * 60 + f[2]/1000;
+    }
+};
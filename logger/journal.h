@@ -0,0 +1,64 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// LogJournal persists a logger's two 24-bit cursors to eeprom as a journal of 8-byte records
+// that rotates through a number of slots so each eeprom word sees only a fraction of the writes.
+// Each record holds the first cursor and an 8-bit sequence number in the first word, and the
+// next cursor and an 8-bit check value in the second. On boot the newest valid record wins.
+// EEPROM must provide static read32 and write32, as JeeH's does.
+
+#pragma once // shared by Logger and PackedLogger
+
+struct LogJournal {
+    int off;        // offset into eeprom of the journal
+    int recs;       // number of records in the journal, at most 64
+    int pos;        // record index of the most recent save
+    uint8_t seq;    // sequence number of the most recent save
+
+    void init(int eepromOffset, int records) {
+        off = eepromOffset;
+        recs = records;
+        pos = recs-1;
+        seq = 0;
+    }
+
+    // restore loads first & next from the newest valid record with both below limit. It returns
+    // false if there is none.
+    bool restore(int limit, int &first, int &next) {
+        bool found = false;
+        int8_t best = 0;
+        for (int i=0; i<recs; i++) {
+            uint32_t w0 = EEPROM::read32(off+8*i);
+            uint32_t w1 = EEPROM::read32(off+8*i+4);
+            int f = w0 & 0xffffff, n = w1 & 0xffffff;
+            uint8_t s = w0 >> 24;
+            if ((w1 >> 24) != check(w0, n) || f >= limit || n >= limit) continue;
+            // sequence numbers of valid records are within recs of each other, so the signed
+            // difference tells which is newer even when they wrap
+            if (found && (int8_t)(s - seq) <= best) continue;
+            if (!found) seq = s;
+            best = (int8_t)(s - seq);
+            first = f;
+            next = n;
+            pos = i;
+            found = true;
+        }
+        seq += best;
+        return found;
+    }
+
+    // save appends a record with first & next to the journal.
+    void save(int first, int next) {
+        if (++pos >= recs) pos = 0;
+        seq++;
+        uint32_t w0 = (first & 0xffffff) | (uint32_t)seq << 24;
+        EEPROM::write32(off+8*pos, w0);
+        EEPROM::write32(off+8*pos+4, (next & 0xffffff) | (uint32_t)check(w0, next) << 24);
+    }
+
+    // check computes the 8-bit check value of a record.
+    static uint8_t check(uint32_t w0, uint32_t next) {
+        uint32_t c = w0 ^ (next * 0x9e3779b1) ^ 0xbeeff00d;
+        c ^= c >> 16;
+        return c ^ (c >> 8);
+    }
+};
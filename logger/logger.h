@@ -1,6 +1,8 @@
 // Copyright (c) 2018 by Thorsten von Eicken
 //
 
+#include "journal.h"
+
 #if 0
 typedef struct LogEntry {
     // 0
@@ -38,124 +40,431 @@ typedef struct LogEntry {
 } LogEntry;
 #endif
 
-template< typename SF >
+template< typename SF, bool BUF = false >
 struct Logger {
     // FIFO list of LogEntry's is kept by `first` and `next`. Flash chip always has the current
     // sector erased so we can write into it as well as the next sector erased so we can "wrap"
     // over into it when we reach the end of the current sector.
+    // Each sector starts with a header holding a sequence number that increments with every
+    // sector that gets written, followed by perSect slots (entries don't straddle sectors). If
+    // the eeprom state is lost, init finds the newest sector by binary search over the headers.
+    // The sector after next is erased in the background when crossing into a new sector (SF must
+    // provide eraseStart and busy, see spi-flash-async.h) and poll() must be called regularly
+    // to notice when the erase is done. Entries pushed while the chip is busy are held in a
+    // small RAM queue and written out by poll().
+    // With BUF set entries are collected in a RAM copy of the current flash page and the page is
+    // programmed in one go when full, or when flush() is called, e.g. before shutting down.
+    // Reads see the buffered entries. Entries in the buffer are lost on a crash.
+
+    // The first & next cursors are persisted to eeprom using a LogJournal (see journal.h).
+    // The state is saved every saveEvery pushes/shifts, which only bounds how much work init has
+    // to do: on boot the newest valid record is found by scanning the journal and `next` is then
+    // rolled forward over the entries written since by checking which slots are erased.
 
-    int off;        // offset into eeprom to store first & next;
+    LogJournal journal; // eeprom journal of first & next
+    int saveEvery;  // number of pushes/shifts between saves
+    int unsaved;    // pushes/shifts since the last save
     int total;      // total number of slots in flash
+    int sectors;    // number of sectors in flash
+    uint32_t sectSeq; // sequence number in the header of the sector next is in
     int first;      // slot index of first entry in list
     int next;       // slot index of next entry to write (one past last)
+    int erasing;    // sector being erased in the background, -1 if none
+    int dropped;    // number of sectors of entries dropped because the flash was full
 
+    // Slot indexes and byte addresses are kept in int, which is 32 bits on the STM32 as well as
+    // on the host, so the 16MB of a W25Q128 (24-bit addresses) fit with plenty of headroom.
+    static_assert(sizeof(int) >= 4, "Logger needs 32-bit int");
     static constexpr int LEsize = sizeof(LogEntry);
     static constexpr int pageBits = 8; // 256 byte pages
     static constexpr int sectorBits = 12; // 4Kbyte sectors
+    static constexpr int pendMax = 4; // entries queued in RAM while erasing
+
+    // SectHdr is written at the start of each sector when its first slot is written. The slots
+    // in sector s are s*perSect..(s+1)*perSect-1, slotSize allows format changes to be detected.
+    struct SectHdr {
+        uint32_t seq;       // sector sequence number, starting at 1
+        uint16_t slotSize;  // LEsize
+        uint16_t check;     // check value over seq and slotSize
+    };
+    static constexpr int perSect = ((1<<sectorBits) - sizeof(SectHdr)) / LEsize;
+
+    LogEntry pend[pendMax]; // entries waiting to be written to flash
+    int pendFirst;  // index into pend of oldest queued entry
+    int pendCnt;    // number of queued entries
+
+    uint8_t buf[BUF ? 1<<pageBits : 1]; // RAM copy of the page being filled
+    int bufPage;    // flash page held in buf, -1 if none
+    int bufFrom;    // offset in buf of first byte not yet programmed
+    int bufTo;      // offset in buf one past last byte written
 
     // init the logger and return true if all OK, the eepromOffset determines where the logger
-    // state is saved (uses 12 bytes).
-    bool init(int eepromOffset) {
-        total = (SF::size()*1024) / LEsize;
-        //total = (6*4*1024) / LEsize; // hack for testing, makes flash real small
-        off = eepromOffset;
-        first = EEPROM::read32(off+0);
-        next = EEPROM::read32(off+4);
-        int chk = EEPROM::read32(off+8);
-
-        if (chk != (first ^ next ^ (int)0xbeeff00d)) {
+    // state is saved (uses 8*records bytes).
+    bool init(int eepromOffset, int records=16, int saveInterval=256) {
+        sectors = SF::size() >> (sectorBits-10);
+        total = sectors * perSect;
+        if (total > 0xffffff) return false; // journal records hold 24-bit slot indexes
+        journal.init(eepromOffset, records);
+        saveEvery = saveInterval;
+        unsaved = 0;
+        erasing = -1;
+        dropped = 0;
+        pendFirst = pendCnt = 0;
+        bufPage = -1;
+        bufFrom = bufTo = 0;
+
+        if (!journal.restore(total, first, next) && !recover()) {
             first = 0;
             next = 0;
+            sectSeq = 0;
             save();
             SF::erase(0);
             SF::erase(1<<sectorBits);
+            return true;
         }
+
+        // roll next forward over entries written after the last save
+        int n = total - count() - 1;
+        while (n-- > 0 && written(next))
+            if (++next >= total) next = 0;
+        // pick up the sector sequence number, if next is at the start of a sector that hasn't
+        // been written yet the previous sector's number is used, and if the power went out
+        // after the header of next's sector was programmed but before its first entry, the
+        // header is programmed again with the same number, which leaves the bits as they are
+        sectSeq = hdrSeq(next / perSect);
+        if (sectSeq != 0 && next % perSect == 0) sectSeq--;
+        else if (sectSeq == 0) sectSeq = hdrSeq((next+total-1) / perSect % sectors);
+        // the erase of the sector after next may have been interrupted, redo it
+        eraseAfterNext(false);
+        save();
         return true;
     }
 
+    // recover is an internal function to rebuild first & next from the sector headers. It
+    // returns false if no sector has a valid header. Sectors 0..S hold increasing sequence
+    // numbers up to the newest sector S, which is followed by one or two erased sectors and then
+    // by older sectors from the previous lap, so hdrSeq(i) >= hdrSeq(0) is true up to S and
+    // false after, and S can be found by binary search. All entries are kept, `first` is set to
+    // the oldest one.
+    bool recover() {
+        uint32_t s0 = hdrSeq(0);
+        int newest;
+        if (s0 != 0) {
+            int lo = 0, hi = sectors;
+            while (hi-lo > 1) {
+                int mid = (lo+hi) / 2;
+                if (hdrSeq(mid) >= s0) lo = mid; else hi = mid;
+            }
+            newest = lo;
+        } else if (hdrSeq(sectors-1) != 0) {
+            newest = sectors-1; // sector 0 is erased because it's after the newest
+        } else if (hdrSeq(sectors-2) != 0) {
+            newest = sectors-2; // the newest is full and next is at the start of the last sector
+        } else {
+            return false;
+        }
+        // binary search for the first unwritten slot in the newest sector
+        int lo = -1, hi = perSect;
+        while (hi-lo > 1) {
+            int mid = (lo+hi) / 2;
+            if (written(newest*perSect + mid)) lo = mid; else hi = mid;
+        }
+        next = newest*perSect + hi;
+        if (next >= total) next = 0;
+        // if the flash has wrapped the oldest sector follows the erased ones, else it's sector 0
+        first = 0;
+        for (int k=2; k<=3; k++) {
+            int o = (newest+k) % sectors;
+            if (o != newest && hdrSeq(o) != 0) {
+                first = o*perSect;
+                break;
+            }
+        }
+        printf("logger recovered from sector headers, first=%d next=%d\r\n", first, next);
+        return true;
+    }
+
+    // hdrSeq is an internal function to read the header of a sector and return its sequence
+    // number, or 0 if the header is not valid.
+    uint32_t hdrSeq(int sect) {
+        SectHdr h;
+        SF::read(sect<<sectorBits, &h, sizeof(h));
+        if (h.slotSize != LEsize || h.check != hdrCheck(h.seq)) return 0;
+        return h.seq;
+    }
+
+    static uint16_t hdrCheck(uint32_t seq) { return (seq ^ (seq >> 16) ^ LEsize) ^ 0xf00d; }
+
+    // written is an internal function that returns true if a slot has been written, i.e. is not
+    // all 0xff.
+    bool written(int slot) {
+        LogEntry le;
+        SF::read(addrOf(slot), &le, LEsize);
+        uint8_t *p = (uint8_t*)&le;
+        for (int i=0; i<LEsize; i++)
+            if (p[i] != 0xff) return true;
+        return false;
+    }
+
+    // addrOf returns the flash address of a slot.
+    static int addrOf(int slot) {
+        return ((slot / perSect) << sectorBits) + sizeof(SectHdr) + (slot % perSect) * LEsize;
+    }
+
+    // clear empties the log without erasing anything.
+    void clear() {
+        pendCnt = 0;
+        first = next;
+        save();
+    }
+
     // eraseAll fully wipes the flash chip and resets the logger
     void eraseAll() {
+        while (erasing >= 0 && SF::busy()) ;
+        erasing = -1;
+        pendCnt = 0;
+        bufPage = -1;
+        bufFrom = bufTo = 0;
         first = 0;
         next = 0;
+        sectSeq = 0;
         save();
         SF::wipe();
     }
 
-    // save is an internal function to save the state to eeprom
+    // save is an internal function to append the state to the eeprom journal, it flushes the
+    // page buffer first unless the flash is busy erasing.
     void save() {
-        EEPROM::write32(off+0, first);
-        EEPROM::write32(off+4, next);
-        EEPROM::write32(off+8, first ^ next ^ 0xbeeff00d);
+        if (erasing < 0) flushBuf();
+        journal.save(first, next);
+        unsaved = 0;
     }
 
     // count returns the number of entries logged
-    int count() { return next>=first ? next-first : next-first+total; }
+    int count() { return (next>=first ? next-first : next-first+total) + pendCnt; }
     // size returns the total number of entries
-    int size() {
-        constexpr int freeSect = ((1<<sectorBits)+LEsize-1) / LEsize; // 1 sect always erased
-        return total - freeSect;
-    }
+    int size() { return total - perSect; } // 1 sect always erased
 
-    // pushEntry adds an entry to the end of the list
+    // pushEntry adds an entry to the end of the list. It does not wait for a background erase
+    // unless the RAM queue is full.
     void pushEntry(LogEntry &le) {
+        if (pendCnt == pendMax) {
+            while (SF::busy()) ;
+            erasing = -1;
+            poll();
+        }
+        pend[(pendFirst+pendCnt) % pendMax] = le;
+        pendCnt++;
+        poll();
+    }
+
+    // poll checks on a background erase and writes queued entries once the flash is idle.
+    void poll() {
+        if (erasing >= 0) {
+            if (SF::busy()) return;
+            erasing = -1;
+        }
+        while (pendCnt > 0 && erasing < 0) {
+            writeEntry(pend[pendFirst]);
+            if (++pendFirst == pendMax) pendFirst = 0;
+            pendCnt--;
+        }
+    }
+
+    // busy returns true while a background erase is in progress.
+    bool busy() { return erasing >= 0; }
+
+    // writeEntry is an internal function to write an entry to flash and start erasing the sector
+    // after next when crossing into a new sector.
+    void writeEntry(LogEntry &le) {
         // slot index of next after the write ("next-next")
         int nn = next+1;
         if (nn >= total) nn = 0;
 
+        // start a new sector with its header
+        if (next % perSect == 0) {
+            SectHdr h = { ++sectSeq, LEsize, hdrCheck(sectSeq) };
+            program((next / perSect) << sectorBits, &h, sizeof(h));
+        }
+
         // figure out where we're writing
-        int addr = next*LEsize;
+        int addr = addrOf(next);
         int page1 = addr >> pageBits;
         int page2 = (addr+LEsize-1) >> pageBits;
         if (page1 == page2) {
             // all fits in same page
             //printf("write(%d/%d, %d)\r\n", addr, addr>>pageBits, LEsize);
-            SF::write(addr, &le, LEsize);
+            program(addr, &le, LEsize);
         } else {
             // write straddles two pages
             int sz1 = (page2<<8)-addr;
-            SF::write(addr, &le, sz1);
-            SF::write(page2<<8, ((uint8_t*)&le)+sz1, LEsize-sz1);
+            program(addr, &le, sz1);
+            program(page2<<8, ((uint8_t*)&le)+sz1, LEsize-sz1);
+            // program the tail right away so a crash can't leave a half-written entry behind
+            flushBuf();
             //printf("write(%d/%d, %d)(%d/%d, %d)\r\n",
             //        addr, addr>>pageBits, sz1, page2<<pageBits, page2, LEsize-sz1);
         }
 
-        bool x = (nn*LEsize)>>sectorBits != addr>>sectorBits; // crossing sectors?
+        bool x = nn % perSect == 0; // crossing sectors?
         next = nn;
-        if (x) {
-            // erase sector after next
-            int sect = ((nn*LEsize)>>sectorBits) + 1;
-            if (sect<<sectorBits >= SF::size()<<10) sect = 0;
-            if (sect<<sectorBits >= 6*4*1024) sect = 0;
-            //printf("*** erase(%d/%d)\r\n", sect<<sectorBits, sect<<4);
+        // a moved head must be saved right away, else it may point into the erased sector
+        if (x && eraseAfterNext(true)) save();
+        else if (++unsaved >= saveEvery) save();
+    }
+
+    // eraseAfterNext is an internal function to erase the sector after the one next is in, in
+    // the background or not. It returns true if that moved the head of the fifo.
+    bool eraseAfterNext(bool background) {
+        int sect = next / perSect + 1;
+        if (sect >= sectors) sect = 0;
+        //printf("*** erase(%d/%d)\r\n", sect<<sectorBits, sect<<4);
+        if (background) {
+            SF::eraseStart(sect<<sectorBits);
+            erasing = sect;
+        } else {
             SF::erase(sect<<sectorBits);
+        }
 
-            // see whether we erased the head of the fifo...
-            if (((first*LEsize)>>sectorBits) == sect) {
-                while (((first*LEsize)>>sectorBits) == sect) first++; // TODO: optimize
-                if (first >= total) first = 0;
-                printf("flash full, first now %d\r\n", first);
-            }
-            save();
+        // see whether we erased the head of the fifo...
+        if (first / perSect != sect) return false;
+        first = (sect+1) * perSect;
+        if (first >= total) first = 0;
+        if (dropped++ == 0) printf("flash full, first now %d\r\n", first);
+        return true;
+    }
+
+    // program is an internal function to write len bytes at addr, which must all be in the same
+    // page. With BUF set the bytes go into the page buffer.
+    void program(int addr, void const* data, int len) {
+        if (!BUF) {
+            SF::write(addr, data, len);
+            return;
+        }
+        int page = addr >> pageBits;
+        int o = addr & ((1<<pageBits)-1);
+        if (page != bufPage) {
+            flushBuf();
+            bufPage = page;
+            bufFrom = o;
+        }
+        memcpy(buf+o, data, len);
+        bufTo = o+len;
+        if (bufTo == 1<<pageBits) flushBuf();
+    }
+
+    // flushBuf is an internal function to program the unwritten part of the page buffer.
+    void flushBuf() {
+        if (!BUF || bufFrom == bufTo) return;
+        SF::write((bufPage<<pageBits)+bufFrom, buf+bufFrom, bufTo-bufFrom);
+        bufFrom = bufTo;
+    }
+
+    // flush writes all entries held in RAM to flash, waiting for a background erase if needed.
+    // It should be called before shutting down.
+    void flush() {
+        while (pendCnt > 0) {
+            while (erasing >= 0 && SF::busy()) ;
+            erasing = -1;
+            poll();
         }
+        while (erasing >= 0 && SF::busy()) ;
+        erasing = -1;
+        flushBuf();
     }
 
+    // flushIdle programs the page buffer unless a background erase is running, without waiting,
+    // so it can be called from the main loop, e.g. while the battery is low. Entries queued in
+    // RAM are left for poll().
+    void flushIdle() { if (erasing < 0) flushBuf(); }
+
     // firstEntry returns the entry at head of list without removing it. Returns false if the list
-    // is empty.
-    bool firstEntry(LogEntry *le) {
-        if (first == next) return false;
-        //printf("read(%d, %d)\r\n", first*LEsize,LEsize);
-        SF::read(first*LEsize, le, LEsize);
+    // is empty or if the entry is in flash and a background erase is in progress, in which case
+    // the caller should try again later.
+    bool firstEntry(LogEntry *le) { return readEntries(le, 1, 0) == 1; }
+
+    // readEntries copies up to max entries into out starting skip entries past the head of the
+    // list without removing them, and returns the number of entries copied. The entries in
+    // flash are fetched using one SPI read per run of consecutive slots within a sector. Returns
+    // 0 if the entries are in flash and a background erase is in progress, in which case the
+    // caller should try again later.
+    int readEntries(LogEntry *out, int max, int skip) {
+        int inFlash = next>=first ? next-first : next-first+total;
+        int n = 0;
+        if (skip < inFlash) {
+            n = inFlash-skip < max ? inFlash-skip : max;
+            int s = first+skip;
+            if (s >= total) s -= total;
+            for (int i = 0; i < n; ) {
+                int run = perSect - s % perSect;
+                if (run > n-i) run = n-i;
+                if (!readFlash(addrOf(s), (uint8_t*)(out+i), run*LEsize)) return 0;
+                i += run;
+                s += run;
+                if (s >= total) s = 0;
+            }
+        }
+        // continue with entries from the RAM queue
+        for (int p = skip+n-inFlash; n < max && p < pendCnt; p++)
+            out[n++] = pend[(pendFirst+p) % pendMax];
+        return n;
+    }
+
+    // readFlash is an internal function to read len bytes at addr, the bytes still in the page
+    // buffer are taken from RAM. Returns false if the flash is busy erasing.
+    bool readFlash(int addr, uint8_t *dst, int len) {
+        int from = 0, to = 0; // range of addresses available from the page buffer
+        if (BUF && bufPage >= 0) {
+            from = (bufPage<<pageBits) + bufFrom;
+            to = (bufPage<<pageBits) + bufTo;
+            if (addr >= from && addr+len <= to) {
+                memcpy(dst, buf + (addr - (bufPage<<pageBits)), len);
+                return true;
+            }
+        }
+        if (erasing >= 0) {
+            if (SF::busy()) return false;
+            erasing = -1; // queued entries are left for poll() as they may start another erase
+        }
+        //printf("read(%d, %d)\r\n", addr, len);
+        SF::read(addr, dst, len);
+        if (BUF && bufPage >= 0) {
+            // part of the range may still be in the page buffer
+            if (from < addr) from = addr;
+            if (to > addr+len) to = addr+len;
+            if (to > from) memcpy(dst + (from-addr), buf + (from - (bufPage<<pageBits)), to-from);
+        }
         return true;
     }
 
     // shiftEntry removes the entry at the head of the list.
     void shiftEntry() {
-        int ff = first+1;
-        if (ff >= total) ff = 0;
+        if (first == next) {
+            // flash is empty, the head is in the RAM queue
+            if (pendCnt == 0) return;
+            if (++pendFirst == pendMax) pendFirst = 0;
+            pendCnt--;
+            return;
+        }
+        if (++first >= total) first = 0;
+        if (++unsaved >= saveEvery) save();
+    }
 
-        bool x = first>>8 != ff>>8; // crossing page boundary, save
-        first = ff;
-        if (x) save();
+    // shiftEntries removes n entries from the head of the list and saves the state at most once.
+    void shiftEntries(int n) {
+        int inFlash = next>=first ? next-first : next-first+total;
+        int k = n < inFlash ? n : inFlash;
+        if (k > 0) {
+            first += k;
+            if (first >= total) first -= total;
+            unsaved += k;
+            if (unsaved >= saveEvery) save();
+        }
+        // the rest come out of the RAM queue
+        for (n -= k; n > 0 && pendCnt > 0; n--) {
+            if (++pendFirst == pendMax) pendFirst = 0;
+            pendCnt--;
+        }
     }
 
 #if 0
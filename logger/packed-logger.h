@@ -0,0 +1,828 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// PackedLogger is a variant of Logger that stores LogEntry's as variable-length compressed
+// records instead of fixed-size slots, so several times more entries fit on the flash chip and
+// fewer bytes go over SPI per entry. It has the same FIFO interface as Logger (pushEntry,
+// firstEntry, readEntries, shiftEntry, shiftEntries, count, poll, flush, clear, ...).
+//
+// FIELDS describes how a LogEntry is split into 32-bit integer fields:
+//   static constexpr int count;           // number of fields
+//   static constexpr uint32_t linear;     // bitmask of fields that change at a steady rate
+//   static void split(const LogEntry &le, int32_t *f);
+//   static void join(const int32_t *f, LogEntry &le);
+//   static uint32_t time(const int32_t *f); // time of the entry, must not decrease
+// join must reproduce the entry exactly (including padding) for it to round-trip. WordFields
+// below works for any LogEntry by treating it as an array of 32-bit words, with the time in the
+// first one. See fix-fields.h for track1's entries.
+//
+// The first record in each sector is a keyframe, the following ones are deltas against a
+// prediction from the previous records in the same sector: the previous value, or for linear
+// fields the previous value plus the previous change. Since most deltas of consecutive fixes are
+// just a few units records are made up of 4-bit nibbles: a bitmap of the fields whose delta is
+// non-zero (4 fields per nibble) followed by the zigzag varint of each such delta using 3 bits
+// per nibble, and a padding nibble if needed. Erased flash doesn't decode as a valid record
+// because its varints don't terminate, which marks the end of the records in a sector.
+
+#include "journal.h"
+
+// WordFields splits a LogEntry into 32-bit words, nothing is predicted linearly.
+struct WordFields {
+    static constexpr int count = (sizeof(LogEntry)+3) / 4;
+    static constexpr uint32_t linear = 0;
+    static void split(const LogEntry &le, int32_t *f) {
+        f[count-1] = 0;
+        memcpy(f, &le, sizeof(le));
+    }
+    static void join(const int32_t *f, LogEntry &le) { memcpy(&le, f, sizeof(le)); }
+    static uint32_t time(const int32_t *f) { return f[0]; }
+};
+
+template< typename SF, typename FIELDS = WordFields, int READERS = 1 >
+struct PackedLogger {
+    // The FIFO ends at the `next` cursor and each of the READERS readers has a cursor of its own
+    // marking the first entry it hasn't shifted yet, so for example the radio uplink and a serial
+    // download can each consume the log at their own pace. A cursor holds a byte address in flash,
+    // the record number (count of records ever written) and the last two records of the sector,
+    // which are needed to decode the record the cursor points at. Each sector starts with a header
+    // holding the number of its first record, which is what allows the state to be rebuilt from
+    // the flash if the eeprom is lost. A sector is considered full when there's no room for a
+    // record of maximum size, so readers and writers move to the next sector at the same place.
+    //
+    // Records are assembled in a RAM copy of the current flash page which is programmed when
+    // full, when the state is saved, or when flush() is called. The sector after the one next is
+    // in is erased in the background when next crosses into a new sector (see Logger), and poll()
+    // must be called regularly. Reads are served from a small RAM window holding flash bytes that
+    // are known to be final, so sequential reads use one SPI read per window rather than one per
+    // record. The cursors are saved to eeprom every saveEvery pushes/shifts using a LogJournal
+    // per reader.
+    //
+    // Flash space is only reclaimed when the flash is full, at which point the oldest sector is
+    // erased and readers that hadn't got past it lose its entries, unless one of them holds its
+    // entries (see setReader) in which case new entries are refused until it has moved on.
+    //
+    // The sector headers also hold the time of the first entry, and the time of the last entry
+    // is programmed into the header (which was left erased) when the sector is full. Together
+    // they form a time index that seek() uses to find an entry by time by reading a few headers
+    // and decoding a single sector.
+
+    static_assert(sizeof(int) >= 4, "PackedLogger needs 32-bit int");
+    static_assert(READERS >= 1, "PackedLogger needs a reader");
+    static constexpr int NF = FIELDS::count;
+    static constexpr int pageBits = 8; // 256 byte pages
+    static constexpr int sectorBits = 12; // 4Kbyte sectors
+    static constexpr int sectSize = 1<<sectorBits;
+    static constexpr int mapNibs = (NF+3) / 4; // nibbles of the non-zero field bitmap
+    static constexpr int maxRec = (mapNibs + 11*NF + 1) / 2; // max size of an encoded record
+    static constexpr int winSize = maxRec > 128 ? maxRec : 128; // size of the read window
+    static constexpr int pendMax = 4; // entries queued in RAM while erasing
+
+    // SectHdr is written at the start of each sector together with its first record, except
+    // for `last` which is written when the sector is full.
+    struct SectHdr {
+        uint32_t rec;       // record number of the first record in the sector
+        uint16_t fields;    // NF, so format changes can be detected
+        uint16_t check;     // check value over rec, fields and time
+        uint32_t time;      // time of the first record
+        uint32_t last;      // time of the last record, 0xffffffff if not written yet
+    };
+
+    // Cursor is a position in the FIFO with the state needed to decode the record there.
+    struct Cursor {
+        int addr;           // flash address of the record, or start of a sector
+        uint32_t rec;       // record number
+        int k;              // number of previous records in the sector, at most 2
+        int32_t p1[NF];     // fields of the previous record
+        int32_t p2[NF];     // fields of the record before that
+    };
+
+    // Reader is the state of one consumer of the log.
+    struct Reader {
+        const char* name;   // set by setReader, for the application's use
+        bool holds;         // refuse new entries rather than drop entries it hasn't read
+        Cursor pos;         // first entry it hasn't shifted
+        Cursor ahead;       // pos moved forward by the last readEntries or seek, valid if aheadOk
+        bool aheadOk;
+        int pendSkip;       // entries at the front of the RAM queue it has shifted
+        int unsaved;        // shifts since its last save
+        uint32_t dropped;   // entries dropped before it could read them
+        LogJournal journal; // eeprom journal of pos.addr & next.addr
+    };
+
+    int saveEvery;  // number of pushes/shifts between saves
+    int unsaved;    // pushes since the last save
+    int sectors;    // number of sectors in flash
+    int bytes;      // size of the flash in bytes
+    Cursor next;    // where the next entry is written (one past last)
+    Reader readers[READERS];
+    int erasing;    // sector being erased in the background, -1 if none
+    int blocked;    // sector that can't be erased because a reader holds it, -1 if none
+    int dropped;    // number of sectors erased while a reader still had entries in them
+    int refused;    // number of entries refused because the flash was full
+
+    LogEntry pend[pendMax]; // entries waiting to be written to flash
+    int pendFirst;  // index into pend of oldest queued entry
+    int pendCnt;    // number of queued entries
+
+    uint8_t buf[1<<pageBits]; // RAM copy of the page being filled
+    int bufPage;    // flash page held in buf, -1 if none
+    int bufFrom;    // offset in buf of first byte not yet programmed
+    int bufTo;      // offset in buf one past last byte written
+
+    uint8_t win[winSize]; // final flash bytes read ahead
+    int winAddr;    // flash address of win[0]
+    int winLen;     // number of valid bytes in win
+
+    // init the logger and return true if all OK, the eepromOffset determines where the logger
+    // state is saved (uses 8*records bytes per reader).
+    bool init(int eepromOffset, int records=16, int saveInterval=256) {
+        sectors = SF::size() >> (sectorBits-10);
+        bytes = sectors << sectorBits;
+        if (bytes > 1<<24) return false; // journal records hold 24-bit addresses
+        for (int r=0; r<READERS; r++) {
+            readers[r].journal.init(eepromOffset + 8*records*r, records);
+            readers[r].aheadOk = false;
+            readers[r].pendSkip = 0;
+            readers[r].unsaved = 0;
+            readers[r].dropped = 0;
+        }
+        saveEvery = saveInterval;
+        unsaved = 0;
+        erasing = -1;
+        blocked = -1;
+        dropped = 0;
+        refused = 0;
+        pendFirst = pendCnt = 0;
+        bufPage = -1;
+        bufFrom = bufTo = 0;
+        winLen = 0;
+
+        int f, n;
+        if (!(readers[0].journal.restore(bytes, f, n) && locate(f, n)) && !recover()) {
+            memset(&next, 0, sizeof(next));
+            for (int r=0; r<READERS; r++) {
+                readers[r].pos = next;
+                save(r);
+            }
+            SF::erase(0);
+            SF::erase(sectSize);
+            return true;
+        }
+
+        // roll next forward over entries written after the last save
+        walk(next, -1, false);
+        winLen = 0; // the window may hold erased bytes past next
+        // the other readers may have shifted entries written after the last save of next, so
+        // they're placed now, a reader that can't be placed starts where the first one is
+        for (int r=1; r<READERS; r++)
+            if (!(readers[r].journal.restore(bytes, f, n) && place(readers[r].pos, f)))
+                readers[r].pos = readers[0].pos;
+        // the erase of the sector after next may have been interrupted, redo it
+        eraseAfterNext(false);
+        save();
+        return true;
+    }
+
+    // setReader names reader r and sets whether it holds its entries: when the flash is full
+    // new entries are refused rather than dropping entries a holding reader hasn't read yet.
+    // Readers start out unnamed and not holding. Reader 0 is used when no reader is specified.
+    void setReader(int r, const char* name, bool holds) {
+        readers[r].name = name;
+        readers[r].holds = holds;
+    }
+
+    // locate is an internal function to rebuild next and the first reader's cursor from their
+    // addresses by walking their sectors from the start. It returns false if the flash doesn't
+    // match.
+    bool locate(int f, int n) {
+        if (startSector(next, n >> sectorBits)) {
+            walk(next, n, false);
+        } else {
+            // next is at the start of an unwritten sector, get the record number by walking the
+            // previous sector, if there is none the flash is fresh
+            if (n & (sectSize-1)) return false;
+            int ps = (n >> sectorBits) - 1;
+            if (ps < 0) ps = sectors-1;
+            if (startSector(next, ps)) {
+                walk(next, n, false);
+            } else {
+                next.addr = n;
+                next.rec = 0;
+            }
+        }
+        if (next.addr != n) return false;
+        return place(readers[0].pos, f);
+    }
+
+    // place is an internal function to point c at the record at address a, which must be before
+    // next, by walking its sector from the start. It returns false if the flash doesn't match.
+    bool place(Cursor &c, int a) {
+        if (a == next.addr) {
+            c = next;
+            return true;
+        }
+        if (!startSector(c, a >> sectorBits)) return false;
+        walk(c, a, false);
+        return c.addr == a && (int)(next.rec - c.rec) > 0;
+    }
+
+    // recover is an internal function to rebuild next and the readers' cursors from the sector
+    // headers, using a binary search over the record numbers in the headers to find the newest
+    // sector like Logger does with its sequence numbers. All readers start at the oldest sector.
+    // It returns false if no sector has a valid header.
+    bool recover() {
+        uint32_t r0, r;
+        int newest;
+        if (hdrRec(0, r0)) {
+            int lo = 0, hi = sectors;
+            while (hi-lo > 1) {
+                int mid = (lo+hi) / 2;
+                if (hdrRec(mid, r) && r >= r0) lo = mid; else hi = mid;
+            }
+            newest = lo;
+        } else if (hdrRec(sectors-1, r)) {
+            newest = sectors-1; // sector 0 is erased because it's after the newest
+        } else if (hdrRec(sectors-2, r)) {
+            newest = sectors-2; // the newest is full and next is at the start of the last sector
+        } else {
+            return false;
+        }
+        startSector(next, newest);
+        walk(next, -1, false);
+        // if the flash has wrapped the oldest sector follows the erased ones, else it's sector 0
+        int oldest = 0;
+        for (int k=2; k<=3; k++) {
+            int o = (newest+k) % sectors;
+            if (o != newest && hdrRec(o, r)) {
+                oldest = o;
+                break;
+            }
+        }
+        Cursor &first = readers[0].pos;
+        if (!startSector(first, oldest)) first = next;
+        for (int i=1; i<READERS; i++) readers[i].pos = first;
+        printf("logger recovered from sector headers, first=%d next=%d\r\n", first.addr, next.addr);
+        return true;
+    }
+
+    // readHdr is an internal function to read the header of a sector, it returns false if the
+    // header is not valid. The flash must not be busy erasing.
+    bool readHdr(int sect, SectHdr &h) {
+        if (!readFlash(sect<<sectorBits, (uint8_t*)&h, sizeof(h))) return false;
+        return h.fields == NF && h.check == hdrCheck(h.rec, h.time);
+    }
+
+    // hdrRec is an internal function to read the record number in the header of a sector, it
+    // returns false if the header is not valid.
+    bool hdrRec(int sect, uint32_t &rec) {
+        SectHdr h;
+        bool ok = readHdr(sect, h);
+        rec = h.rec;
+        return ok;
+    }
+
+    static uint16_t hdrCheck(uint32_t rec, uint32_t time) {
+        uint32_t c = rec ^ (time * 0x9e3779b1) ^ NF;
+        return (c ^ (c >> 16)) ^ 0xcafe;
+    }
+
+    // startSector is an internal function to point c at the start of a sector using the record
+    // number in its header. It returns false if the header is not valid.
+    bool startSector(Cursor &c, int sect) {
+        c.addr = sect << sectorBits;
+        c.k = 0;
+        return hdrRec(sect, c.rec);
+    }
+
+    // walk is an internal function to advance c over written records until it reaches stop or a
+    // record that isn't there. It continues into the next sector only if its header has the
+    // expected record number. With bounded set it doesn't go past next.
+    void walk(Cursor &c, int stop, bool bounded) {
+        int32_t f[NF];
+        while (c.addr != stop) {
+            uint32_t rec;
+            if ((c.addr & (sectSize-1)) == 0 && !(hdrRec(c.addr>>sectorBits, rec) && rec == c.rec))
+                return;
+            if (readRec(c, f, bounded) <= 0) return;
+        }
+    }
+
+    // clear empties the log for reader r, or for all readers if r is -1, without erasing
+    // anything.
+    void clear(int r=-1) {
+        for (int i=0; i<READERS; i++) {
+            if (r >= 0 && i != r) continue;
+            readers[i].pos = next;
+            readers[i].pendSkip = pendCnt;
+            readers[i].aheadOk = false;
+            save(i);
+        }
+        trimPend();
+    }
+
+    // eraseAll fully wipes the flash chip and resets the logger
+    void eraseAll() {
+        waitErase();
+        pendCnt = 0;
+        bufPage = -1;
+        bufFrom = bufTo = 0;
+        winLen = 0;
+        blocked = -1;
+        memset(&next, 0, sizeof(next));
+        for (int r=0; r<READERS; r++) {
+            readers[r].pos = next;
+            readers[r].pendSkip = 0;
+            readers[r].aheadOk = false;
+            save(r);
+        }
+        SF::wipe();
+    }
+
+    // save is an internal function to append reader r's state to its eeprom journal, it flushes
+    // the page buffer first unless the flash is busy erasing. Reader 0's journal is the one that
+    // keeps track of next.
+    void save(int r=0) {
+        if (erasing < 0) flushBuf();
+        readers[r].journal.save(readers[r].pos.addr, next.addr);
+        readers[r].unsaved = 0;
+        if (r == 0) unsaved = 0;
+    }
+
+    // count returns the number of entries logged that reader r hasn't shifted yet
+    int count(int r=0) {
+        return (int)(next.rec - readers[r].pos.rec) + pendCnt - readers[r].pendSkip;
+    }
+
+    // size returns the number of entries the flash can hold (1 sector is always erased). It's
+    // an estimate based on the entries currently in the log, or a lower bound if it's empty.
+    int size() {
+        Cursor &first = readers[slowest()].pos;
+        int span = next.addr - first.addr;
+        if (span < 0) span += bytes;
+        int cnt = next.rec - first.rec;
+        int room = bytes - sectSize;
+        if (cnt < 100 || span == 0) return room / sectSize * ((sectSize - sizeof(SectHdr)) / maxRec);
+        return (int64_t)room * cnt / span;
+    }
+
+    // slowest returns the index of the reader furthest behind in the flash.
+    int slowest() {
+        int s = 0;
+        for (int r=1; r<READERS; r++)
+            if ((int)(next.rec - readers[r].pos.rec) > (int)(next.rec - readers[s].pos.rec)) s = r;
+        return s;
+    }
+
+    // pushEntry adds an entry to the end of the list. It does not wait for a background erase
+    // unless the RAM queue is full. It returns false if the entry was refused because the flash
+    // is full of entries that a holding reader hasn't read yet.
+    bool pushEntry(LogEntry &le) {
+        if (pendCnt == pendMax) {
+            waitErase();
+            poll();
+            if (pendCnt == pendMax) {
+                refused++;
+                return false;
+            }
+        }
+        pend[(pendFirst+pendCnt) % pendMax] = le;
+        pendCnt++;
+        poll();
+        return true;
+    }
+
+    // poll checks on a background erase and writes queued entries once the flash is idle.
+    void poll() {
+        if (erasing >= 0) {
+            if (SF::busy()) return;
+            erasing = -1;
+        }
+        while (pendCnt > 0 && erasing < 0 && writeEntry(pend[pendFirst])) {
+            // readers that shifted the entry out of the queue are now past it in flash
+            for (int r=0; r<READERS; r++) {
+                if (readers[r].pendSkip == 0) continue;
+                readers[r].pendSkip--;
+                readers[r].pos = next;
+                readers[r].aheadOk = false;
+            }
+            if (++pendFirst == pendMax) pendFirst = 0;
+            pendCnt--;
+        }
+    }
+
+    // trimPend is an internal function to drop queued entries that all readers have shifted,
+    // they don't need to be written to flash.
+    void trimPend() {
+        int m = pendCnt;
+        for (int r=0; r<READERS; r++)
+            if (readers[r].pendSkip < m) m = readers[r].pendSkip;
+        for (int r=0; r<READERS; r++) readers[r].pendSkip -= m;
+        pendFirst = (pendFirst+m) % pendMax;
+        pendCnt -= m;
+    }
+
+    // busy returns true while a background erase is in progress.
+    bool busy() { return erasing >= 0; }
+
+    // waitErase is an internal function to wait for a background erase to finish.
+    void waitErase() {
+        while (erasing >= 0 && SF::busy()) ;
+        erasing = -1;
+    }
+
+    // writeEntry is an internal function to encode and write an entry to flash and start erasing
+    // the sector after next when crossing into a new sector. It returns false if the entry could
+    // not be written yet because that erase is blocked or was just started.
+    bool writeEntry(LogEntry &le) {
+        if (blocked >= 0) {
+            eraseAfterNext(true);
+            return false;
+        }
+
+        int32_t f[NF];
+        FIELDS::split(le, f);
+
+        // start a new sector with its header
+        if ((next.addr & (sectSize-1)) == 0) {
+            uint32_t t = FIELDS::time(f);
+            SectHdr h = { next.rec, NF, hdrCheck(next.rec, t), t, 0xffffffff };
+            program(next.addr, &h, sizeof(h));
+            next.addr += sizeof(h);
+            next.k = 0;
+        }
+
+        uint8_t rec[maxRec];
+        int len = encode(next, f, rec);
+        int addr = next.addr;
+        int page2 = (addr+len-1) >> pageBits;
+        if (addr >> pageBits == page2) {
+            program(addr, rec, len);
+        } else {
+            // record straddles two pages
+            int sz1 = (page2<<pageBits)-addr;
+            program(addr, rec, sz1);
+            program(page2<<pageBits, rec+sz1, len-sz1);
+            // program the tail right away so a crash can't leave a half-written record behind
+            flushBuf();
+        }
+
+        int sect = next.addr >> sectorBits;
+        advance(next, f, len);
+        if (next.addr >> sectorBits != sect) {
+            // complete the time index in the full sector's header
+            uint32_t t = FIELDS::time(f);
+            program((sect<<sectorBits) + sizeof(SectHdr) - sizeof(t), &t, sizeof(t)); // last
+            eraseAfterNext(true);
+        }
+        if (++unsaved >= saveEvery) save();
+        return true;
+    }
+
+    // eraseAfterNext is an internal function to erase the sector after the one next is in, in
+    // the background or not. Readers in that sector are moved to the following one, unless one
+    // of them holds its entries, in which case the erase is put off by setting blocked.
+    void eraseAfterNext(bool background) {
+        int sect = (next.addr >> sectorBits) + 1;
+        if (sect >= sectors) sect = 0;
+        for (int r=0; r<READERS; r++) {
+            if (readers[r].holds && inSector(readers[r].pos, sect)) {
+                if (blocked != sect) printf("flash full, reader %d holds sector %d\r\n", r, sect);
+                blocked = sect;
+                return;
+            }
+        }
+        blocked = -1;
+        winLen = 0;
+        // move readers out of the sector, the header of the following one has to be read before
+        // the erase starts, and moved readers must be saved right away else they may point into
+        // the erased sector
+        int s2 = sect+1 < sectors ? sect+1 : 0;
+        Cursor head;
+        bool moved = false;
+        for (int r=0; r<READERS; r++) {
+            Reader &rd = readers[r];
+            if (!inSector(rd.pos, sect)) continue;
+            if (!moved && !startSector(head, s2)) head = next;
+            moved = true;
+            rd.dropped += head.rec - rd.pos.rec;
+            rd.pos = head;
+            rd.aheadOk = false;
+            save(r);
+        }
+        if (moved && dropped++ == 0) printf("flash full, dropping entries\r\n");
+        //printf("*** erase(%d/%d)\r\n", sect<<sectorBits, sect<<4);
+        if (background) {
+            SF::eraseStart(sect<<sectorBits);
+            erasing = sect;
+        } else {
+            SF::erase(sect<<sectorBits);
+        }
+    }
+
+    // inSector is an internal function that returns true if c points at an entry in sect.
+    bool inSector(const Cursor &c, int sect) {
+        return c.addr != next.addr && c.addr >> sectorBits == sect;
+    }
+
+    // advance is an internal function to move c past a record of len bytes with fields f, and on
+    // to the next sector if there's no room left for another record.
+    void advance(Cursor &c, const int32_t *f, int len) {
+        int sect = c.addr & ~(sectSize-1);
+        memcpy(c.p2, c.p1, sizeof(c.p1));
+        memcpy(c.p1, f, sizeof(c.p1));
+        if (c.k < 2) c.k++;
+        c.rec++;
+        c.addr += len;
+        if (sect + sectSize - c.addr < maxRec) {
+            c.addr = sect + sectSize;
+            if (c.addr >= bytes) c.addr = 0;
+        }
+    }
+
+    // predict is an internal function that returns the predicted value of field i at c.
+    static uint32_t predict(const Cursor &c, int i) {
+        if (c.k == 0) return 0;
+        if (c.k == 1 || !(FIELDS::linear & (1u<<i))) return c.p1[i];
+        return 2*(uint32_t)c.p1[i] - (uint32_t)c.p2[i];
+    }
+
+    // encode is an internal function to encode fields f as a record at c, returns its length.
+    static int encode(const Cursor &c, const int32_t *f, uint8_t *rec) {
+        memset(rec, 0, maxRec);
+        int n = mapNibs; // nibble index
+        for (int i=0; i<NF; i++) {
+            uint32_t d = (uint32_t)f[i] - predict(c, i);
+            if (d == 0) continue;
+            rec[i/8] |= 0x80 >> (i%8);
+            uint32_t z = (d << 1) ^ (uint32_t)((int32_t)d >> 31); // zigzag
+            for (; z >= 8; z >>= 3, n++)
+                rec[n/2] |= (8 | (z & 7)) << (n&1 ? 0 : 4);
+            rec[n/2] |= z << (n&1 ? 0 : 4);
+            n++;
+        }
+        return (n+1) / 2;
+    }
+
+    // decode is an internal function to decode the record at c from rec, of which avail bytes are
+    // valid, into fields f. It returns the record's length, or 0 if it's not a valid record.
+    static int decode(const Cursor &c, const uint8_t *rec, int avail, int32_t *f) {
+        if (avail*2 < mapNibs) return 0;
+        for (int i=NF; i<mapNibs*4; i++)
+            if (rec[i/8] & (0x80 >> (i%8))) return 0;
+        int n = mapNibs;
+        for (int i=0; i<NF; i++) {
+            uint32_t d = 0;
+            if (rec[i/8] & (0x80 >> (i%8))) {
+                uint32_t z = 0;
+                for (int sh = 0; ; sh += 3) {
+                    if (n >= avail*2 || sh > 30) return 0;
+                    uint8_t b = (rec[n/2] >> (n&1 ? 0 : 4)) & 0xf;
+                    n++;
+                    z |= (uint32_t)(b & 7) << sh;
+                    if (!(b & 8)) break;
+                }
+                d = (z >> 1) ^ -(z & 1);
+            }
+            f[i] = predict(c, i) + d;
+        }
+        return (n+1) / 2;
+    }
+
+    // readRec is an internal function to decode the record at c into f and advance c. It returns
+    // 1 if OK, 0 if the flash is busy erasing, and -1 if there's no valid record at c, in which
+    // case c is unchanged. With bounded set the record must lie before next.
+    int readRec(Cursor &c, int32_t *f, bool bounded) {
+        Cursor h = c;
+        if ((h.addr & (sectSize-1)) == 0) {
+            h.addr += sizeof(SectHdr);
+            h.k = 0;
+        }
+        int end = (h.addr | (sectSize-1)) + 1;
+        if (bounded && h.addr <= next.addr && next.addr < end) end = next.addr;
+        int need = end - h.addr < maxRec ? end - h.addr : maxRec;
+        if (need <= 0) return -1;
+        // decode from the window if the record is there, a record that doesn't fit in what's
+        // left of the window fails to decode
+        bool inWin = h.addr >= winAddr && h.addr < winAddr + winLen;
+        int len = inWin ? decode(h, win + (h.addr-winAddr), winAddr+winLen-h.addr, f) : 0;
+        if (len == 0 && (!inWin || h.addr + need > winAddr + winLen)) {
+            // refill the window, with bounded set only bytes that are final are read
+            int n = end - h.addr < winSize ? end - h.addr : winSize;
+            if (!readFlash(h.addr, win, n)) return 0;
+            winAddr = h.addr;
+            winLen = n;
+            len = decode(h, win, winLen, f);
+        }
+        if (len == 0) return -1;
+        advance(h, f, len);
+        c = h;
+        return 1;
+    }
+
+    // program is an internal function to write len bytes at addr into the page buffer, they must
+    // all be in the same page.
+    void program(int addr, void const* data, int len) {
+        int page = addr >> pageBits;
+        int o = addr & ((1<<pageBits)-1);
+        if (page != bufPage) {
+            flushBuf();
+            bufPage = page;
+            bufFrom = o;
+        }
+        memcpy(buf+o, data, len);
+        bufTo = o+len;
+        if (bufTo == 1<<pageBits) flushBuf();
+    }
+
+    // flushBuf is an internal function to program the unwritten part of the page buffer.
+    void flushBuf() {
+        if (bufFrom == bufTo) return;
+        SF::write((bufPage<<pageBits)+bufFrom, buf+bufFrom, bufTo-bufFrom);
+        bufFrom = bufTo;
+    }
+
+    // flush writes all entries held in RAM to flash, waiting for a background erase if needed.
+    // It should be called before shutting down. Entries that can't be written because a reader
+    // holds the flash stay in RAM.
+    void flush() {
+        while (pendCnt > 0 && blocked < 0) {
+            waitErase();
+            poll();
+        }
+        waitErase();
+        flushBuf();
+    }
+
+    // flushIdle programs the page buffer unless a background erase is running, without waiting,
+    // so it can be called from the main loop, e.g. while the battery is low. Entries queued in
+    // RAM are left for poll().
+    void flushIdle() { if (erasing < 0) flushBuf(); }
+
+    // firstEntry returns the first entry reader r hasn't shifted without removing it. Returns
+    // false if the list is empty or if the entry is in flash and a background erase is in
+    // progress, in which case the caller should try again later.
+    bool firstEntry(LogEntry *le, int r=0) { return readEntries(le, 1, 0, r) == 1; }
+
+    // readEntries copies up to max entries into out starting skip entries past reader r's
+    // position without removing them, and returns the number of entries copied. Returns 0 if the
+    // entries are in flash and a background erase is in progress, in which case the caller
+    // should try again later. The position after the last entry read is remembered so a
+    // following shiftEntries doesn't have to decode the entries again.
+    int readEntries(LogEntry *out, int max, int skip, int r=0) {
+        Reader &rd = readers[r];
+        int inFlash = next.rec - rd.pos.rec;
+        int n = 0;
+        if (skip < inFlash) {
+            Cursor c = rd.aheadOk && (int)(rd.ahead.rec - rd.pos.rec) <= skip ? rd.ahead : rd.pos;
+            int32_t f[NF];
+            while ((int)(c.rec - rd.pos.rec) < skip) {
+                int st = readRec(c, f, true);
+                if (st == 0) return 0;
+                if (st < 0) return bad(c, r);
+            }
+            while (n < max && c.rec != next.rec) {
+                int st = readRec(c, f, true);
+                if (st == 0 && n == 0) return 0;
+                if (st < 0 && n == 0) return bad(c, r);
+                if (st <= 0) return n;
+                FIELDS::join(f, out[n++]);
+            }
+            rd.ahead = c;
+            rd.aheadOk = true;
+        }
+        // continue with entries from the RAM queue
+        for (int p = rd.pendSkip+skip+n-inFlash; n < max && p < pendCnt; p++)
+            out[n++] = pend[(pendFirst+p) % pendMax];
+        return n;
+    }
+
+    // bad is an internal function called when the record at c is corrupt, it moves reader r
+    // past the end of the sector since the following records in it can't be decoded either,
+    // and returns 0.
+    int bad(Cursor &c, int r) {
+        waitErase();
+        Reader &rd = readers[r];
+        uint32_t was = rd.pos.rec;
+        int sect = c.addr >> sectorBits;
+        int s2 = sect+1 < sectors ? sect+1 : 0;
+        if (sect == next.addr >> sectorBits || !startSector(rd.pos, s2)) rd.pos = next;
+        printf("logger: bad record at %d, reader %d now at %d\r\n", c.addr, r, rd.pos.addr);
+        rd.dropped += rd.pos.rec - was;
+        rd.aheadOk = false;
+        save(r);
+        return 0;
+    }
+
+    // seek finds the first entry with a time at or after t (see FIELDS::time) and returns the
+    // number of entries before it from reader r's position, which can be passed as skip to
+    // readEntries to read from there. The position is remembered so that readEntries doesn't
+    // have to walk the log to get there. The sector holding the entry is found with a binary
+    // search over the times in the sector headers and only that sector is decoded. Waits for a
+    // background erase to finish.
+    int seek(uint32_t t, int r=0) {
+        waitErase();
+        Reader &rd = readers[r];
+        int fs = rd.pos.addr >> sectorBits;
+        int m = (next.addr >> sectorBits) - fs + 1; // sectors holding entries
+        if (m <= 0) m += sectors;
+        // find the last sector whose first entry is not after t, the sector the reader is in is
+        // taken even if it is
+        SectHdr h;
+        int lo = 0, hi = m;
+        while (hi-lo > 1) {
+            int mid = (lo+hi) / 2;
+            if (readHdr((fs+mid) % sectors, h) && h.time <= t) lo = mid; else hi = mid;
+        }
+        Cursor c = rd.pos;
+        if (lo > 0) startSector(c, (fs+lo) % sectors);
+        if (lo+1 < m && readHdr((fs+lo) % sectors, h) && h.last != 0xffffffff && h.last < t) {
+            // t falls after the end of the sector, the entry is the first of the next one
+            if (!startSector(c, (fs+lo+1) % sectors)) c = next;
+        } else {
+            int32_t f[NF];
+            while (c.rec != next.rec) {
+                Cursor p = c;
+                if (readRec(c, f, true) <= 0) break;
+                if (FIELDS::time(f) >= t) {
+                    c = p;
+                    break;
+                }
+            }
+        }
+        int n = c.rec - rd.pos.rec;
+        if (c.rec != rd.pos.rec) {
+            rd.ahead = c;
+            rd.aheadOk = true;
+        }
+        // the entry may be in the RAM queue
+        if (c.rec == next.rec) {
+            for (int p = rd.pendSkip; p < pendCnt; p++, n++) {
+                int32_t f[NF];
+                FIELDS::split(pend[(pendFirst+p) % pendMax], f);
+                if (FIELDS::time(f) >= t) break;
+            }
+        }
+        return n;
+    }
+
+    // readFlash is an internal function to read len bytes at addr, the bytes still in the page
+    // buffer are taken from RAM. Returns false if the flash is busy erasing.
+    bool readFlash(int addr, uint8_t *dst, int len) {
+        int from = 0, to = 0; // range of addresses available from the page buffer
+        if (bufPage >= 0) {
+            from = (bufPage<<pageBits) + bufFrom;
+            to = (bufPage<<pageBits) + bufTo;
+            if (addr >= from && addr+len <= to) {
+                memcpy(dst, buf + (addr - (bufPage<<pageBits)), len);
+                return true;
+            }
+        }
+        if (erasing >= 0) {
+            if (SF::busy()) return false;
+            erasing = -1; // queued entries are left for poll() as they may move readers
+        }
+        SF::read(addr, dst, len);
+        if (bufPage >= 0) {
+            // part of the range may still be in the page buffer
+            if (from < addr) from = addr;
+            if (to > addr+len) to = addr+len;
+            if (to > from) memcpy(dst + (from-addr), buf + (from - (bufPage<<pageBits)), to-from);
+        }
+        return true;
+    }
+
+    // shiftEntry removes the first entry for reader r.
+    void shiftEntry(int r=0) { shiftEntries(1, r); }
+
+    // shiftEntries removes n entries for reader r and saves its state at most once. Unless the
+    // entries were just read with readEntries they have to be decoded to find where the new
+    // position is, which waits for a background erase. Queued entries that all readers have
+    // shifted are dropped from RAM.
+    void shiftEntries(int n, int r=0) {
+        Reader &rd = readers[r];
+        int inFlash = next.rec - rd.pos.rec;
+        int k = n < inFlash ? n : inFlash;
+        if (k > 0) {
+            Cursor c = rd.aheadOk && (int)(rd.ahead.rec - rd.pos.rec) <= k ? rd.ahead : rd.pos;
+            int32_t f[NF];
+            while ((int)(c.rec - rd.pos.rec) < k) {
+                int st = readRec(c, f, true);
+                if (st == 0) waitErase();
+                if (st < 0) {
+                    bad(c, r);
+                    return;
+                }
+            }
+            rd.pos = c;
+            rd.aheadOk = false;
+            rd.unsaved += k;
+            if (rd.unsaved >= saveEvery) save(r);
+        }
+        // the rest come out of the RAM queue
+        n -= k;
+        if (n > pendCnt - rd.pendSkip) n = pendCnt - rd.pendSkip;
+        if (n > 0) {
+            rd.pendSkip += n;
+            trimPend();
+        }
+    }
+};
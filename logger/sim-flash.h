@@ -0,0 +1,203 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Host-side stand-ins for JeeH's SpiFlash and EEPROM so the Logger can run on Linux.
+//
+// SimFlash has the same static interface as SpiFlashAsync (size in KB, read, write, erase, wipe,
+// eraseStart, busy) and behaves like a W25Q128: erase sets bytes to 0xff, programming can only
+// clear bits, and a write that runs past the end of a 256-byte page wraps around to the start of
+// that page. Each operation advances a simulated clock by the SPI transfer time plus the chip's
+// typical program/erase time, and counts SPI transactions and bytes so benchmarks can report what
+// the real bus would see.
+// EEPROM mimics the STM32L0 data EEPROM with its multi-millisecond word write time.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// SimClock is the simulated time shared by all simulated devices, in microseconds.
+struct SimClock {
+    static uint64_t usecs;
+    static void advance(uint32_t us) { usecs += us; }
+};
+uint64_t SimClock::usecs = 0;
+
+// SimStats accumulates counters for everything the benchmarks report.
+struct SimStats {
+    uint32_t spiTxns;       // SPI transactions (chip-select cycles), excluding status polls
+    uint32_t spiBytes;      // bytes clocked over SPI, including command and address bytes
+    uint32_t reads;         // read commands
+    uint32_t programs;      // page program commands
+    uint32_t erases;        // 4KB sector erases
+    uint32_t overwrites;    // programmed bytes that were not erased (bits could not be set)
+    uint32_t pageWraps;     // writes that ran past the end of a page and wrapped
+    uint32_t eepromWrites;  // 32-bit EEPROM word writes
+    uint32_t stalls;        // operations issued while a background erase was still running
+    uint64_t busyUsecs;     // time spent waiting on flash program/erase and EEPROM writes
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+};
+
+template< int KB >
+struct SimFlashT {
+    static constexpr int pageSize = 256;
+    static constexpr int sectorSize = 4096;
+    // W25Q128JV typical timings, all in microseconds
+    static constexpr uint32_t tBP1 = 30;        // first byte program
+    static constexpr uint32_t tBPn10 = 25;      // each additional byte program, *10
+    static constexpr uint32_t tPP = 400;        // full page program
+    static constexpr uint32_t tSE = 45000;      // 4KB sector erase
+    static constexpr uint32_t tCE = 40000000;   // chip erase
+    static uint32_t spiHz;                      // SPI clock, the default is about what SpiGpio does
+    static bool blockingErase;                  // eraseStart waits for completion
+
+    static uint8_t mem[KB*1024];
+    static SimStats stats;
+    static uint64_t busyUntil;                  // simulated time when current program/erase ends
+
+    static void init() { memset(mem, 0xff, sizeof(mem)); busyUntil = 0; }
+    static int size() { return KB; } // in KB, like SpiFlash
+
+    // wait polls the status register until the chip is no longer busy, start must be true
+    // when called at the start of an operation so those stalls get counted.
+    static void wait(bool start=true) {
+        if (SimClock::usecs < busyUntil) {
+            if (start) stats.stalls++;
+            stats.busyUsecs += busyUntil - SimClock::usecs;
+            SimClock::usecs = busyUntil;
+        }
+        spi(2, false); // final status read that sees busy=0
+    }
+
+    static void read(int addr, void* buf, int len) {
+        wait();
+        spi(4+len);
+        stats.reads++;
+        memcpy(buf, mem + wrap(addr), len);
+    }
+
+    static void write(int addr, void const* buf, int len) {
+        wait();
+        spi(1); // write-enable
+        spi(4+len);
+        stats.programs++;
+        int page = addr & ~(pageSize-1);
+        uint8_t const* p = (uint8_t const*)buf;
+        for (int i=0; i<len; i++) {
+            int a = wrap(page + ((addr - page + i) & (pageSize-1)));
+            if ((mem[a] & p[i]) != p[i]) stats.overwrites++;
+            mem[a] &= p[i];
+        }
+        if ((addr & (pageSize-1)) + len > pageSize) stats.pageWraps++;
+        uint32_t t = tBP1 + (len-1) * tBPn10 / 10;
+        busyUntil = SimClock::usecs + (t < tPP ? t : tPP);
+        wait(false);
+    }
+
+    static void erase(int addr) {
+        wait();
+        spi(1); // write-enable
+        spi(4);
+        stats.erases++;
+        memset(mem + wrap(addr & ~(sectorSize-1)), 0xff, sectorSize);
+        busyUntil = SimClock::usecs + tSE;
+        wait(false);
+    }
+
+    // eraseStart and busy are the background erase interface of SpiFlashAsync. Setting
+    // blockingErase makes eraseStart behave like erase for before/after comparisons.
+    static void eraseStart(int addr) {
+        wait();
+        spi(1); // write-enable
+        spi(4);
+        stats.erases++;
+        memset(mem + wrap(addr & ~(sectorSize-1)), 0xff, sectorSize);
+        busyUntil = SimClock::usecs + tSE;
+        if (blockingErase) wait(false);
+    }
+    static bool busy() {
+        spi(2, false);
+        return SimClock::usecs < busyUntil;
+    }
+
+    static void wipe() {
+        wait();
+        spi(1);
+        spi(1);
+        memset(mem, 0xff, sizeof(mem));
+        busyUntil = SimClock::usecs + tCE;
+        wait(false);
+    }
+
+    // load and store persist the flash image to a file so a run can pick up where the last
+    // one left off. They return false if the file can't be accessed.
+    static bool load(const char* path) {
+        FILE* f = fopen(path, "rb");
+        if (f == 0) return false;
+        bool ok = fread(mem, 1, sizeof(mem), f) == sizeof(mem);
+        fclose(f);
+        return ok;
+    }
+    static bool store(const char* path) {
+        FILE* f = fopen(path, "wb");
+        if (f == 0) return false;
+        bool ok = fwrite(mem, 1, sizeof(mem), f) == sizeof(mem);
+        fclose(f);
+        return ok;
+    }
+
+    // spi accounts for one chip-select cycle transferring n bytes
+    static void spi(int n, bool count=true) {
+        if (count) { stats.spiTxns++; stats.spiBytes += n; }
+        SimClock::advance((uint32_t)((uint64_t)n * 8 * 1000000 / spiHz) + 1);
+    }
+
+    static int wrap(int addr) { return addr % (KB*1024); }
+};
+
+template< int KB > uint32_t SimFlashT<KB>::spiHz = 2000000;
+template< int KB > bool SimFlashT<KB>::blockingErase = false;
+template< int KB > uint8_t SimFlashT<KB>::mem[KB*1024];
+template< int KB > SimStats SimFlashT<KB>::stats;
+template< int KB > uint64_t SimFlashT<KB>::busyUntil = 0;
+
+typedef SimFlashT<16*1024> SimFlash; // W25Q128, 16MB
+
+// EEPROM emulates the STM32L0 data EEPROM (6KB on the L082) using the same static interface as
+// JeeH. Writes are charged the word program time and counted in SimFlash's stats.
+template< int SIZE >
+struct SimEEPROM {
+    static constexpr uint32_t tProg = 3200; // word erase+program in microseconds
+    static uint8_t mem[SIZE];
+    static SimStats* stats;
+
+    static uint32_t read32(int off) {
+        uint32_t v;
+        memcpy(&v, mem + off, 4);
+        return v;
+    }
+    static void write32(int off, uint32_t v) {
+        memcpy(mem + off, &v, 4);
+        SimClock::advance(tProg);
+        if (stats) { stats->eepromWrites++; stats->busyUsecs += tProg; }
+    }
+
+    static bool load(const char* path) {
+        FILE* f = fopen(path, "rb");
+        if (f == 0) return false;
+        bool ok = fread(mem, 1, sizeof(mem), f) == sizeof(mem);
+        fclose(f);
+        return ok;
+    }
+    static bool store(const char* path) {
+        FILE* f = fopen(path, "wb");
+        if (f == 0) return false;
+        bool ok = fwrite(mem, 1, sizeof(mem), f) == sizeof(mem);
+        fclose(f);
+        return ok;
+    }
+};
+
+template< int SIZE > uint8_t SimEEPROM<SIZE>::mem[SIZE];
+template< int SIZE > SimStats* SimEEPROM<SIZE>::stats = &SimFlash::stats;
+
+typedef SimEEPROM<6*1024> EEPROM;
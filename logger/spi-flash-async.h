@@ -0,0 +1,30 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// SpiFlashAsync extends JeeH's SpiFlash with a sector erase that doesn't wait for completion so
+// the Logger can erase in the background and poll the busy flag. The regular read/write
+// functions must not be called while busy() returns true.
+
+template< typename SPI >
+struct SpiFlashAsync : SpiFlash< SPI > {
+    // eraseStart issues a write-enable and a 4KB sector erase and returns immediately.
+    static void eraseStart(int addr) {
+        SPI::enable();
+        SPI::transfer(0x06); // write enable
+        SPI::disable();
+        SPI::enable();
+        SPI::transfer(0x20); // sector erase
+        SPI::transfer(addr >> 16);
+        SPI::transfer(addr >> 8);
+        SPI::transfer(addr);
+        SPI::disable();
+    }
+
+    // busy reads status register 1 and returns the state of the BUSY bit.
+    static bool busy() {
+        SPI::enable();
+        SPI::transfer(0x05);
+        bool b = SPI::transfer(0) & 1;
+        SPI::disable();
+        return b;
+    }
+};
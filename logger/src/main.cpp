@@ -7,6 +7,7 @@ int printf(const char* fmt, ...); // forward decl to allow .h files to print for
 #include <jee.h>
 #include <string.h>
 #include <jee/spi-flash.h>
+#include "logger/spi-flash-async.h"
 
 #define NUM 50
 typedef struct {
@@ -25,7 +26,7 @@ UartBufDev< PinA<9>, PinA<10>, 80 > console;              // usart1 on FTDI conn
 SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinC<15>, 0 > spiDisp;  // spi1 with display select
 SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinA<4>, 0 > spiRf;     // spi1 with radio select
 SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinC<14>, 0 > spiFlash; // spi1 with flash select
-SpiFlash< decltype(spiFlash) > emem;                      // external dataflash, W25Q128
+SpiFlashAsync< decltype(spiFlash) > emem;                 // external dataflash, W25Q128
 Logger< decltype(emem) > logger;                          // logger going to external flash
 
 // ===== Helper functions for peripherals
@@ -60,11 +61,9 @@ void setup() {
     logger.eraseAll();
 #else
     for (int i=0; i<10; i++) emem.erase(i<<12);
-    EEPROM::write32(32+0, 0);
-    EEPROM::write32(32+4, 0);
-    EEPROM::write32(32+8, 0);
 #endif
     bool lOk = logger.init(32);
+    logger.clear();
     printf("Logger init: %s\r\n", lOk ? "OK" : "ERR");
 }
 
@@ -79,6 +78,12 @@ void printLE(LogEntry &le) {
         printf("]");
 }
 
+// firstLE waits for any background erase to finish and then reads the first entry
+bool firstLE(LogEntry &le) {
+    while (logger.busy()) logger.poll();
+    return logger.firstEntry(&le);
+}
+
 bool checkLE(int i, LogEntry &le) {
     if (le.time != (uint32_t)i) return false;
     for (int j=0; j<NUM; j++) if (le.filler[j] != i+j) return false;
@@ -102,7 +107,7 @@ int main () {
             //printf("Writing %d\r\n", i);
             logger.pushEntry(le);
             memset(&le, 0, sizeof(le));
-            bool feOk = logger.firstEntry(&le);
+            bool feOk = firstLE(le);
             if (!feOk || !checkLE(0, le)) {
                 printf("ERR: "); printLE(le); printf(" %s\r\n\n", feOk ? "OK" : "ERR");
             }
@@ -111,7 +116,7 @@ int main () {
 
         for (int i=0; i<49; i++) {
             LogEntry le;
-            bool feOk = logger.firstEntry(&le);
+            bool feOk = firstLE(le);
             if (!feOk || !checkLE(i, le)) {
                 printf("ERR[%d]: ", i); printLE(le); printf(" %s\r\n\n", feOk ? "OK" : "ERR");
             }
@@ -123,8 +128,7 @@ int main () {
 
     int sz = logger.size();
     printf("\n== Writing %d entries\r\n", sz);
-    EEPROM::write32(32+8, 0);
-    logger.init(32);
+    logger.clear();
     printState();
     for (int i=0; i<sz; i++) {
         LogEntry le;
@@ -136,7 +140,7 @@ int main () {
     printf("Reading back %d entries\r\n", sz);
     for (int i=0; i<sz; i++) {
         LogEntry le;
-        bool feOk = logger.firstEntry(&le);
+        bool feOk = firstLE(le);
         if (!feOk || !checkLE(i, le)) {
             printf("ERR[%d]: ", i); printLE(le); printf(" %s\r\n\n", feOk ? "OK" : "ERR");
         }
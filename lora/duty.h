@@ -0,0 +1,49 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// DutyCycle keeps the tracker's transmissions within the duty-cycle limit of the band, 10% over
+// an hour for the 433.05-434.79MHz SRD band in Europe (ERC/REC 70-03, annex 1). It's a token
+// bucket of airtime: credit accrues at the allowed share of the elapsed time, up to what the
+// whole window allows, and each packet spends its time on air. The remaining credit is the
+// airtime budget that can be spent right now.
+
+struct DutyCycle {
+    uint32_t permille;  // share of the time the radio may transmit, in 1/1000
+    uint32_t cap;       // max credit in usecs
+    uint32_t credit;    // airtime available in usecs
+    uint32_t last;      // ms of the last update
+
+    // init sets the limit to permille of window ms, the full credit is available at first since
+    // nothing was sent during the past window.
+    void init(uint32_t now, uint32_t pm=100, uint32_t window=3600000) {
+        permille = pm;
+        cap = window * pm; // ms*1/1000 = usecs
+        credit = cap;
+        last = now;
+    }
+
+    // update accrues the credit for the time elapsed until now.
+    void update(uint32_t now) {
+        uint64_t c = credit + (uint64_t)(now - last) * permille;
+        credit = c < cap ? c : cap;
+        last = now;
+    }
+
+    // wait returns the number of ms until cost usecs of airtime are available.
+    uint32_t wait(uint32_t cost) {
+        return credit >= cost ? 0 : (cost - credit + permille-1) / permille;
+    }
+
+    void spend(uint32_t cost) { credit = credit > cost ? credit - cost : 0; }
+
+    // airtime returns the time on air in usecs of a packet of len bytes at sf, 125kHz and coding
+    // rate 4/7 as all the RateCtl::conf configurations use, with an 8-symbol preamble, explicit
+    // header and CRC.
+    static uint32_t airtime(int sf, int len) {
+        uint32_t sym = (1000u << sf) / 125;
+        int de = sf >= 11; // low data rate optimization
+        int bits = 8*len - 4*sf + 28 + 16;
+        int div = 4 * (sf - 2*de);
+        int syms = 8 + (bits > 0 ? (bits + div-1) / div * 7 : 0);
+        return sym * (8*4 + 17) / 4 + sym * syms; // preamble is 8+4.25 symbols
+    }
+};
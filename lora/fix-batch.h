@@ -0,0 +1,125 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// FixBatch packs several GPS fixes into one LoRa packet so the preamble, header and ACK turn-around
+// are paid once per batch instead of once per fix. A fix is a row of FixBatch::vals integers in the
+// format of track1's uplink (see FixFields::values in logger/fix-fields.h). The first fix of a
+// batch is a keyframe and the following ones are deltas against a prediction from the previous
+// fixes: the previous value, or for the time, lat and lon the previous value plus the previous
+// change, as in PackedLogger. Each fix is encoded as a 16-bit little-endian bitmap of the values
+// whose delta is non-zero followed by the zigzag varint (7 bits per byte, low bits first) of each
+// of those deltas, so a follow-up fix at 1Hz is typically 6-9 bytes. A batch starts with the number
+// of fixes in it. See window.h for the packets that carry batches.
+
+#include "gps/date.h"
+
+// RadioFix names the values of a fix sent over the radio, see FixFields::values for the units.
+struct RadioFix {
+    int32_t date;   // DDMMYY
+    int32_t time;   // dHHMMSS
+    int32_t lat, lon, alt, speed, course, sats, hdop, hr;
+};
+
+struct FixBatch {
+    static constexpr int vals = 10;             // values per fix
+    static constexpr uint32_t linear = 0x0e;    // time, lat and lon change at a steady rate
+    static constexpr int maxFix = 2 + 5*vals;   // max bytes of an encoded fix
+    static_assert(sizeof(RadioFix) == vals*4, "RadioFix must match the values");
+
+    uint8_t *buf;   // batch being filled, buf[0] holds the number of fixes
+    int len;        // space available in buf
+    int pos;        // bytes of buf used
+    int k;          // number of fixes seen, at most 2
+    int32_t p1[vals], p2[vals]; // previous two fixes
+
+    // begin starts a batch in buf, which has room for len bytes.
+    void begin(uint8_t *b, int l) {
+        buf = b;
+        len = l;
+        pos = 1;
+        buf[0] = 0;
+        k = 0;
+    }
+
+    // add appends a fix to the batch and returns true, or false if it doesn't fit, in which case
+    // the batch is unchanged.
+    bool add(const int32_t *v) {
+        uint8_t f[maxFix];
+        int n = 2;
+        uint16_t map = 0;
+        for (int i=0; i<vals; i++) {
+            uint32_t d = (uint32_t)v[i] - predict(i);
+            if (d == 0) continue;
+            map |= 1 << i;
+            uint32_t z = (d << 1) ^ (uint32_t)((int32_t)d >> 31); // zigzag
+            for (; z >= 0x80; z >>= 7) f[n++] = 0x80 | (z & 0x7f);
+            f[n++] = z;
+        }
+        f[0] = map;
+        f[1] = map >> 8;
+        if (pos+n > len || buf[0] == 255) return false;
+        memcpy(buf+pos, f, n);
+        pos += n;
+        buf[0]++;
+        shift(v);
+        return true;
+    }
+
+    int count() { return buf[0]; } // number of fixes in the batch
+    int size() { return pos; }     // number of bytes in the batch
+
+    // decode unpacks the batch of len bytes in b into rows, up to max of them, and returns the
+    // number of fixes, or -1 if the batch is malformed.
+    static int decode(const uint8_t *b, int len, int32_t (*rows)[vals], int max) {
+        if (len < 1) return -1;
+        int cnt = b[0], pos = 1;
+        FixBatch d;
+        d.k = 0;
+        for (int r=0; r<cnt; r++) {
+            if (pos+2 > len) return -1;
+            uint16_t map = b[pos] | b[pos+1] << 8;
+            pos += 2;
+            int32_t v[vals];
+            for (int i=0; i<vals; i++) {
+                uint32_t z = 0;
+                if (map & (1 << i)) {
+                    for (int sh=0; ; sh += 7) {
+                        if (pos >= len || sh > 28) return -1;
+                        z |= (uint32_t)(b[pos] & 0x7f) << sh;
+                        if (!(b[pos++] & 0x80)) break;
+                    }
+                }
+                v[i] = d.predict(i) + ((z >> 1) ^ -(z & 1));
+            }
+            if (r < max) memcpy(rows[r], v, sizeof(v));
+            d.shift(v);
+        }
+        return pos == len ? (cnt < max ? cnt : max) : -1;
+    }
+
+    // fix returns the values v of a fix by name.
+    static RadioFix fix(const int32_t *v) {
+        RadioFix f;
+        memcpy(&f, v, sizeof(f));
+        return f;
+    }
+
+    // time returns the time of the fix with values v in seconds since 2000-01-01.
+    static uint32_t time(const int32_t *v) {
+        int hms = v[1] % 1000000;
+        return (uint32_t)dateDays(v[0]) * 86400 + hms/10000*3600 + hms/100%100*60 + hms%100;
+    }
+
+    // predict is an internal function that returns the predicted value i of the next fix.
+    uint32_t predict(int i) {
+        if (k == 0) return 0;
+        if (k == 1 || !(linear & (1u<<i))) return p1[i];
+        return 2*(uint32_t)p1[i] - (uint32_t)p2[i];
+    }
+
+    // shift is an internal function to make v the previous fix.
+    void shift(const int32_t *v) {
+        memcpy(p2, p1, sizeof(p1));
+        memcpy(p1, v, sizeof(p1));
+        if (k < 2) k++;
+    }
+};
@@ -0,0 +1,84 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Framing of binary records over a serial line: a record is followed by its CRC-16/CCITT (poly
+// 0x1021, init 0xffff, high byte first), the whole is COBS encoded so it contains no 0 byte, and a
+// 0 byte ends the frame. A receiver that starts in the middle of a frame or loses bytes resyncs at
+// the next 0 and the CRC rejects the damaged frame. COBS adds one byte per 254, so a frame is at
+// most maxRecord+5 bytes.
+
+struct Frame {
+    static constexpr int maxRecord = 250;
+    static constexpr int maxFrame = maxRecord + 2 + 2 + 1; // CRC, COBS overhead, delimiter
+
+    static uint16_t crc16(const uint8_t *b, int len, uint16_t crc=0xffff) {
+        for (int i=0; i<len; i++) {
+            crc ^= b[i] << 8;
+            for (int k=0; k<8; k++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+        return crc;
+    }
+
+    // encode frames the len bytes of rec into out, which has room for maxFrame bytes, and returns
+    // the length of the frame, or 0 if the record is too long.
+    static int encode(const uint8_t *rec, int len, uint8_t *out) {
+        if (len > maxRecord) return 0;
+        uint16_t crc = crc16(rec, len);
+        int code = 0, n = 1; // out[code] is the pending code byte
+        for (int i=0; i<len+2; i++) {
+            uint8_t c = i < len ? rec[i] : i == len ? crc >> 8 : crc & 0xff;
+            if (c != 0) out[n++] = c;
+            if (c == 0 || n - code == 0xff) {
+                out[code] = n - code;
+                code = n++;
+            }
+        }
+        out[code] = n - code;
+        out[n++] = 0;
+        return n;
+    }
+};
+
+// Deframer reassembles records from the bytes received.
+struct Deframer {
+    uint8_t buf[Frame::maxFrame];
+    int n;          // bytes of the current frame
+    uint32_t bad;   // frames dropped because they were malformed or failed the CRC
+
+    void init() { n = 0; bad = 0; }
+
+    // feed adds the byte c and, if it ends a good frame, decodes the record into rec, which has
+    // room for Frame::maxRecord bytes, and returns its length, else it returns 0.
+    int feed(uint8_t c, uint8_t *rec) {
+        if (c != 0) {
+            if (n < (int)sizeof(buf)) buf[n++] = c;
+            else n = sizeof(buf) + 1; // too long, dropped at the delimiter
+            return 0;
+        }
+        int len = n;
+        n = 0;
+        if (len == 0) return 0; // empty frame, e.g. sent to resync
+        if (len > (int)sizeof(buf)) {
+            bad++;
+            return 0;
+        }
+        // decode in place, each code byte makes room for the 0 it stands for so the record never
+        // overtakes the bytes it's decoded from, then check the CRC and copy out the record
+        int r = 0;
+        for (int i=0; i<len; ) {
+            int code = buf[i++];
+            if (i + code-1 > len) {
+                bad++;
+                return 0;
+            }
+            for (int k=1; k<code; k++) buf[r++] = buf[i++];
+            if (code < 0xff && i < len) buf[r++] = 0;
+        }
+        if (r < 3 || r-2 > Frame::maxRecord ||
+                Frame::crc16(buf, r-2) != (buf[r-2] << 8 | buf[r-1])) {
+            bad++;
+            return 0;
+        }
+        memcpy(rec, buf, r-2);
+        return r-2;
+    }
+};
@@ -0,0 +1,354 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// GwCore is the GW side of the radio protocol: it receives packets, decodes the batches of fixes
+// in data packets, keeps a RecvWindow per node so each batch is delivered once, answers each
+// packet with an ACK, and switches the SF it listens at to the slowest one the nodes heard in
+// the last minute ask for, or to the home SF during a short slot each minute (see window.h).
+// The fixes of a packet that arrives ahead of one that's missing are held back, as many as fit,
+// until the missing one comes in so the fixes of each node come out in time order, and the
+// newest fix a live packet carries comes out right away unless a newer one already did. The XOR
+// of the data packets of a group a parity packet protects is collected per node, in one of a
+// few slots, so the one packet of the group that was lost can be rebuilt (see uplink.h), and
+// only packets that ask for it are ACKed.
+// RADIO is JeeH's RF96lora or SimRadio (sim-radio.h).
+// The caller calls poll from its main loop and prints or forwards what was received, and can
+// print the per-node link statistics from nodes and the distributions by SF from links.
+//
+// A node is a tracker with the 5-bit node ID in the packet header, the table has a fixed entry
+// for each of the 32 IDs so a fleet can share one GW without any allocation.
+
+template< typename RADIO >
+struct GwCore {
+    static constexpr int maxNodes = 32;     // node IDs are 5 bits
+    static constexpr int maxFixes = 32;     // max fixes decoded from one packet
+    static constexpr int maxHeld = 16;      // max fixes held back for a missing packet
+    static constexpr int maxGroups = 4;     // nodes whose parity groups are collected at once
+    static constexpr uint32_t quiet = RateCtl::quiet; // ms until a node no longer sets the SF
+
+    // Node is what the GW knows about a tracker
+    struct Node {
+        RecvWindow win;     // uplink state, incl. the last sequence number
+        uint8_t sf;         // SF the node asked for
+        uint32_t heard;     // ms when last heard from
+        uint32_t live;      // time of the newest live fix passed on, see FixBatch::time
+        // link statistics
+        uint32_t packets;   // packets received, incl. duplicates and parity packets
+        uint32_t dups;      // duplicates of packets received before
+        uint32_t rebuilt;   // packets rebuilt from a parity packet
+        uint32_t fixes;     // fixes passed on, incl. live ones
+        int16_t rssi;       // RSSI of the last packet in dBm
+        int8_t margin;      // margin of the last packet at the GW in dB
+        int8_t nodeMargin;  // margin the node reported for the last ACK it got in dB
+        uint8_t rxSF;       // SF the last packet came at
+        Hist<0, 4, 12> margins; // distribution of the margin at the GW, coarse to save RAM
+    };
+
+    // Held is a fix waiting for a packet that was sent before the one it came in
+    struct Held {
+        uint8_t node, session, seq; // packet it came in
+        int32_t row[FixBatch::vals];
+    };
+
+    RADIO *radio;
+    uint32_t freq;          // frequency passed to the radio
+    Node nodes[maxNodes];
+    int listenSF;           // SF the radio is at
+    uint32_t newest;        // time of the newest fix received, see FixBatch::time
+    uint32_t utcPhase;      // ms to add to the clock to be in step with UTC mod slotEvery
+    LinkStats links[RateCtl::maxSF-RateCtl::minSF+1]; // link statistics by SF, see link-stats.h
+    Held held[maxHeld];
+    int nHeld;
+    // Group is the XOR of the data packets of a node's group received so far, from the type to
+    // the end of the batch
+    struct Group {
+        uint8_t node, session, seq; // node and the first packet, seq is valid if mask isn't 0
+        uint8_t mask;       // packets in buf, bit i for seq+i
+        uint8_t len;        // XOR of their lengths
+        uint32_t at;        // ms when the last one came, the oldest slot is reused
+        uint8_t buf[128];
+    };
+    Group groups[maxGroups];
+    // last packet received
+    uint8_t packet[256];
+    uint8_t node;           // node it came from
+    bool data;              // it's a data packet
+    bool fresh;             // it's not a duplicate
+    bool recovered;         // it was rebuilt from a parity packet
+    int fixes;              // number of fixes in rows, -1 if the batch was malformed
+    int32_t rows[maxFixes+maxHeld][FixBatch::vals]; // fixes to pass on, oldest first
+    bool live;              // liveRow has a new live fix
+    int32_t liveRow[FixBatch::vals];
+    int16_t margin;         // margin the node reported in its info trailer, 0 if none
+
+    void init(RADIO &r, uint32_t f) {
+        radio = &r;
+        freq = f;
+        memset(nodes, 0, sizeof(nodes));
+        for (int i=0; i<RateCtl::maxSF-RateCtl::minSF+1; i++) links[i].init();
+        listenSF = RateCtl::homeSF;
+        newest = utcPhase = 0;
+        nHeld = 0;
+        memset(groups, 0, sizeof(groups));
+    }
+
+    // wantSF returns the SF to listen at outside of the home SF slots: the slowest requested by
+    // the nodes heard from in the last minute, except for the home SF since those nodes send in
+    // the slots, or the home SF if none were.
+    int wantSF(uint32_t now) {
+        int sf = 0;
+        for (int i=0; i<maxNodes; i++)
+            if (nodes[i].win.valid && now - nodes[i].heard < quiet && nodes[i].sf > sf &&
+                    nodes[i].sf != RateCtl::homeSF)
+                sf = nodes[i].sf;
+        return sf ? sf : RateCtl::homeSF;
+    }
+
+    // slotTime returns how many ms ago the last home SF slot started, the slots start on the full
+    // UTC minute as far as the newest fix received tells, see window.h.
+    uint32_t slotTime(uint32_t now) {
+        return (now % RateCtl::slotEvery + utcPhase) % RateCtl::slotEvery;
+    }
+
+    // setSF switches the radio to listen at sf, keeping the TX power.
+    void setSF(int sf) {
+        int pow = radio->txpow;
+        radio->init(61, 0xcb, *RateCtl::conf(sf), freq);
+        radio->txPower(pow);
+        listenSF = sf;
+    }
+
+    // release appends the fixes held for node n that no longer wait for a missing packet to rows
+    // and sorts rows by time.
+    void release(uint8_t n) {
+        RecvWindow &w = nodes[n].win;
+        int k = 0;
+        for (int i=0; i<nHeld; i++) {
+            Held &h = held[i];
+            if (h.node == n && (h.session != w.session || (int8_t)(h.seq - w.cum) < 0))
+                memcpy(rows[fixes++], h.row, sizeof(h.row));
+            else
+                held[k++] = h;
+        }
+        nHeld = k;
+        for (int i=1; i<fixes; i++) { // insertion sort, rows are mostly in order
+            int32_t r[FixBatch::vals];
+            memcpy(r, rows[i], sizeof(r));
+            uint32_t t = FixBatch::time(r);
+            int j = i;
+            for (; j > 0 && FixBatch::time(rows[j-1]) > t; j--)
+                memcpy(rows[j], rows[j-1], sizeof(r));
+            memcpy(rows[j], r, sizeof(r));
+        }
+    }
+
+    // printNodes prints the link statistics of the nodes heard from, now is the time in ms, and
+    // of each SF.
+    void printNodes(uint32_t now) {
+        printf("node  pkts  dups rebuilt fixes seq     SF RSSI    margin p10/50 remote\r\n");
+        for (int i=0; i<maxNodes; i++) {
+            Node &n = nodes[i];
+            if (n.packets == 0) continue;
+            printf("%4d %5d %5d %7d %5d %3d:%-3d %2d %4ddBm %4ddB %3d %3ddB %4ddB  %ds ago\r\n",
+                i, n.packets, n.dups, n.rebuilt, n.fixes, n.win.session, n.win.cum, n.rxSF,
+                n.rssi, n.margin, n.margins.quantile(10), n.margins.quantile(50), n.nodeMargin,
+                (now - n.heard) / 1000);
+        }
+        LinkStats::print("SF", links, RateCtl::maxSF-RateCtl::minSF+1, RateCtl::minSF);
+    }
+
+    // group returns the slot collecting the group of node n, or if add is set a new one, the
+    // oldest if none is free, or 0.
+    Group *group(uint8_t n, bool add, uint32_t now) {
+        Group *g = 0;
+        for (int i=0; i<maxGroups; i++) {
+            if (groups[i].mask && groups[i].node == n) return &groups[i];
+            if (!g || (g->mask && (!groups[i].mask || now - groups[i].at > now - g->at)))
+                g = &groups[i];
+        }
+        if (!add) return 0;
+        g->mask = 0;
+        g->node = n;
+        return g;
+    }
+
+    // collect adds the fresh data packet in packet, of length len, to its node's group if it's
+    // part of one, i.e. it doesn't ask for an ACK, and ends the group otherwise.
+    void collect(int len, uint32_t now) {
+        bool member = !(packet[0] & 0x20);
+        Group *g = group(node, member, now);
+        if (!g) return;
+        if (!member) {
+            g->mask = 0;
+            return;
+        }
+        uint8_t d = packet[3] - g->seq;
+        if (!g->mask || g->session != packet[2] || d >= SendWindow::size) {
+            // the first packet of a group, or of the next one if the parity packet was lost
+            memset(g->buf, 0, sizeof(g->buf));
+            g->session = packet[2];
+            g->seq = packet[3];
+            g->mask = g->len = d = 0;
+        }
+        int l = len-1-2;
+        for (int i=0; i<l; i++) g->buf[i] ^= packet[1+i];
+        g->len ^= l;
+        g->mask |= 1 << d;
+        g->at = now;
+    }
+
+    // recover rebuilds the packet the parity packet in packet protects if it's the only one of
+    // the group the GW is missing and it has collected the others, and ends the group. The
+    // packet replaces the parity packet, with a blank info trailer, and recover returns its
+    // length, or 0 if nothing was rebuilt.
+    int recover(int len, uint32_t now) {
+        RecvWindow &w = nodes[node].win;
+        Group *g = group(node, false, now);
+        if (!g) return 0;
+        uint8_t got = g->mask;
+        g->mask = 0;
+        uint8_t sess = packet[2], seq0 = packet[3], k = packet[5];
+        int plen = len - 7 - 2;
+        if (!w.valid || w.session != sess || g->session != sess || k > SendWindow::size ||
+                plen > 128) return 0;
+        // the group has to hold exactly the packets the GW has, the one missing is rebuilt
+        int missing = 0;
+        uint8_t mask = 0;
+        for (int i=0; i<k; i++) {
+            uint8_t seq = seq0 + i, d = seq - g->seq;
+            if (!w.has(seq))
+                missing++;
+            else if (d >= SendWindow::size)
+                return 0;
+            else
+                mask |= 1 << d;
+        }
+        uint8_t l = packet[6] ^ g->len;
+        if (missing != 1 || mask != got || l < 4 || l > plen) return 0;
+        for (int i=0; i<l; i++) packet[1+i] = packet[7+i] ^ g->buf[i];
+        packet[l+1] = packet[l+2] = 0;
+        return l + 3;
+    }
+
+    // poll receives a packet and ACKs it, now is the time in milliseconds. It returns the length
+    // of the packet, or 0 if nothing was received. A malformed batch isn't ACKed so the tracker
+    // sends it again, and fixes in a packet that was received before are ACKed again but the
+    // packet isn't fresh. The fixes to pass on are in rows and, if live is set, liveRow.
+    // A parity packet is ACKed like a data packet and if the packet it rebuilt has fixes, data
+    // and recovered are set.
+    int poll(uint32_t now) {
+        int len = radio->receive(packet, sizeof(packet));
+        if (len < 2) {
+            // nothing... switch SF once an ACK announcing it has gone out, or go back to the
+            // home SF once nobody has been heard from for a while or for its slot
+            int sf = slotTime(now) < RateCtl::slotLen ? RateCtl::homeSF : wantSF(now);
+            if (listenSF != sf) setSF(sf);
+            return 0;
+        }
+
+        margin = 0;
+        if (len > 4 && packet[1] & 0x80) {
+            margin = packet[len-2] & 0x3f;
+            radio->adjustPow(margin);
+        }
+
+        node = packet[0] & 0x1f;
+        int rxLen = len;
+        Node &st = nodes[node];
+        st.packets++;
+        st.rssi = radio->rssi;
+        st.margin = radio->margin;
+        st.nodeMargin = margin;
+        st.rxSF = listenSF;
+        st.margins.add(radio->margin);
+        links[listenSF-RateCtl::minSF].packet(radio->margin, radio->rssi, radio->fei);
+        bool parity = len > 9 && packet[1] == SendWindow::parityType;
+        recovered = false;
+        if (parity) {
+            int l = recover(len, now);
+            if (l) {
+                len = l;
+                recovered = true;
+            }
+        }
+        bool isLive = packet[1] == SendWindow::liveType;
+        data = len > 5 && (packet[1] == SendWindow::dataType || isLive);
+        fresh = live = false;
+        fixes = 0;
+        if (data) {
+            int m = FixBatch::decode(packet+5, len-5-2, rows, maxFixes); // minus info trailer
+            if (m < 0) {
+                fixes = -1;
+                return rxLen;
+            }
+            Node &nd = nodes[node];
+            if (m > 0 && !recovered && FixBatch::time(rows[m-1]) > newest) {
+                // the newest fix so far was taken a bit before the packet started, which puts
+                // the clock in step with UTC for the slots
+                newest = FixBatch::time(rows[m-1]);
+                uint32_t start = now - DutyCycle::airtime(listenSF, rxLen) / 1000;
+                utcPhase = (newest % (RateCtl::slotEvery/1000) * 1000 + RateCtl::slotEvery -
+                        start % RateCtl::slotEvery) % RateCtl::slotEvery;
+            }
+            if (isLive && m > 0) {
+                // the live fix is the last one, it's passed on if it's the newest so far
+                uint32_t t = FixBatch::time(rows[--m]);
+                live = t > nd.live;
+                if (live) {
+                    nd.live = t;
+                    memcpy(liveRow, rows[m], sizeof(liveRow));
+                }
+            }
+            fresh = nd.win.receive(packet[2], packet[3], packet[3] - (packet[4] >> 4));
+            if (fresh && !recovered) collect(len, now);
+            if (fresh) {
+                // hold the fixes back if a packet before this one is missing
+                bool ahead = (int8_t)(packet[3] - nd.win.cum) >= 0;
+                for (int i=0; i<m; i++) {
+                    if (ahead && nHeld < maxHeld) {
+                        Held &h = held[nHeld++];
+                        h.node = node;
+                        h.session = packet[2];
+                        h.seq = packet[3];
+                        memcpy(h.row, rows[i], sizeof(h.row));
+                    } else {
+                        memmove(rows[fixes++], rows[i], sizeof(rows[i]));
+                    }
+                }
+            }
+            release(node);
+        }
+        if (data || parity) {
+            Node &nd = nodes[node];
+            int sf = packet[4] & 0x0f;
+            if (sf >= RateCtl::minSF && sf <= RateCtl::maxSF) nd.sf = sf;
+            nd.heard = now;
+            if (data && !fresh) nd.dups++;
+            if (data) links[listenSF-RateCtl::minSF].exchange(!fresh);
+            if (recovered) nd.rebuilt++;
+            nd.fixes += fixes + live;
+        }
+        if (!(packet[0] & 0x20)) return rxLen; // no ACK requested
+
+        uint8_t ack[10];
+        int alen = 0;
+        RecvWindow &w = nodes[node].win;
+        if (data || (parity && w.valid && w.session == packet[2])) {
+            // cumulative and selective ACK of the packets received in the session, a parity
+            // packet of a session the GW has no data packet of, e.g. after it restarted, only
+            // gets the info trailer since there's nothing to ACK
+            ack[alen++] = SendWindow::ackType;
+            ack[alen++] = w.session;
+            ack[alen++] = w.cum;
+            ack[alen++] = w.sel;
+            ack[alen++] = wantSF(now); // the SF to use from now on
+            // when the next home SF slot starts
+            ack[alen++] = (RateCtl::slotEvery - slotTime(now)) / RateCtl::slotUnit;
+        } else {
+            ack[alen++] = 0x80; // packet type 0, got info trailer
+        }
+        ack[alen++] = (uint8_t)(-radio->rssi);
+        radio->addInfo(ack+alen);
+        radio->send(0xC0 | node, ack, alen+2); // ACK from GW
+        return rxLen;
+    }
+};
@@ -0,0 +1,165 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// GwOut is the GW's output to the host: binary records in frames (see frame.h) queued in a ring
+// buffer of N bytes that the main loop moves into the UART's buffer as it has room, so receiving
+// and ACKing never waits for the serial line. A frame that doesn't fit whole in the ring is dropped
+// and counted rather than blocking. A record starts with its type, multi-byte values are little
+// endian:
+//   'T' text: a line of text without its line end
+//   'P' packet: node, packet type, session, seq, length, -RSSI in dBm, margin in dB, margin the
+//       node reported in dB, SF, flags (see below), number of fixes passed on
+//   'F' fixes: node, 1 if it's the live fix else 0, a FixBatch with the fixes, a packet's fixes
+//       take as many records as needed
+//   'N' node statistics: node, packets, dups, rebuilt, fixes (4 bytes each), session, cum, SF,
+//       RSSI in dBm (2 bytes), margin, margin the node reported, secs since last heard (4 bytes),
+//       10th and 50th percentile of the margin
+//   'L' link statistics of an SF (see link-stats.h): SF, 10th, 50th and 90th percentile of the
+//       margin in dB and of -RSSI in dBm, median frequency error in Hz (2 bytes), share of
+//       duplicates in percent
+// gwhost (gwhost/src/main.cpp) turns the records back into text.
+
+template< int N >
+struct GwOut {
+    static constexpr uint8_t textRec = 'T', packetRec = 'P', fixRec = 'F', nodeRec = 'N',
+        linkRec = 'L';
+    // flags of a packet record
+    static constexpr uint8_t isData = 1, isFresh = 2, isRebuilt = 4, hasLive = 8, isBad = 16;
+
+    uint8_t ring[N];
+    int head, tail;     // next byte to put and to get
+    uint32_t frames;    // frames queued
+    uint32_t dropped;   // frames dropped because the ring was full
+    uint8_t rec[Frame::maxRecord]; // record being built
+    int len;            // its length
+
+    void init() { head = tail = 0; frames = dropped = 0; len = 0; }
+
+    int avail() { return (head - tail + N) % N; }
+    int space() { return N-1 - avail(); }
+
+    // put frames the record in rec and queues it, returns false if it was dropped.
+    bool put() {
+        uint8_t f[Frame::maxFrame];
+        int n = Frame::encode(rec, len, f);
+        len = 0;
+        if (n == 0 || n > space()) {
+            dropped++;
+            return false;
+        }
+        for (int i=0; i<n; i++) {
+            ring[head] = f[i];
+            head = (head+1) % N;
+        }
+        frames++;
+        return true;
+    }
+
+    // drain moves queued bytes to the UART until its buffer is full, UART is JeeH's UartBufDev
+    // or anything with writable and putc.
+    template< typename UART >
+    void drain(UART &uart) {
+        while (tail != head && uart.writable()) {
+            uart.putc(ring[tail]);
+            tail = (tail+1) % N;
+        }
+    }
+
+    void add(uint8_t b) { rec[len++] = b; }
+    void add32(uint32_t v) { for (int i=0; i<4; i++) add(v >> 8*i); }
+
+    // text queues a line of l characters.
+    void text(const char *s, int l) {
+        if (l > Frame::maxRecord-1) l = Frame::maxRecord-1;
+        add(textRec);
+        memcpy(rec+len, s, l);
+        len += l;
+        put();
+    }
+
+    // packet queues the packet record and the fixes of the packet the GW just received, GW is a
+    // GwCore, rxLen is what its poll returned.
+    template< typename GW >
+    void packet(GW &gw, int rxLen) {
+        uint8_t flags = (gw.data ? isData : 0) | (gw.fresh ? isFresh : 0) |
+            (gw.recovered ? isRebuilt : 0) | (gw.live ? hasLive : 0) |
+            (gw.data && gw.fixes < 0 ? isBad : 0);
+        typename GW::Node &n = gw.nodes[gw.node];
+        add(packetRec);
+        add(gw.node);
+        add(gw.packet[1]);
+        add(gw.packet[2]);
+        add(gw.packet[3]);
+        add(rxLen);
+        add(-n.rssi);
+        add(n.margin);
+        add(n.nodeMargin);
+        add(n.rxSF);
+        add(flags);
+        add(gw.fixes < 0 ? 0 : gw.fixes);
+        put();
+        if (gw.live) fixes(gw.node, true, &gw.liveRow, 1);
+        if (gw.fixes > 0) fixes(gw.node, false, gw.rows, gw.fixes);
+    }
+
+    // fixes queues n fixes of node in as many records as they need.
+    void fixes(uint8_t node, bool live, const int32_t (*rows)[FixBatch::vals], int n) {
+        FixBatch b;
+        for (int i=0; i<n; ) {
+            add(fixRec);
+            add(node);
+            add(live);
+            b.begin(rec+len, sizeof(rec)-len);
+            while (i < n && b.add(rows[i])) i++;
+            len += b.size();
+            put();
+        }
+    }
+
+    // nodes queues the statistics of the nodes GW heard from, now is the time in ms.
+    template< typename GW >
+    void nodes(GW &gw, uint32_t now) {
+        for (int i=0; i<GW::maxNodes; i++) {
+            typename GW::Node &n = gw.nodes[i];
+            if (n.packets == 0) continue;
+            add(nodeRec);
+            add(i);
+            add32(n.packets);
+            add32(n.dups);
+            add32(n.rebuilt);
+            add32(n.fixes);
+            add(n.win.session);
+            add(n.win.cum);
+            add(n.rxSF);
+            add(n.rssi);
+            add(n.rssi >> 8);
+            add(n.margin);
+            add(n.nodeMargin);
+            add32((now - n.heard) / 1000);
+            add(n.margins.quantile(10));
+            add(n.margins.quantile(50));
+            put();
+        }
+    }
+
+    // links queues the link statistics of the SFs GW heard packets at.
+    template< typename GW >
+    void links(GW &gw) {
+        for (int sf=RateCtl::minSF; sf<=RateCtl::maxSF; sf++) {
+            LinkStats &l = gw.links[sf-RateCtl::minSF];
+            if (l.margin.n == 0) continue;
+            add(linkRec);
+            add(sf);
+            add(l.margin.quantile(10));
+            add(l.margin.quantile(50));
+            add(l.margin.quantile(90));
+            add(-l.rssi.quantile(10));
+            add(-l.rssi.quantile(50));
+            add(-l.rssi.quantile(90));
+            int f = l.fei.quantile(50);
+            add(f);
+            add(f >> 8);
+            add(l.loss());
+            put();
+        }
+    }
+};
@@ -0,0 +1,141 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Link statistics in fixed memory: Hist is a streaming histogram that answers percentile queries
+// about the recent samples of a value, and LinkStats keeps one per quantity of a link (margin,
+// RSSI, frequency error, ACK round-trip time) plus the share of failed exchanges. Single samples
+// of a fading link jump by 10dB and more, the percentiles show what the link reliably does, e.g.
+// the 10th percentile of the margin is what 90% of the packets got.
+//
+// Hist counts the samples in BINS bins of STEP centered on LO, LO+STEP, etc, samples outside the
+// range go to the first or last bin. When window samples have been counted all the counts are
+// halved, so the histogram follows a link that changes, with the older samples weighing less and
+// less, and a count fits in a byte. LogHist does the same with bins a quarter octave wide, for
+// values that span several orders of magnitude such as the round-trip times from SF7 to SF12.
+
+template< int LO, int STEP, int BINS >
+struct Hist {
+    static constexpr int window = 128;
+
+    uint8_t bins[BINS];
+    uint8_t n;          // samples counted, 0 if none
+
+    void init() { memset(bins, 0, sizeof(bins)); n = 0; }
+
+    void add(int v) {
+        int i = v < LO ? 0 : (v - LO + STEP/2) / STEP;
+        bins[i < BINS ? i : BINS-1]++;
+        if (++n < window) return;
+        n = 0;
+        for (int j=0; j<BINS; j++) n += bins[j] -= bins[j] / 2;
+    }
+
+    // quantile returns the value below which pct percent of the samples are, rounded to the
+    // center of its bin, or 0 if there are none.
+    int quantile(int pct) {
+        if (n == 0) return 0;
+        int k = (n * pct + 99) / 100, c = 0, i = 0;
+        if (k < 1) k = 1;
+        for (; i < BINS-1; i++)
+            if ((c += bins[i]) >= k) break;
+        return LO + i*STEP;
+    }
+};
+
+// LogHist counts the samples in quarter-octave bins from 2^LO to 2^(LO+OCTAVES), i.e. 2^m,
+// 1.25*2^m, 1.5*2^m and 1.75*2^m up to the next octave, plus a bin for the samples below 2^LO.
+template< int LO, int OCTAVES >
+struct LogHist {
+    static constexpr int window = 128;
+    static constexpr int BINS = 1 + 4*OCTAVES;
+
+    uint8_t bins[BINS];
+    uint8_t n;          // samples counted, 0 if none
+
+    void init() { memset(bins, 0, sizeof(bins)); n = 0; }
+
+    void add(int v) {
+        int i = 0;
+        if (v >= 1 << LO) {
+            int m = LO;
+            while (m < LO+OCTAVES && v >> (m+1)) m++;
+            i = 1 + 4*(m-LO) + (v >> (m-2) & 3);
+        }
+        bins[i < BINS ? i : BINS-1]++;
+        if (++n < window) return;
+        n = 0;
+        for (int j=0; j<BINS; j++) n += bins[j] -= bins[j] / 2;
+    }
+
+    // quantile returns the value below which pct percent of the samples are, rounded to the
+    // center of its bin, or 0 if there are none.
+    int quantile(int pct) {
+        if (n == 0) return 0;
+        int k = (n * pct + 99) / 100, c = 0, i = 0;
+        if (k < 1) k = 1;
+        for (; i < BINS-1; i++)
+            if ((c += bins[i]) >= k) break;
+        if (i == 0) return (1 << LO) / 2;
+        int m = LO + (i-1) / 4;
+        return (1 << m) + (2*((i-1) % 4) + 1) * (1 << m) / 8;
+    }
+};
+
+// LinkStats holds the distributions of one link, e.g. a node's or an SF's. Failures are the lost
+// ACKs at the tracker and the duplicates at the GW (which means its ACK didn't make it), and are
+// counted over the same window as the histograms. The GW has no ACK round-trip times.
+struct LinkStats {
+    Hist<0, 2, 20> margin;          // dB
+    Hist<-140, 4, 20> rssi;         // dBm
+    Hist<-10000, 1000, 20> fei;     // Hz
+    LogHist<6, 7> rtt;              // ms, 64ms to 8s
+    uint8_t tries, fails;           // exchanges and those that failed
+
+    void init() {
+        margin.init();
+        rssi.init();
+        fei.init();
+        rtt.init();
+        tries = fails = 0;
+    }
+
+    // packet counts a packet received with margin dB, rssi dBm and a frequency error of f Hz.
+    void packet(int m, int r, int f) {
+        margin.add(m);
+        rssi.add(r);
+        fei.add(f);
+    }
+
+    // exchange counts an exchange that failed or not.
+    void exchange(bool failed) {
+        tries++;
+        fails += failed;
+        if (tries < margin.window) return;
+        tries -= tries / 2;
+        fails -= fails / 2;
+    }
+
+    // loss returns the share of the exchanges that failed in percent.
+    int loss() { return tries ? fails * 100 / tries : 0; }
+
+    // print prints a table of the n links in l, the first one named first and the others numbered
+    // from there, e.g. the SFs, skipping those with no packets.
+    static void print(const char *what, LinkStats *l, int n, int first) {
+        printf("%-4s margin p10/50/90  RSSI p10/50/90  FEI p50  RTT p50/90  loss\r\n", what);
+        for (int i=0; i<n; i++) {
+            LinkStats &s = l[i];
+            if (s.margin.n == 0 && s.tries == 0) continue;
+            if (s.margin.n) {
+                printf("%4d %5d %3d %3ddB %5d %4d %4d %6dHz", first+i,
+                    s.margin.quantile(10), s.margin.quantile(50), s.margin.quantile(90),
+                    s.rssi.quantile(10), s.rssi.quantile(50), s.rssi.quantile(90),
+                    s.fei.quantile(50));
+            } else { // only failed exchanges, nothing was measured
+                printf("%4d %5s %3s %3s   %5s %4s %4s %6s  ", first+i, "-", "-", "-", "-", "-",
+                    "-", "-");
+            }
+            if (s.rtt.n) printf(" %5d %4dms", s.rtt.quantile(50), s.rtt.quantile(90));
+            else printf("     -      ");
+            printf(" %4d%%\r\n", s.loss());
+        }
+    }
+};
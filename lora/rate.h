@@ -0,0 +1,123 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// RateCtl is the tracker's adaptive data rate controller: it picks the spreading factor (SF7 to
+// SF12 at 125kHz) and TX power from the link margins reported with each ACK, i.e. how far above
+// its sensitivity the GW received the packet and how far above ours the ACK came in. The worse
+// of the two is smoothed together with its deviation (as TCP does for RTTs) and the controller
+// keeps the smoothed margin minus the deviation at target. When short it raises the power first
+// and then the SF, when there's more than target+hyst to spare it lowers the SF first, since
+// each step roughly halves the airtime, and then the power. Each SF step is worth 2.5dB of
+// sensitivity, and after a change the smoothed margin is adjusted by the expected difference so
+// the next decision doesn't have to wait for fresh samples. Lowering needs hold ACKs since the
+// last change, which together with hyst prevents flapping. Lost ACKs count too: the second in a
+// row raises the power or the SF and the third the power to the maximum. Once there has been no
+// ACK for quiet ms the link is lost and the uplink starts over at homeSF at full power, which is
+// also where the GW goes back to when it doesn't hear from any node for that long, and where it
+// listens for slotLen ms every slotEvery ms in any case (see window.h).
+//
+// Margins are in quarter dB internally. conf maps an SF to JeeH's LoRaConfig, so this has to be
+// included after the radio driver (or sim-radio.h).
+
+struct RateCtl {
+    static constexpr int minSF = 7, maxSF = 12;
+    static constexpr int homeSF = 12;       // SF to fall back to when the link is lost
+    static constexpr int minPow = 2, maxPow = 20; // TX power range in dBm
+    static constexpr int step = 10;         // sensitivity gained per SF step, 2.5dB
+    static constexpr int target = 10*4;     // margin to keep, 10dB
+    static constexpr int hyst = 3*4;        // extra margin required to speed up, 3dB
+    static constexpr int hold = 4;          // ACKs after a change before speeding up
+    static constexpr uint32_t quiet = 60000; // ms without an ACK after which the link is lost
+    static constexpr uint32_t slotEvery = 60000; // ms between the GW's home SF slots, whole secs
+    static constexpr uint32_t slotLen = 12000; // ms the GW listens at homeSF in each slot
+    static constexpr uint32_t slotUnit = 250; // ms per unit of the time to the next slot in ACKs
+    static constexpr uint32_t slotGuard = 1000; // ms a tracker keeps off the ends of a slot
+
+    int sf;         // spreading factor to use
+    int pow;        // TX power to use in dBm
+    int avg;        // smoothed margin at sf and pow
+    int dev;        // smoothed deviation of the margin
+    int samples;    // ACKs since the last change
+    int timeouts;   // consecutive lost ACKs
+
+    // conf returns the radio configuration for sf at 125kHz and coding rate 4/7.
+    static LoRaConfig* conf(int sf) {
+        static LoRaConfig* confs[] = {
+            &lora_bw125cr47sf7, &lora_bw125cr47sf8, &lora_bw125cr47sf9,
+            &lora_bw125cr47sf10, &lora_bw125cr47sf11, &lora_bw125cr47sf12,
+        };
+        return confs[sf-minSF];
+    }
+
+    void init(int sf0=homeSF, int pow0=maxPow) {
+        sf = sf0;
+        pow = pow0;
+        avg = dev = 0;
+        samples = timeouts = 0;
+    }
+
+    // ack feeds the margins in dB from an ACK for a packet that was sent at sentSF and returns
+    // true if sf or pow changed.
+    bool ack(int gwMargin, int rxMargin, int sentSF) {
+        int m = (gwMargin < rxMargin ? gwMargin : rxMargin) * 4 + (sf - sentSF) * step;
+        timeouts = 0;
+        if (samples++ == 0) {
+            avg = m;
+            dev = 2*4;
+        } else {
+            int d = m - avg;
+            avg += d / 4;
+            dev += ((d < 0 ? -d : d) - dev) / 4;
+        }
+        int eff = avg - dev;
+        if (eff < target) return slower(target - eff);
+        if (samples < hold) return false;
+        int spare = eff - target - hyst;
+        if (spare >= step && sf > minSF) {
+            int n = spare / step < sf-minSF ? spare / step : sf-minSF;
+            change(-n, 0);
+            return true;
+        }
+        if (sf == minSF && spare >= 4 && pow > minPow) {
+            int n = spare / 4 < pow-minPow ? spare / 4 : pow-minPow;
+            change(0, -n);
+            return true;
+        }
+        return false;
+    }
+
+    // timeout reports a lost ACK and returns true if sf or pow changed.
+    bool timeout() {
+        timeouts++;
+        if (timeouts == 3 && pow < maxPow) {
+            change(0, maxPow-pow);
+            return true;
+        }
+        if (timeouts == 2) return slower(step);
+        return false;
+    }
+
+    // slower is an internal function to gain need quarter dB of margin, it returns true if
+    // anything changed.
+    bool slower(int need) {
+        if (pow < maxPow) {
+            int n = (need+3) / 4 < maxPow-pow ? (need+3) / 4 : maxPow-pow;
+            change(0, n);
+            return true;
+        }
+        if (sf < maxSF) {
+            int n = (need+step-1) / step < maxSF-sf ? (need+step-1) / step : maxSF-sf;
+            change(n, 0);
+            return true;
+        }
+        return false;
+    }
+
+    // change is an internal function to move sf and pow by dsf and dpow and adjust the smoothed
+    // margin by what that should gain or lose.
+    void change(int dsf, int dpow) {
+        sf += dsf;
+        pow += dpow;
+        avg += dsf*step + dpow*4;
+        samples = samples > 0 ? 1 : 0; // keep the average but wait hold ACKs to speed up again
+    }
+};
@@ -0,0 +1,249 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Host-side stand-in for JeeH's RF96lora so the tracker and GW protocol code (uplink.h and
+// gw-core.h) can run on Linux against each other.
+//
+// SimRadio has the subset of RF96lora's interface they use (init, txPower, send, getAck, receive,
+// addInfo, adjustPow, margin, rssi, ...) and all SimRadios share one channel, SimAir, ignoring the
+// frequency. A transmission occupies the channel for the LoRa airtime of the packet at the
+// radio's SF, bandwidth and coding rate (Semtech's formula, 8-symbol preamble, explicit header,
+// CRC). It is received by a radio that listens at the same SF from before it starts to after it
+// ends if its signal, i.e. TX power minus the path losses of sender and receiver minus a fade
+// drawn per packet, is above the SX1276's sensitivity at that SF, and if no other transmission at
+// the same SF overlaps it without being at least SimAir::capture dB weaker. Different SFs don't
+// interfere. On top of that SimAir::drop permille of the receptions can be lost, independently or
+// in bursts. Time is SimClock's, which the caller advances. A radio with a trace file writes the
+// packets it receives to it in the format gwhost reads: time in ms, RSSI, margin and the packet
+// in hex, one per line.
+
+#include "logger/sim-flash.h" // SimClock
+
+// LoRaConfig is the radio configuration, the names of the instances match JeeH's.
+struct LoRaConfig {
+    uint8_t sf;     // spreading factor
+    uint16_t bw;    // bandwidth in kHz
+    uint8_t cr;     // coding rate 4/cr
+};
+LoRaConfig lora_bw125cr47sf7 = { 7, 125, 7 };
+LoRaConfig lora_bw125cr47sf8 = { 8, 125, 7 };
+LoRaConfig lora_bw125cr47sf9 = { 9, 125, 7 };
+LoRaConfig lora_bw125cr47sf10 = { 10, 125, 7 };
+LoRaConfig lora_bw125cr47sf11 = { 11, 125, 7 };
+LoRaConfig lora_bw125cr47sf12 = { 12, 125, 7 };
+
+// SimAir is the channel shared by all simulated radios.
+struct SimAir {
+    static constexpr int maxTx = 64;    // transmissions remembered
+    static constexpr int keep = 10000000; // usecs after which a transmission is forgotten
+
+    struct Tx {
+        uint64_t start, end;    // usecs
+        int from;               // radio ID
+        int sf;
+        int level;              // TX power minus the sender's path loss in dBm
+        int len;
+        uint8_t buf[256];       // header followed by the payload
+    };
+    static Tx txs[maxTx];
+    static int n;               // transmissions in txs
+    static int radios;          // radios created, to hand out IDs
+    static uint32_t seed;       // random number generator state
+    static int fade;            // standard deviation of the per-packet fade in dB
+    static int capture;         // dB by which a packet must be stronger to survive a collision
+    static int drop;            // permille of the receptions lost regardless of the signal
+    static int burst;           // mean number of receptions lost in a row
+    static bool bad;            // the loss model is in its lossy state
+
+    // counters
+    static uint32_t sent;       // transmissions
+    static uint32_t weak;       // receptions lost because the signal was below sensitivity
+    static uint32_t collided;   // receptions lost to another transmission
+    static uint32_t dropped;    // receptions lost to the loss model
+    static uint64_t busyUsecs;  // total airtime
+
+    static void init(uint32_t s=1) {
+        n = sent = weak = collided = dropped = 0;
+        busyUsecs = 0;
+        bad = false;
+        seed = s;
+    }
+
+    static uint32_t random() { // xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        return seed;
+    }
+
+    // gauss returns an approximately normal random number with standard deviation sd.
+    static int gauss(int sd) {
+        int s = 0;
+        for (int i=0; i<12; i++) s += random() % 1000;
+        return (s - 6000) * sd / 1000;
+    }
+
+    // lose returns true if the loss model drops a reception. It's a two-state (Gilbert-Elliott)
+    // channel that loses every reception while in the bad state, and enters and leaves that state
+    // so that drop permille of them are lost in runs of burst on average.
+    static bool lose() {
+        if (drop == 0) return false;
+        if (bad) bad = random() % burst != 0;
+        else bad = random() % 1000000 < (uint32_t)(drop * 1000000LL / ((1000-drop) * burst));
+        return bad;
+    }
+
+    // sensitivity returns the SX1276's sensitivity at 125kHz in dBm.
+    static int sensitivity(int sf) {
+        static const int16_t s[] = { -123, -126, -129, -132, -134, -137 };
+        return s[sf-7];
+    }
+
+    // airtime returns the time on air of a packet of len bytes in usecs.
+    static uint32_t airtime(const LoRaConfig &c, int len) {
+        uint32_t sym = (1000u << c.sf) / c.bw;
+        int de = c.sf >= 11 && c.bw <= 125; // low data rate optimization
+        int bits = 8*len - 4*c.sf + 28 + 16;
+        int div = 4 * (c.sf - 2*de);
+        int syms = 8 + (bits > 0 ? (bits + div-1) / div * c.cr : 0);
+        return sym * (8*4 + 17) / 4 + sym * syms; // preamble is 8+4.25 symbols
+    }
+
+    static void add(Tx &t) {
+        // forget old transmissions
+        int k = 0;
+        for (int i=0; i<n; i++)
+            if (txs[i].end + keep > SimClock::usecs) txs[k++] = txs[i];
+        n = k;
+        if (n < maxTx) txs[n++] = t;
+        sent++;
+        busyUsecs += t.end - t.start;
+    }
+};
+SimAir::Tx SimAir::txs[SimAir::maxTx];
+int SimAir::n = 0;
+int SimAir::radios = 0;
+uint32_t SimAir::seed = 1;
+int SimAir::fade = 3;
+int SimAir::capture = 6;
+int SimAir::drop = 0;
+int SimAir::burst = 1;
+bool SimAir::bad = false;
+uint32_t SimAir::sent = 0;
+uint32_t SimAir::weak = 0;
+uint32_t SimAir::collided = 0;
+uint32_t SimAir::dropped = 0;
+uint64_t SimAir::busyUsecs = 0;
+
+struct SimRadio {
+    int id;             // ID on the air
+    int loss;           // path loss to the GW in dB, 0 for the GW itself
+    LoRaConfig conf;
+    uint32_t nomFreq, actFreq;
+    int txpow;          // TX power in dBm
+    int rssi;           // RSSI of the last packet received in dBm
+    int margin;         // margin above sensitivity of the last packet received in dB
+    int fei;            // frequency error of the last packet received, always 0
+    uint64_t txEnd;     // end of the current transmission
+    uint64_t rxFrom;    // time since when the radio has been listening
+    uint64_t seen;      // end of the last transmission considered for reception
+    uint64_t ackUntil;  // time at which getAck times out
+    uint8_t ackNode;    // node an ACK has to come from
+    uint32_t ackWait;   // usecs to wait for an ACK after the transmission ends
+    uint32_t sent;      // packets sent
+    FILE *trace;        // file to write the packets received to, or 0
+
+    SimRadio() : id(SimAir::radios++), loss(0), txpow(20), rssi(0), margin(0), fei(0),
+            txEnd(0), rxFrom(0), seen(0), ackWait(100000), sent(0), trace(0) {}
+
+    bool init(uint8_t, uint8_t, LoRaConfig &c, uint32_t freq) {
+        conf = c;
+        nomFreq = actFreq = freq;
+        rxFrom = SimClock::usecs > txEnd ? SimClock::usecs : txEnd;
+        return true;
+    }
+
+    void txPower(int p) { txpow = p; }
+    void adjustPow(int) {} // the power stays where it was set
+    int noiseFloor() { return -120; }
+
+    // addInfo appends the margin and frequency error of the last packet received.
+    void addInfo(uint8_t *buf) {
+        buf[0] = margin < 0 ? 0 : margin > 63 ? 63 : margin;
+        buf[1] = fei / 128;
+    }
+
+    void send(uint8_t hdr, const uint8_t *buf, int len) {
+        SimAir::Tx t;
+        t.start = SimClock::usecs > txEnd ? SimClock::usecs : txEnd;
+        t.end = t.start + SimAir::airtime(conf, len+1);
+        t.from = id;
+        t.sf = conf.sf;
+        t.level = txpow - loss;
+        t.buf[0] = hdr;
+        memcpy(t.buf+1, buf, len);
+        t.len = len+1;
+        SimAir::add(t);
+        sent++;
+        txEnd = rxFrom = t.end;
+        ackNode = hdr & 0x1f;
+        // wait for the GW to turn around and send a 10-byte ACK
+        ackUntil = txEnd + SimAir::airtime(conf, 10) + ackWait;
+    }
+
+    // receive returns the next packet that was heard, including its header byte, 0 if none was,
+    // or -1 while transmitting.
+    int receive(uint8_t *buf, int len) {
+        if (SimClock::usecs < txEnd) return -1;
+        for (;;) {
+            // transmission that ended first after the last one considered
+            SimAir::Tx *t = 0;
+            for (int i=0; i<SimAir::n; i++) {
+                SimAir::Tx &x = SimAir::txs[i];
+                if (x.end > seen && x.end <= SimClock::usecs && (!t || x.end < t->end)) t = &x;
+            }
+            if (!t) return 0;
+            seen = t->end;
+            if (t->from == id || t->sf != conf.sf || t->start < rxFrom) continue;
+            int level = t->level - loss + SimAir::gauss(SimAir::fade);
+            if (level < SimAir::sensitivity(t->sf)) {
+                SimAir::weak++;
+                continue;
+            }
+            if (SimAir::lose()) {
+                SimAir::dropped++;
+                continue;
+            }
+            bool hit = false;
+            for (int i=0; i<SimAir::n && !hit; i++) {
+                SimAir::Tx &x = SimAir::txs[i];
+                hit = &x != t && x.from != id && x.sf == t->sf && x.start < t->end &&
+                        x.end > t->start && x.level - loss > level - SimAir::capture;
+            }
+            if (hit) {
+                SimAir::collided++;
+                continue;
+            }
+            rssi = level;
+            margin = level - SimAir::sensitivity(t->sf);
+            int n = t->len < len ? t->len : len;
+            memcpy(buf, t->buf, n);
+            if (trace) {
+                fprintf(trace, "%llu %d %d ", (unsigned long long)(SimClock::usecs/1000), rssi,
+                        margin);
+                for (int i=0; i<n; i++) fprintf(trace, "%02x", buf[i]);
+                fprintf(trace, "\n");
+            }
+            return n;
+        }
+    }
+
+    // getAck returns -1 while waiting for the ACK to the last packet sent, the length of the ACK
+    // including its header byte, or 0 if it didn't come in time.
+    int getAck(uint8_t *buf, int len) {
+        if (SimClock::usecs < txEnd) return -1;
+        int n;
+        while ((n = receive(buf, len)) > 0)
+            if ((buf[0] & 0xC0) == 0xC0 && (buf[0] & 0x1f) == ackNode) return n;
+        return SimClock::usecs < ackUntil ? -1 : 0;
+    }
+};
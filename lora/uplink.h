@@ -0,0 +1,461 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Uplink is the tracker side of the radio protocol: it sends the fixes at the head of the log in
+// batches through a SendWindow, shifts them out of the log as the GW acknowledges them, and
+// adapts the SF and TX power with a RateCtl.
+//
+// Sending is paced to get the most fixes through the DutyCycle's airtime budget. Since the
+// preamble, header and ACK cost the same for one fix as for a full batch, a packet that can't be
+// filled waits until interval ms have passed since the previous one, and once less than a
+// quarter of the budget is left only full packets go out. A packet is sent when the budget has
+// its time on air. After a lost ACK the next packet is held back by a random fraction of the
+// lost one's airtime, doubled with each further one up to maxHold, so trackers whose packets
+// collided don't collide again. The GW listens at the home SF in a short slot each minute (see
+// window.h): packets at a faster SF are held back so they and their ACK stay out of the slots,
+// and packets at the home SF wait for a slot while the GW is at another SF or ACKs are being
+// lost.
+//
+// After an outage the backlog can take a long time to drain, so the newest fix, which the caller
+// passes to latest, goes along in a live packet (see window.h) at most every interval ms, as the
+// last fix of the batch, until the backlog in the packet reaches it. The GW passes it on right
+// away, so the current position is at most a packet or two behind however large the backlog is.
+// Once the GW acknowledges a live fix, it's skipped when the backlog gets to it, unless it went
+// in a packet that was sent before, since the GW may have the first copy.
+//
+// With fecK set, new packets go out in groups of fecK that don't ask for an ACK, followed by a
+// parity packet that holds the XOR of their bytes and is ACKed for the whole group. The GW
+// rebuilds a lost packet of the group from the parity and the others, so a single loss doesn't
+// cost a retransmission. A group only starts when the window has room for it and there are
+// fixes for fecK full packets, and while the rate isn't settled, since RateCtl needs ACKs to
+// adapt, packets are sent and ACKed one at a time. The parity packet costs as much airtime as a
+// data packet while the selective ACKs already avoid sending again what got through, so parity
+// lowers the throughput of a tracker held back by its duty cycle, by up to a third, and on a
+// clean channel. It pays off for a fleet sharing a GW on a channel with random loss, where
+// fewer ACKs and retransmissions leave more room for the other trackers (see lorabench).
+//
+// RADIO is JeeH's RF96lora or SimRadio (sim-radio.h), LOG a PackedLogger or anything else with
+// count, readEntries, shiftEntries and save, and FIELDS converts a LogEntry into FixBatch values,
+// see logger/fix-fields.h. The caller drives it by calling send and poll from its main loop and
+// is left to print and display what happened.
+
+template< typename RADIO, typename LOG, typename FIELDS >
+struct Uplink {
+    static constexpr int batchMax = 16; // max fixes sent in one packet
+    static constexpr int hdrLen = 1;    // header byte added by the radio
+    static constexpr int skipMax = 32;  // live fixes remembered for the backlog to skip
+    static constexpr int maxLen = 128;  // max length of a data packet
+    static constexpr int maxBackoff = 6; // lost ACKs after which the back-off stops growing
+    static constexpr uint32_t maxHold = 30000; // max ms of back-off
+
+    RADIO *radio;
+    LOG *log;
+    uint32_t freq;      // frequency passed to the radio
+    uint8_t node;       // node ID sent in the packet header
+    SendWindow win;     // packets in flight
+    RateCtl rate;       // adaptive data rate
+    int txSF;           // SF the GW listens at
+    int sentSF;         // SF of the packet awaiting an ACK
+    int ackSF;          // SF the GW was at when the last ACK came
+    uint32_t ackAt;     // ms when the last ACK came
+    int scan;           // SFs tried since the link was lost, -1 while it isn't
+    uint32_t slotAt;    // ms when a home SF slot of the GW starts, see window.h
+    bool slotKnown;     // slotAt is set, by the time of the newest fix or by an ACK
+    bool slotAcked;     // an ACK said when
+    bool busy;          // a packet was sent and its ACK is pending
+    DutyCycle duty;     // airtime budget
+    uint32_t interval;  // ms between packets that aren't full, set by the caller
+    uint32_t sentAt;    // ms when the last packet was sent
+    uint32_t holdUntil; // ms before which nothing is sent
+    uint32_t seed;      // random number generator state for the back-off
+    int fill;           // fixes needed to fill a packet
+    // newest fix, sent ahead of the backlog
+    bool liveFirst;     // send the newest fix in live packets, set by the caller
+    LogEntry newest;    // newest fix, set with latest
+    uint32_t newestAt;  // its time in seconds since 2000, 0 if none
+    uint32_t liveAt;    // time of the newest live fix the GW has
+    uint32_t sentLive;  // time of the live fix awaiting an ACK, 0 if none
+    uint32_t skips[skipMax]; // times of the live fixes the GW has that are still in the log
+    int nSkips;
+    uint8_t liveSeq, liveSession; // packet with that live fix
+    bool liveFresh;     // that packet wasn't sent before, with another live fix or none
+    // forward erasure coding
+    int fecK;           // data packets per parity packet, 0 to ACK each one, at most
+                        // SendWindow::size, set by the caller
+    int groupN;         // data packets sent in the current group
+    uint8_t groupSeq;   // sequence number of the first one
+    uint8_t parity[maxLen-2]; // XOR of their bytes without the info trailer
+    int parityLen;      // length of the longest one
+    uint8_t lenXor;     // XOR of their lengths
+    // last packet sent
+    uint8_t seq;        // sequence number
+    int fixes;          // number of fixes in it, including the live one
+    bool live;          // it's a live packet
+    bool isParity;      // it's a parity packet
+    int len;            // length in bytes
+    uint32_t airtime;   // time on air in usecs
+    // last ACK received
+    uint8_t ack[10];    // ACK packet, starting with the header
+    int8_t gwMargin;    // margin the GW reported, -100 if no ACK
+    int16_t gwRssi;     // RSSI the GW reported
+    int8_t rxMargin;    // margin of the ACK
+    int shifted;        // number of entries it confirmed
+    // link statistics by the SF packets are sent at, the margin is the worse of gwMargin and
+    // rxMargin as for RateCtl
+    LinkStats links[RateCtl::maxSF-RateCtl::minSF+1];
+
+    void init(RADIO &r, LOG &l, uint8_t id, uint8_t session, uint32_t f, uint32_t now) {
+        radio = &r;
+        log = &l;
+        node = id;
+        freq = f;
+        win.init(session);
+        rate.init();
+        txSF = sentSF = ackSF = RateCtl::homeSF;
+        ackAt = now;
+        scan = -1;
+        slotKnown = slotAcked = false;
+        busy = false;
+        duty.init(now);
+        interval = 10000;
+        sentAt = holdUntil = now;
+        seed = 0x9e3779b9 ^ (id << 8 | session);
+        fill = batchMax;
+        liveFirst = true;
+        newestAt = liveAt = sentLive = 0;
+        nSkips = 0;
+        fecK = groupN = 0;
+        live = isParity = false;
+        gwMargin = rxMargin = -100;
+        gwRssi = 0;
+        for (int i=0; i<RateCtl::maxSF-RateCtl::minSF+1; i++) links[i].init();
+    }
+
+    // setRate switches the radio to spreading factor sf and TX power pow.
+    void setRate(int sf, int pow) {
+        radio->init(61, 0xcb, *RateCtl::conf(sf), freq);
+        radio->txPower(pow);
+    }
+
+    // latest tells the uplink about the newest fix, the caller calls it with each fix it logs,
+    // now is the time in ms.
+    void latest(const LogEntry &le, uint32_t now) {
+        newest = le;
+        int32_t vals[FixBatch::vals];
+        FIELDS::values(le, vals);
+        newestAt = FixBatch::time(vals);
+        if (!slotAcked && newestAt > 0) {
+            // the GW's slots start on the full UTC minute until an ACK says exactly when
+            slotAt = now - newestAt % (RateCtl::slotEvery/1000) * 1000;
+            slotKnown = true;
+        }
+    }
+
+    // hurry sends the newest fix in the next packet as soon as the duty cycle allows instead of
+    // waiting for the interval, e.g. when the tracker crossed a geofence, now is the time in ms.
+    void hurry(uint32_t now) {
+        sentAt = now - interval;
+        liveAt = 0;
+    }
+
+    // skipped returns true if the fix at time t went out as a live fix the GW has.
+    bool skipped(uint32_t t) {
+        for (int i=0; i<nSkips; i++)
+            if (skips[i] == t) return true;
+        return false;
+    }
+
+    // settled returns true if the rate controller had enough ACKs to lower the rate and the GW
+    // is at the SF it wants.
+    bool settled() { return rate.samples >= RateCtl::hold && rate.sf == txSF; }
+
+    // nextSlot returns when the first home SF slot of the GW that doesn't end before t starts,
+    // give or take slotGuard ms.
+    uint32_t nextSlot(uint32_t t) {
+        uint32_t end = slotAt + RateCtl::slotLen + RateCtl::slotGuard;
+        if ((int32_t)(t - end) >= 0)
+            slotAt += ((t - end) / RateCtl::slotEvery + 1) * RateCtl::slotEvery;
+        return slotAt;
+    }
+
+    // aim returns when to send a packet that takes air ms with its ACK at the home SF: t if the
+    // GW's home SF slot at t leaves time for it, else a random time early enough in the next
+    // slot.
+    uint32_t aim(uint32_t t, uint32_t air) {
+        uint32_t len = RateCtl::slotLen - 2*RateCtl::slotGuard;
+        if (len < air) len = air;
+        for (uint32_t s = nextSlot(t);; s += RateCtl::slotEvery) {
+            uint32_t from = s + RateCtl::slotGuard;
+            if ((int32_t)(from + len - air - t) < 0) continue; // too late for this one
+            if ((int32_t)(t - from) >= 0) return t;
+            return from + seed % (len - air + 1);
+        }
+    }
+
+    // slotted returns true if packets go in the GW's home SF slots: they're at the home SF and
+    // the GW listens at another SF, or may since ACKs are being lost.
+    bool slotted() {
+        return slotKnown && txSF == RateCtl::homeSF &&
+                (ackSF != RateCtl::homeSF || rate.timeouts >= 3 || scan >= 0);
+    }
+
+    // slotWait returns how many ms a packet of cost usecs of airtime has to wait, 0 if none: at a
+    // faster SF than the home SF it and its ACK stay out of the GW's home SF slots, during which
+    // the GW doesn't hear it, and slotted packets go in one.
+    uint32_t slotWait(uint32_t now, uint32_t cost) {
+        if (!slotKnown || (txSF == RateCtl::homeSF && !slotted())) return 0;
+        uint32_t air = (cost + DutyCycle::airtime(txSF, sizeof(ack))) / 1000 + 1;
+        if (txSF == RateCtl::homeSF) return aim(now, air) - now;
+        uint32_t s = nextSlot(now);
+        if ((int32_t)(now + air + RateCtl::slotGuard - s) <= 0) return 0;
+        return s + RateCtl::slotLen + RateCtl::slotGuard - now;
+    }
+
+    // send sends a lost packet again or as many new fixes as fit in one packet, if the radio
+    // isn't busy, the window has something to send and the pacing allows it, now is the time in
+    // ms. It returns true if it sent something.
+    bool send(uint32_t now) {
+        if (busy || (int32_t)(now - holdUntil) < 0) return false;
+        int offset, slot = win.pick(log->count(), offset);
+        bool fresh = slot == win.n;
+        // a group ends after fecK packets or when there's nothing new to send
+        if (groupN > 0 && (groupN == fecK || !fresh)) return sendParity(now);
+        if (slot < 0) return false;
+        duty.update(now);
+        bool group = fecK > 1 && fresh && (groupN > 0 || (win.n + fecK <= SendWindow::size &&
+                log->count() - offset >= fecK * fill && settled()));
+        // a new packet waits for enough fixes to fill it unless it's time for an update, the
+        // packets of a group go back to back
+        bool wait = fresh && groupN == 0 && (now - sentAt < interval || duty.credit < duty.cap/4);
+        if (wait && log->count() - offset < fill) return false;
+        int max = fresh ? batchMax : win.slots[slot].count;
+        LogEntry les[batchMax];
+        int n = log->readEntries(les, max, offset);
+        if (n == 0) return false;
+        int32_t vals[FixBatch::vals];
+        if (offset == 0) {
+            // forget the live fixes the head of the log has moved past
+            FIELDS::values(les[0], vals);
+            uint32_t head = FixBatch::time(vals);
+            int k = 0;
+            while (k < nSkips && skips[k] < head) k++;
+            memmove(skips, skips+k, (nSkips-k) * sizeof(skips[0]));
+            nSkips -= k;
+        }
+        // the newest fix goes along if the GW doesn't have it and the entries in the packet don't
+        // reach it, a new packet gives up its last entries to make room for it
+        live = liveFirst && newestAt > 0 && newestAt >= liveAt + interval/1000;
+        int32_t liveVals[FixBatch::vals];
+        if (live) FIELDS::values(newest, liveVals);
+        uint8_t packet[maxLen];
+        packet[1] = win.session;
+        FixBatch batch;
+        int used = n; // entries in the packet, including the skipped ones
+        for (;;) {
+            int m = used;
+            bool reached = false;
+            batch.begin(packet+4, sizeof(packet)-6); // leave room for the info trailer
+            for (used=0; used<m; used++) {
+                FIELDS::values(les[used], vals);
+                uint32_t t = FixBatch::time(vals);
+                if (t >= newestAt) reached = true;
+                if (skipped(t)) continue;
+                if (!batch.add(vals)) break;
+            }
+            if (!live || reached) {
+                live = false;
+                break;
+            }
+            if (batch.add(liveVals)) break;
+            if (!fresh || used <= 1) {
+                live = false;
+                break;
+            }
+            used--;
+        }
+        packet[0] = live ? SendWindow::liveType : SendWindow::dataType;
+        if (fresh) {
+            // remember how many fixes filled the packet, or that more are needed
+            bool full = used < n || n == batchMax;
+            fill = full ? used : n+1;
+            if (wait && !full) return false;
+        }
+        len = 4 + batch.size() + 2; // info bytes
+        uint32_t cost = DutyCycle::airtime(txSF, len + hdrLen);
+        uint32_t hold = slotWait(now, cost);
+        if (duty.wait(cost) > hold) hold = duty.wait(cost);
+        if (hold > 0) {
+            holdUntil = now + hold;
+            return false;
+        }
+        packet[2] = seq = win.sent(slot, used);
+        packet[3] = rate.sf | slot << 4; // SF we'd like the GW to switch to, packets before
+        if (group) {
+            // add the packet to the group's parity
+            if (groupN == 0) {
+                groupSeq = seq;
+                memset(parity, 0, sizeof(parity));
+                parityLen = lenXor = 0;
+            }
+            for (int i=0; i<len-2; i++) parity[i] ^= packet[i];
+            if (len-2 > parityLen) parityLen = len-2;
+            lenXor ^= len-2;
+            groupN++;
+        }
+        radio->addInfo(packet+len-2);
+        radio->send((group ? 0 : 1<<5) + node, packet, len); // request ack unless in a group
+        duty.spend(cost);
+        airtime = cost;
+        sentAt = now;
+        // the next packet of a group goes once this one is out
+        busy = !group;
+        if (group) holdUntil = now + cost/1000 + 1;
+        sentSF = txSF;
+        fixes = batch.count();
+        isParity = false;
+        if (live) {
+            sentLive = newestAt;
+            liveSeq = seq;
+            liveFresh = fresh;
+            liveSession = win.session;
+        } else if (seq == liveSeq) {
+            sentLive = 0; // sent again without it
+        }
+        return true;
+    }
+
+    // sendParity sends the parity packet of the group, which is ACKed like a data packet:
+    // type SendWindow::parityType, session, seq of the first packet, SF, number of packets, XOR
+    // of their lengths, XOR of their bytes, info trailer.
+    bool sendParity(uint32_t now) {
+        uint8_t packet[6 + sizeof(parity) + 2];
+        int l = 6 + parityLen + 2;
+        duty.update(now);
+        uint32_t cost = DutyCycle::airtime(txSF, l + hdrLen);
+        uint32_t hold = slotWait(now, cost);
+        if (duty.wait(cost) > hold) hold = duty.wait(cost);
+        if (hold > 0) {
+            holdUntil = now + hold;
+            return false;
+        }
+        packet[0] = SendWindow::parityType;
+        packet[1] = win.session;
+        packet[2] = seq = groupSeq;
+        packet[3] = rate.sf;
+        packet[4] = groupN;
+        packet[5] = lenXor;
+        memcpy(packet+6, parity, parityLen);
+        radio->addInfo(packet+l-2);
+        radio->send((1<<5) + node, packet, l); // request ack
+        duty.spend(cost);
+        airtime = cost;
+        sentAt = now;
+        busy = true;
+        sentSF = txSF;
+        len = l;
+        fixes = groupN = 0;
+        live = false;
+        isParity = true;
+        return true;
+    }
+
+    // poll checks for the ACK of the packet sent and returns -1 if it's still pending (or
+    // nothing was sent), 0 if it timed out, or the length of the ACK. Now is the time in ms.
+    int poll(uint32_t now) {
+        if (!busy) return -1;
+        int n = radio->getAck(ack, sizeof(ack));
+        if (n < 0) return -1;
+        busy = false;
+        shifted = 0;
+        bool changed = false;
+        LinkStats &ls = links[sentSF-RateCtl::minSF];
+        ls.exchange(n < 3);
+        if (n == 0) {
+            // after a few lost ACKs the GW may have switched to the SF the packets asked for
+            // without the tracker getting the ACK, try it and the one the GW was at in turn, and
+            // once the link is lost try the home SF and then each starting with the fastest, see
+            // window.h
+            changed = rate.timeout();
+            if (scan < 0 && now - ackAt >= RateCtl::quiet) {
+                int t = rate.timeouts;
+                rate.init();
+                rate.timeouts = t; // keep counting for the back-off
+                changed = true;
+                scan = 0;
+            }
+            int sf = txSF;
+            if (scan >= 0)
+                sf = scan++ == 0 ? RateCtl::homeSF :
+                        RateCtl::minSF + (scan-2) % (RateCtl::maxSF-RateCtl::minSF+1);
+            else if (rate.timeouts >= 3)
+                sf = rate.timeouts % 2 ? ackSF : rate.sf;
+            if (sf != txSF) {
+                txSF = sf;
+                changed = true;
+            }
+            // random back-off of up to the airtime of the lost packet, doubled with each
+            // further lost ACK since the channel may be crowded, but no more than maxHold so a
+            // node that lost the GW keeps looking for it
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            int k = rate.timeouts < maxBackoff ? rate.timeouts : maxBackoff;
+            uint32_t w = airtime/1000 << (k-1);
+            holdUntil = now + seed % ((w < maxHold ? w : maxHold) + 1);
+            // the GW is sure to listen at the home SF during its next slot
+            if (slotted())
+                holdUntil = aim(holdUntil, (DutyCycle::airtime(txSF, maxLen + hdrLen) +
+                        DutyCycle::airtime(txSF, sizeof(ack))) / 1000 + 1);
+        } else {
+            // the ACK says which packets the GW has, shift the fixes at the head
+            bool data = n >= 10 && ack[1] == SendWindow::ackType;
+            if (data && sentLive && ack[2] == liveSession &&
+                    win.has(ack[2], ack[3], ack[4], liveSeq)) {
+                // the GW has the live fix, the backlog skips it unless the GW may have gotten an
+                // earlier copy of the packet, with another live fix or none
+                liveAt = sentLive;
+                if (liveFresh && nSkips < skipMax && (nSkips == 0 || skips[nSkips-1] < sentLive))
+                    skips[nSkips++] = sentLive;
+                sentLive = 0;
+            }
+            if (data) {
+                shifted = win.ack(ack[2], ack[3], ack[4]);
+                log->shiftEntries(shifted);
+            }
+            if (log->count() == 0) log->save();
+        }
+        if (n >= 3) {
+            gwMargin = (int8_t)(ack[n-2] & 0x3f);
+            gwRssi = n > 3 ? -(int16_t)(ack[n-3]) : 0;
+            rxMargin = radio->margin;
+            ls.packet(gwMargin < rxMargin ? gwMargin : rxMargin, gwRssi, 128 * (int8_t)ack[n-1]);
+            ls.rtt.add(now - sentAt);
+            // adapt the rate to the margins and follow the GW's SF
+            changed = rate.ack(gwMargin, rxMargin, sentSF);
+            int gwSF = n >= 10 && ack[1] == SendWindow::ackType ? ack[5] : txSF;
+            if (gwSF < RateCtl::minSF || gwSF > RateCtl::maxSF) gwSF = txSF;
+            ackSF = gwSF;
+            // a node that needs the home SF stays at it and sends in the GW's slots
+            if (rate.sf == RateCtl::homeSF && sentSF == RateCtl::homeSF) gwSF = RateCtl::homeSF;
+            if (gwSF != txSF) {
+                txSF = gwSF;
+                changed = true;
+            }
+            if (n >= 10 && ack[1] == SendWindow::ackType) {
+                // the ACK took its airtime to come in after the GW said when its next slot
+                // starts, the one before may not be over yet
+                slotAt = now - DutyCycle::airtime(sentSF, n) / 1000 + ack[6] * RateCtl::slotUnit -
+                        RateCtl::slotEvery;
+                slotKnown = slotAcked = true;
+            }
+        } else {
+            gwRssi = 0;
+            gwMargin = rxMargin = -100;
+        }
+        if (n >= 3) {
+            ackAt = now;
+            scan = -1;
+        }
+        if (changed) setRate(txSF, rate.pow);
+        return n;
+    }
+};
@@ -0,0 +1,181 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Sliding-window uplink: the tracker keeps up to SendWindow::size packets in flight instead of
+// waiting for each one to be acknowledged, so a lost ACK is covered by the next one and a lost
+// packet is sent again as soon as a later one gets through, rather than after a timeout. Each
+// packet carries an 8-bit sequence number and the tracker's session number, which changes at
+// every boot. The GW answers each packet with the sequence number of the first packet it is
+// still missing (cumulative ACK) and a bitmap of the packets after that one it has received
+// (selective ACK). It keeps a RecvWindow per node so duplicates are ACKed but delivered once.
+//
+// Each data packet also says how many packets ahead of it the tracker still waits for the ACK
+// of, so a GW that lost track of the node, e.g. because it restarted, knows where the node's
+// window starts: it can't ACK what it never received, but mustn't tell the node it has the
+// packets that went missing while it wasn't listening either.
+//
+// Each packet also carries the SF the tracker would like to use (see rate.h) and each ACK the SF
+// the GW listens at from then on, which the tracker switches to once it gets the ACK. If the ACK
+// of a switch is lost the two end up on different SFs. After 3 lost ACKs the tracker alternates
+// between the SF of the last ACK and the one it asked for, so a GW that only missed a burst of
+// packets is found where it was. The GW listens at the slowest SF asked for by the nodes it
+// heard in the last RateCtl::quiet ms, except RateCtl::homeSF, so the near nodes may keep it at a
+// faster SF than a far node can reach. For the far nodes, the GW listens at the home SF for
+// RateCtl::slotLen ms every RateCtl::slotEvery ms whatever the nodes ask for, starting on the
+// full UTC minute as told by the newest fix it received, and each ACK says how long it is until
+// the next slot. A tracker goes by the time of its own newest fix until it gets an ACK. Packets at
+// a faster SF stay out of the slots, and a node that needs the home SF and got through at it
+// stays there when the GW moves on and sends its packets in the slots. After RateCtl::quiet ms
+// without an ACK the link is lost: the tracker asks for the home SF and tries it in the next
+// slot, then each SF from the fastest, and the GW goes back to the home SF as well after not
+// hearing from any node for that long.
+//
+// Data packet: type SendWindow::dataType, session, seq, SF in the low 4 bits and the number of
+// packets in flight before this one in the high 4 bits, FixBatch, 2-byte info trailer. A
+// packet of type SendWindow::liveType is the same but the last fix of its batch is the newest
+// one the tracker has, sent ahead of the backlog (see uplink.h), and not part of the window.
+// Parity packet: type SendWindow::parityType, session, seq of the first packet of the group, SF,
+// number of packets in the group, XOR of their lengths, XOR of their bytes from the type to the
+// end of the batch, 2-byte info trailer. It's ACKed like a data packet, see uplink.h.
+// ACK: type SendWindow::ackType, session, cum, sel, SF, time to the next home SF slot in
+// RateCtl::slotUnit ms, RSSI, 2-byte info trailer.
+
+// SendWindow is the tracker side, it maps the packets in flight to the entries at the head of
+// the log: the oldest packet holds the first entries, the next one the following ones, etc.
+struct SendWindow {
+    static constexpr int size = 4;                  // max packets in flight
+    static constexpr uint8_t dataType = 0x80 + 6;   // packet type 6 with info trailer
+    static constexpr uint8_t liveType = 0x80 + 7;   // packet type 7 with info trailer
+    static constexpr uint8_t parityType = 0x80 + 8; // packet type 8 with info trailer
+    static constexpr uint8_t ackType = 0x80 + 2;    // ACK type 2 with info trailer
+
+    struct Slot {
+        uint8_t seq;    // sequence number of the packet
+        uint8_t count;  // number of entries in the packet
+        bool acked;     // the GW has the packet
+        bool lost;      // a later packet got through but this one didn't, send it again
+    };
+    Slot slots[size];   // packets in flight, oldest first
+    int n;              // number of packets in flight
+    uint8_t session;    // session number sent with each packet
+    uint8_t seq;        // sequence number of the next new packet
+
+    void init(uint8_t sess) {
+        session = sess;
+        seq = 0;
+        n = 0;
+    }
+
+    // restart forgets the packets in flight, e.g. because the log dropped entries, and starts a
+    // new session so the GW doesn't wait for them.
+    void restart() { init(session+1); }
+
+    // pending returns the number of entries in the packets in flight.
+    int pending() {
+        int c = 0;
+        for (int i=0; i<n; i++) c += slots[i].count;
+        return c;
+    }
+
+    // pick returns the slot of the packet to send next given that avail entries are in the log,
+    // n if it should be a new packet, or -1 if there's nothing to send. A lost packet goes
+    // first, then new entries while there's room in the window, and else the oldest packet is
+    // sent again since its ACK must have been lost. Offset is set to the number of entries
+    // before the packet's.
+    int pick(int avail, int &offset) {
+        int s = -1;
+        for (int i=0; i<n && s < 0; i++)
+            if (slots[i].lost) s = i;
+        if (s < 0) s = n < size && pending() < avail ? n : n > 0 ? 0 : -1;
+        offset = 0;
+        for (int i=0; i<s; i++) offset += slots[i].count;
+        return s;
+    }
+
+    // sent records that the packet in slot s was sent with count entries, and returns its
+    // sequence number.
+    uint8_t sent(int s, int count) {
+        if (s == n) {
+            Slot sl = { seq++, (uint8_t)count, false, false };
+            slots[n++] = sl;
+        }
+        slots[s].lost = false;
+        return slots[s].seq;
+    }
+
+    // has returns true if the ACK sess, cum, sel says the GW has packet seq of this session.
+    bool has(uint8_t sess, uint8_t cum, uint8_t sel, uint8_t sq) {
+        if (sess != session) return false;
+        int d = (int8_t)(sq - cum);
+        return d < 0 || (d > 0 && d <= 8 && (sel >> (d-1) & 1));
+    }
+
+    // ack processes an ACK and returns the number of entries at the head of the log that are
+    // now confirmed and can be shifted out. Each ACK says everything the GW has, so a packet an
+    // earlier ACK confirmed that this one doesn't was held by a GW that restarted since, and is
+    // sent again.
+    int ack(uint8_t sess, uint8_t cum, uint8_t sel) {
+        if (sess != session) return 0; // stale ACK from before a restart
+        int last = -1;
+        for (int i=0; i<n; i++) {
+            slots[i].acked = has(sess, cum, sel, slots[i].seq);
+            if (slots[i].acked) last = i;
+        }
+        // packets are sent one at a time and each is ACKed right away, so a packet that was sent
+        // before one that got through and that the GW doesn't have was lost
+        for (int i=0; i<last; i++)
+            if (!slots[i].acked) slots[i].lost = true;
+        int done = 0, k = 0;
+        while (k < n && slots[k].acked) done += slots[k++].count;
+        memmove(slots, slots+k, (n-k) * sizeof(Slot));
+        n -= k;
+        return done;
+    }
+};
+
+// RecvWindow is the GW side state for one node.
+struct RecvWindow {
+    bool valid;         // a packet has been received
+    uint8_t session;    // session of the node
+    uint8_t cum;        // sequence number of the first packet not received
+    uint8_t sel;        // bit i is set if packet cum+1+i has been received
+
+    // has returns true if packet seq of the current session has been received.
+    bool has(uint8_t seq) {
+        int d = (int8_t)(seq - cum);
+        return valid && (d < 0 || (d > 0 && d <= 8 && (sel >> (d-1) & 1)));
+    }
+
+    // receive records the arrival of packet seq of session and returns true if it's new, false
+    // if it's a duplicate. Base is the oldest packet the node hasn't got the ACK of: the node
+    // has the ACKs of the ones before, so they count as received, and a new session, or a GW
+    // that restarted, starts there rather than at seq, which would ACK the packets in between.
+    bool receive(uint8_t sess, uint8_t seq, uint8_t base) {
+        if (!valid || sess != session) {
+            valid = true;
+            session = sess;
+            cum = base;
+            sel = 0;
+        }
+        while ((int8_t)(base - cum) > 0) skip();
+        int d = (int8_t)(seq - cum);
+        if (d < 0 || d > 8) return false; // received before, or further ahead than nodes send
+        if (d > 0) {
+            uint8_t b = 1 << (d-1);
+            if (sel & b) return false;
+            sel |= b;
+            return true;
+        }
+        skip();
+        return true;
+    }
+
+    // skip moves cum past the packet it points at and the ones after it that were received.
+    void skip() {
+        cum++;
+        while (sel & 1) {
+            sel >>= 1;
+            cum++;
+        }
+        sel >>= 1;
+    }
+};
@@ -0,0 +1,369 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// LoRa uplink benchmark, runs track1's uplink (lora/uplink.h) on simulated trackers against the
+// GW's protocol core (lora/gw-core.h) over a simulated channel (lora/sim-radio.h) and reports
+// how long a backlog of fixes takes to drain while new fixes keep coming once a second, the
+// airtime spent per delivered fix, the distribution of the ACK latency, and how old the newest
+// position the GW has is, with and without sending the newest fix ahead of the backlog, and with
+// and without parity packets under random and bursty packet loss.
+//
+// With `-t file` it runs only the crowd scenario and writes the packets the GW receives to file,
+// which gwhost replays.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lora/sim-radio.h"
+
+// host stand-in for JeeH's NMEAfix, same field sizes
+struct NMEAfix {
+    uint32_t date;      // DDMMYY
+    uint16_t time;      // HHMM
+    uint16_t msecs;     // SSsss
+    int32_t lat, lon;   // minutes*1E4
+    int32_t alt;        // m*10
+    uint16_t knots;     // knots*100
+    uint16_t course;    // degrees*100
+    uint16_t hdop;      // *100
+    uint8_t sats;
+};
+
+// same as track1
+typedef struct {
+    NMEAfix fix;
+    uint8_t hr;
+} LogEntry;
+#include "logger/fix-fields.h"
+#include "lora/fix-batch.h"
+#include "lora/window.h"
+#include "lora/rate.h"
+#include "lora/duty.h"
+#include "lora/link-stats.h"
+#include "lora/uplink.h"
+#include "lora/gw-core.h"
+
+static constexpr uint32_t freq = 433600;
+static constexpr int gwPow = 12; // as in gw/src/main.cpp
+
+// SimLog is a RAM FIFO with the part of PackedLogger's interface that Uplink uses.
+struct SimLog {
+    static constexpr int size = 8192;
+    LogEntry les[size];
+    uint32_t first, next;
+
+    void init() { first = next = 0; }
+    int count() { return next - first; }
+    void save() {}
+
+    bool pushEntry(const LogEntry &le) {
+        if (next - first >= size) return false;
+        les[next++ % size] = le;
+        return true;
+    }
+
+    int readEntries(LogEntry *out, int max, int skip) {
+        int n = 0;
+        for (uint32_t i = first+skip; n < max && i < next; i++) out[n++] = les[i % size];
+        return n;
+    }
+
+    void shiftEntries(int n) { first += n < count() ? n : count(); }
+};
+
+// makeEntry produces the i-th fix of node's synthetic 1Hz track heading NE at ~8 knots, with a
+// bit of jitter in the position like a real GPS, i can be recovered from the time with fixIndex
+static void makeEntry(int node, int i, LogEntry &le) {
+    memset(&le, 0, sizeof(le));
+    le.fix.date = 10718;
+    le.fix.time = 1200 + (i/60)%60 + (i/3600)*100;
+    le.fix.msecs = (i%60)*1000;
+    le.fix.lat = 21*600000 + 1234*i + (i*7)%5 - 2 + node*10000;
+    le.fix.lon = -157*600000 + 987*i + (i*3)%5 - 2;
+    le.fix.alt = 15 + i%7;
+    le.fix.knots = 800 + i%50;
+    le.fix.course = 4500 + (i*37)%300;
+    le.fix.hdop = 90 + i%20;
+    le.fix.sats = 9;
+    le.hr = node;
+}
+
+// fixIndex returns i for the values of the i-th fix
+static int fixIndex(const int32_t *v) {
+    return (v[1]/10000 - 12) * 3600 + v[1]/100%100 * 60 + v[1]%100;
+}
+
+// Tracker is one simulated tracker with its log and uplink
+struct Tracker {
+    SimRadio radio;
+    SimLog log;
+    Uplink< SimRadio, SimLog, FixFields > up;
+    int pushed;         // fixes logged
+    int delivered;      // fixes the GW got
+    int missing;        // fixes of the backlog the GW doesn't have yet
+    int twice;          // fixes the GW got live and again from the backlog
+    int again;          // fixes the GW got again after it restarted
+    int newestGot;      // newest fix the GW got, -1 if none
+    uint8_t got[16384]; // how the GW got each fix: 1 from the backlog, 2 live, 3 both, shifted
+                        // left by 2 when the GW restarts
+    uint64_t start;     // time the tracker comes within range and starts sending
+    uint64_t nextFix;   // time of the next fix
+    uint64_t sentAt;    // time the packet awaiting an ACK was sent
+    uint64_t drained;   // time the backlog was delivered, 0 if not yet
+    uint64_t airtime;   // usecs spent transmitting
+    uint32_t lowCredit; // lowest airtime budget left in usecs
+    uint32_t packets, timeouts;
+};
+
+static constexpr int maxTrackers = 8;
+static Tracker trackers[maxTrackers];
+static SimRadio gwRadio;
+static GwCore< SimRadio > gw;
+
+static constexpr int maxLat = 100000;
+static uint32_t lat[maxLat];    // ACK latencies in ms
+static int nLat;
+static constexpr int maxAge = 20000;
+static uint32_t age[maxAge];    // age of the newest position at the GW in seconds, sampled 1/s
+static int nAge;
+static int errors;
+static int minShare;            // per mille of its fixes each tracker must deliver, 0 for any
+
+static int cmpU32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// benchDrain starts n trackers with path losses loss[] to the GW and a backlog of fixes each,
+// e.g. after being out of range, and runs for secs seconds. The trackers come within range at
+// random times in the first 10 seconds and keep logging a fix per second. They may transmit
+// duty/1000 of the time, send a packet that isn't full every interval ms, and send the newest fix
+// ahead of the backlog if live is set and a parity packet after every fec packets if it's not 0.
+// If reboot isn't 0 the GW restarts every reboot seconds and forgets what it received.
+// Drain times are counted from the start of the run.
+static void benchDrain(const char* name, int n, const int *loss, int backlog, int secs,
+        int duty, int interval, bool live=true, int fec=0, int reboot=0) {
+    SimAir::init();
+    uint64_t t0 = SimClock::usecs;
+    gwRadio.init(61, 0xcb, *RateCtl::conf(RateCtl::homeSF), freq);
+    gwRadio.txPower(gwPow);
+    gwRadio.sent = 0;
+    gw.init(gwRadio, freq);
+    for (int k=0; k<n; k++) {
+        Tracker &t = trackers[k];
+        t.radio.loss = loss[k];
+        t.radio.init(61, 0xcb, *RateCtl::conf(RateCtl::homeSF), freq);
+        t.radio.txPower(RateCtl::maxPow);
+        t.log.init();
+        t.up.init(t.radio, t.log, k+1, 1, freq, SimClock::usecs/1000);
+        for (t.pushed = 0; t.pushed < backlog; t.pushed++) {
+            LogEntry le;
+            makeEntry(k+1, t.pushed, le);
+            t.log.pushEntry(le);
+            t.up.latest(le, SimClock::usecs/1000);
+        }
+        t.up.duty.init(SimClock::usecs/1000, duty);
+        t.up.interval = interval;
+        t.up.liveFirst = live;
+        t.up.fecK = fec;
+        t.lowCredit = t.up.duty.credit;
+        t.delivered = 0;
+        t.missing = backlog;
+        t.twice = t.again = 0;
+        t.newestGot = -1;
+        memset(t.got, 0, sizeof(t.got));
+        t.start = t0 + (n > 1 ? SimAir::random() % 10000 * 1000 : 0);
+        t.nextFix = t0 + 1000000 * (k+1) / n;
+        t.drained = t.airtime = 0;
+        t.packets = t.timeouts = 0;
+    }
+    nLat = nAge = errors = 0;
+    uint32_t sfPackets[13] = {0}, dups = 0, rebuilt = 0, reboots = 0;
+    while (SimClock::usecs - t0 < (uint64_t)secs * 1000000) {
+        if (reboot && SimClock::usecs - t0 >= (reboots+1) * (uint64_t)reboot * 1000000) {
+            gwRadio.init(61, 0xcb, *RateCtl::conf(RateCtl::homeSF), freq);
+            gwRadio.txPower(gwPow);
+            gw.init(gwRadio, freq);
+            reboots++;
+            // the GW can't know what it got before, a packet whose ACK was lost comes again
+            for (int k=0; k<n; k++)
+                for (int i=0; i<(int)sizeof(trackers[k].got); i++)
+                    trackers[k].got[i] = (trackers[k].got[i] | trackers[k].got[i] << 2) & 0x0c;
+        }
+        for (int k=0; k<n; k++) {
+            Tracker &t = trackers[k];
+            if (SimClock::usecs >= t.nextFix) {
+                LogEntry le;
+                makeEntry(k+1, t.pushed++, le);
+                t.log.pushEntry(le);
+                t.up.latest(le, SimClock::usecs/1000);
+                t.nextFix += 1000000;
+                if (SimClock::usecs >= t.start && nAge < maxAge)
+                    age[nAge++] = t.pushed-1 - t.newestGot;
+            }
+            uint32_t ms = SimClock::usecs / 1000;
+            if (SimClock::usecs >= t.start && t.up.send(ms)) {
+                t.sentAt = SimClock::usecs;
+                t.airtime += SimAir::airtime(t.radio.conf, t.up.len+1);
+                t.packets++;
+                if (t.up.duty.credit < t.lowCredit) t.lowCredit = t.up.duty.credit;
+                sfPackets[t.radio.conf.sf]++;
+            }
+            int ack = t.up.poll(ms);
+            if (ack == 0) t.timeouts++;
+            if (ack > 0 && nLat < maxLat) lat[nLat++] = (SimClock::usecs - t.sentAt) / 1000;
+        }
+        int len = gw.poll((SimClock::usecs - t0) / 1000);
+        if (len > 0 && gw.data && !gw.fresh) dups++;
+        if (len > 0 && gw.recovered) rebuilt++;
+        if (len > 0 && gw.data && gw.node >= 1 && gw.node <= n) {
+            Tracker &t = trackers[gw.node-1];
+            // the live fix comes first, then the fixes from the backlog, oldest first
+            for (int i=-1; i<gw.fixes; i++) {
+                if (i < 0 && !gw.live) continue;
+                int f = fixIndex(i < 0 ? gw.liveRow : gw.rows[i]);
+                int how = i < 0 ? 2 : 1;
+                if (f < 0 || f >= (int)sizeof(t.got) || (t.got[f] & how)) {
+                    if (errors++ < 10) printf("ERR node %d: got fix %d again\n", gw.node, f);
+                    continue;
+                }
+                if (i > 0 && f < fixIndex(gw.rows[i-1]) && errors++ < 10)
+                    printf("ERR node %d: got fix %d after %d\n", gw.node, f,
+                            fixIndex(gw.rows[i-1]));
+                if (t.got[f] & how << 2) {
+                    t.again++;
+                } else if (t.got[f]) {
+                    t.twice++;
+                } else {
+                    t.delivered++;
+                    if (f < backlog) t.missing--;
+                }
+                t.got[f] |= how;
+                if (f > t.newestGot) t.newestGot = f;
+            }
+            if (!t.drained && t.missing == 0) t.drained = SimClock::usecs - t0;
+        }
+        SimClock::advance(1000);
+    }
+
+    // all fixes the trackers shifted out of their logs must have been delivered
+    for (int k=0; k<n; k++)
+        for (uint32_t i=0; i<trackers[k].log.first; i++)
+            if (!trackers[k].got[i] && errors++ < 10) printf("ERR node %d: lost fix %d\n", k+1, i);
+    // and each tracker must get its share of the channel, the far ones too
+    for (int k=0; k<n; k++)
+        if (trackers[k].delivered * 1000 < trackers[k].pushed * minShare && errors++ < 10)
+            printf("ERR node %d: delivered %d of %d fixes\n", k+1, trackers[k].delivered,
+                    trackers[k].pushed);
+
+    uint64_t air = 0;
+    uint32_t packets = 0, timeouts = 0, delivered = 0, pushed = 0;
+    printf("== %s: %d trackers, backlog %d, %d.%d%% duty cycle, %ds interval, %s, ", name, n,
+            backlog, duty/10, duty%10, interval/1000, live ? "live first" : "FIFO only");
+    if (fec) printf("parity every %d, ", fec);
+    if (reboot) printf("GW restarted %d times, ", reboots);
+    if (SimAir::drop) printf("%d.%d%% loss in bursts of %d, ", SimAir::drop/10, SimAir::drop%10,
+            SimAir::burst);
+    printf("%ds, %d errors\n", secs, errors);
+    for (int k=0; k<n; k++) {
+        Tracker &t = trackers[k];
+        t.up.duty.update(SimClock::usecs/1000);
+        printf("  node %d, %ddB path loss: ", k+1, loss[k]);
+        if (t.drained) printf("drained in %ds", (int)(t.drained/1000000));
+        else printf("%d of backlog delivered", backlog - t.missing);
+        if (reboot) printf(", %d fixes again after a restart", t.again);
+        printf(", %d of %d fixes (%d twice), %d packets, %d timeouts, %.0fms airtime per fix, SF%d @%ddBm, "
+                "budget left %ds (min %ds)\n", t.delivered, t.pushed, t.twice, t.packets, t.timeouts,
+                t.delivered ? t.airtime/1000.0/t.delivered : 0.0, t.radio.conf.sf, t.radio.txpow,
+                t.up.duty.credit/1000000, t.lowCredit/1000000);
+        air += t.airtime;
+        packets += t.packets;
+        timeouts += t.timeouts;
+        delivered += t.delivered;
+        pushed += t.pushed;
+    }
+    printf("  %d of %d fixes delivered in %d packets (%d dups, %d rebuilt), %d ACKs, %d timeouts, "
+            "%.0fms tracker airtime per fix, channel load %d%%\n", delivered, pushed, packets,
+            dups, rebuilt, gwRadio.sent, timeouts, delivered ? air/1000.0/delivered : 0.0,
+            (int)(SimAir::busyUsecs/10000/secs));
+    printf("  %d receptions too weak, %d collided, %d dropped, packets by SF7..12:",
+            SimAir::weak, SimAir::collided, SimAir::dropped);
+    for (int sf=7; sf<=12; sf++) printf(" %d", sfPackets[sf]);
+    printf("\n");
+    if (nLat > 0) {
+        qsort(lat, nLat, sizeof(lat[0]), cmpU32);
+        printf("  ACK latency: min %dms, p50 %dms, p90 %dms, p99 %dms, max %dms\n",
+                lat[0], lat[nLat/2], lat[nLat*9/10], lat[nLat*99/100], lat[nLat-1]);
+    }
+    if (nAge > 0) {
+        qsort(age, nAge, sizeof(age[0]), cmpU32);
+        printf("  position age at the GW: p50 %ds, p90 %ds, p99 %ds, max %ds\n",
+                age[nAge/2], age[nAge*9/10], age[nAge*99/100], age[nAge-1]);
+    }
+    // the distributions the GW and the first tracker keep, see link-stats.h
+    printf("  GW by ");
+    LinkStats::print("SF", gw.links, RateCtl::maxSF-RateCtl::minSF+1, RateCtl::minSF);
+    printf("  node 1 by ");
+    LinkStats::print("SF", trackers[0].up.links, RateCtl::maxSF-RateCtl::minSF+1, RateCtl::minSF);
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    printf("===== LoRa uplink benchmark, GW at %ddBm, fade %ddB, capture %ddB\n\n",
+            gwPow, SimAir::fade, SimAir::capture);
+
+    static const int near[] = { 115 }, mid[] = { 130 }, far[] = { 138 }, edge[] = { 144 };
+    static const int mixed[] = { 115, 125, 135, 140 };
+    static const int crowd[] = { 125, 125, 125, 125, 125, 125, 125, 125 };
+    if (argc == 3 && strcmp(argv[1], "-t") == 0) {
+        // write what the GW receives in the crowd scenario to a trace for gwhost
+        gwRadio.trace = fopen(argv[2], "w");
+        if (!gwRadio.trace) {
+            printf("cannot open %s\n", argv[2]);
+            return 1;
+        }
+        benchDrain("crowd", 8, crowd, 600, 1800, 100, 10000);
+        fclose(gwRadio.trace);
+        return 0;
+    }
+    // unpaced is how the uplink behaved before it had a budget: send whenever the radio is idle
+    benchDrain("near, unpaced", 1, near, 600, 1800, 1000, 0);
+    benchDrain("near", 1, near, 600, 1800, 100, 10000);
+    benchDrain("mid range", 1, mid, 600, 1800, 100, 10000);
+    benchDrain("far, unpaced", 1, far, 600, 1800, 1000, 0);
+    benchDrain("far", 1, far, 600, 1800, 100, 10000);
+    benchDrain("far, 1% duty cycle", 1, far, 600, 1800, 10, 10000);
+    benchDrain("edge of range", 1, edge, 600, 1800, 100, 10000);
+    benchDrain("mixed ranges, unpaced", 4, mixed, 600, 1800, 1000, 0);
+    // the 140dB node needs SF12 and delivers only ~40% of its fixes alone on a 10% budget
+    minShare = 250;
+    benchDrain("mixed ranges", 4, mixed, 600, 1800, 100, 10000);
+    minShare = 0;
+    benchDrain("crowd, unpaced", 8, crowd, 600, 1800, 1000, 0);
+    benchDrain("crowd", 8, crowd, 600, 1800, 100, 10000);
+    // after an hour out of range
+    benchDrain("near, 1h outage, FIFO only", 1, near, 3600, 1800, 100, 10000, false);
+    benchDrain("near, 1h outage", 1, near, 3600, 1800, 100, 10000);
+    benchDrain("far, 1h outage, FIFO only", 1, far, 3600, 1800, 100, 10000, false);
+    benchDrain("far, 1h outage", 1, far, 3600, 1800, 100, 10000);
+    benchDrain("mixed ranges, 1h outage, FIFO only", 4, mixed, 3600, 1800, 100, 10000, false);
+    benchDrain("mixed ranges, 1h outage", 4, mixed, 3600, 1800, 100, 10000);
+    // the GW loses its per-node state when it restarts, e.g. after a power cut or an update
+    benchDrain("near, unpaced, GW restarts", 1, near, 600, 1800, 1000, 0, true, 0, 97);
+    benchDrain("mixed ranges, GW restarts", 4, mixed, 600, 1800, 100, 10000, true, 0, 97);
+    // packet loss beyond fading and collisions, e.g. interference or obstacles
+    static const int losses[][2] = { { 100, 1 }, { 100, 4 }, { 200, 1 } };
+    for (int i=0; i<3; i++) {
+        SimAir::drop = losses[i][0];
+        SimAir::burst = losses[i][1];
+        benchDrain("near, lossy", 1, near, 600, 1800, 100, 10000);
+        benchDrain("near, lossy, parity", 1, near, 600, 1800, 100, 10000, true, 3);
+        benchDrain("mid range, lossy", 1, mid, 600, 1800, 100, 10000);
+        benchDrain("mid range, lossy, parity", 1, mid, 600, 1800, 100, 10000, true, 3);
+        benchDrain("mixed ranges, lossy", 4, mixed, 600, 1800, 100, 10000);
+        benchDrain("mixed ranges, lossy, parity", 4, mixed, 600, 1800, 100, 10000, true, 3);
+    }
+    SimAir::drop = 0;
+
+    return 0;
+}
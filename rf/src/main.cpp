@@ -10,6 +10,7 @@ int printf(const char* fmt, ...); // forward decl to allow .h files to print for
 #include <jee/i2c-ssd1306.h>
 #include <jee/text-font.cpp>
 #include <jee/text-font.h>
+#include "lora/link-stats.h"
 
 LoRaConfig &lora_conf = lora_bw125cr47sf10;
 
@@ -76,9 +77,10 @@ void setup() {
 uint16_t seq = 0;
 int16_t noise = -100;
 
-constexpr int N = 20;
+constexpr int N = 20;  // ACKs between printing the link statistics
 int count = 0;
-int32_t rmargin, lmargin, lnoise, rrssi, lrssi;
+LinkStats remote, local; // link as seen by the GW and by us
+int32_t lnoise;
 
 uint8_t s1=0, s2=0;
 const uint8_t spinner[] = {'/', '~', '\\', '|'};
@@ -122,20 +124,22 @@ void loop() {
         oled_printf("%2d/%2ddB %d/%ddBm", radio.margin, margin, radio.rssi, rssi);
         if (s1 > 3) s1=0;
 
-        rmargin += margin;
-        lmargin += radio.margin;
+        remote.packet(margin, rssi, fei);
+        local.packet(radio.margin, radio.rssi, radio.fei);
         lnoise += noise;
-        rrssi += rssi;
-        lrssi += radio.rssi;
         count++;
 
         if (count == N) {
-            printf("** remote: %ddB %ddBm, local %ddB %ddBm (%ddBm)\r\n",
-                    rmargin/N, rrssi/N, lmargin/N, lrssi/N, lnoise/N);
+            printf("** remote: %d/%d/%ddB %ddBm, local %d/%d/%ddB %ddBm (%ddBm)\r\n",
+                    remote.margin.quantile(10), remote.margin.quantile(50),
+                    remote.margin.quantile(90), remote.rssi.quantile(50),
+                    local.margin.quantile(10), local.margin.quantile(50),
+                    local.margin.quantile(90), local.rssi.quantile(50), lnoise/N);
             oled_txt.y = 48; oled_txt.x = 0;
-            oled_printf("%2ddB %2ddB %ddB %c", lmargin/N, rmargin/N, lnoise/N, spinner[s2++]);
+            oled_printf("%2ddB %2ddB %ddB %c", local.margin.quantile(10),
+                    remote.margin.quantile(10), lnoise/N, spinner[s2++]);
             if (s2 > 3) s2 = 0;
-            rmargin = lmargin = lnoise = rrssi = lrssi = 0;
+            lnoise = 0;
             count = 0;
         }
         //printf("noise: %ddBm\r\n", radio.noiseFloor());
@@ -151,7 +155,9 @@ void loop() {
 
 int main () {
     setup();
-    rmargin = lmargin = lnoise = rrssi = lrssi = 0;
+    remote.init();
+    local.init();
+    lnoise = 0;
 
     printf("===== Starting main loop\r\n");
     while (1) loop();
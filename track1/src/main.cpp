@@ -3,19 +3,29 @@
 // Marine tracker, v1
 
 static constexpr int gps_tx_target = 10 * 1000; // target milliseconds between updates
+static constexpr int tx_duty = 100; // radio duty cycle limit in 1/1000, 10% in the 433MHz band
+static constexpr int tx_fec = 0; // data packets per parity packet, 0 to ACK each one, see uplink.h
+static constexpr int gps_simplify = 0; // max error in m of the track logged, 0 to log every fix
+static constexpr int fence_hyst = 10; // m past a geofence's edge for an enter or exit event
+static constexpr int bat_low = 3500; // battery mV below which log entries are flushed right away
+static constexpr int eeprom_session = 0; // eeprom offset of the uplink session number
 
 int printf(const char* fmt, ...); // forward decl to allow .h files to print for debug
 
 #include <jee.h>
 #include <jee/nmea.h>
 #include <jee/spi-rf96lora.h>
-#include <jee/varint.h>
 #include <jee/spi-st7565r.h>
 #include <jee/spi-flash.h>
+#include "logger/spi-flash-async.h"
 #include "gps/track.h"
 #include "gps/fence.h"
-
-LoRaConfig &lora_conf = lora_bw125cr47sf10;
+#include "lora/fix-batch.h"
+#include "lora/window.h"
+#include "lora/rate.h"
+#include "lora/duty.h"
+#include "lora/link-stats.h"
+#include "lora/uplink.h"
 
 // ===== GPIO pins and hardware peripherals
 
@@ -34,7 +44,7 @@ SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinA<4>, 0 > spiRf;     // spi1 with radio s
 SpiGpio< PinA<7>, PinA<6>, PinA<5>, PinC<14>, 0 > spiFlash; // spi1 with flash select
 ST7565R< decltype(spiDisp), decltype(dispDC) > disp;      // display driver
 RF96lora< decltype(spiRf) > radio;                        // radio driver
-SpiFlash< decltype(spiFlash) > emem;                      // external dataflash, W25Q128
+SpiFlashAsync< decltype(spiFlash) > emem;                 // external dataflash, W25Q128
 
 I2cBus< PinB<7>, PinB<6> > bus;                           // standard I2C pins for SDA and SCL
 
@@ -45,8 +55,9 @@ typedef struct {
     NMEAfix fix;
     uint8_t hr;
 } LogEntry;
-#include "logger/logger.h"
-Logger< decltype(emem) > logger;                          // logger going to external flash
+#include "logger/fix-fields.h"
+#include "logger/packed-logger.h"
+PackedLogger< decltype(emem), FixFields > logger;         // logger going to external flash
 
 // ===== Helper functions for peripherals
 
@@ -147,30 +158,12 @@ int gps_printf(const char* fmt, ...) {
 NMEA nmea;
 Track track;
 
-constexpr int nmea_vals = 10;
-uint8_t nmea_packet[4+5*nmea_vals];
-
-// nmeaMakePacket converts the NMEA info and heart rate into a varint-encoded packet.
-// It returns the number of bytes placed into the buffer.
-// Packet format:
-// UTC date (DDMMYY), time (dHHMMSS, d=deciseconds), lat [deg*1E6], lon [deg*1E6], alt [m*10],
-// horiz-speed [m/s*1E2], course [deg*1E2], sats, hdop [*1E2], hr
-int nmeaMakePacket(NMEAfix &nmea, uint8_t hr, uint8_t *buf, int len) {
-    int32_t time = nmea.time*100 + nmea.msecs/1000 + nmea.msecs/100%10*1000000;
-    int32_t vals[nmea_vals] = { (int32_t)nmea.date, (int32_t)time, nmea.lat*5/3, nmea.lon*5/3,
-        nmea.alt, nmea.knots*514/1000, nmea.course, nmea.sats, nmea.hdop, hr,
-    };
-    //for (int i=0; i<nmea_vals; i++) printf(" %d", vals[i]);
-    //printf("\r\n");
-    int cnt = encodeVarint(vals, nmea_vals, buf, len);
-    //for (int i=0; i<cnt; i++) printf(" %02x", buf[i]);
-    //printf("\r\n");
-    decodeVarint(buf, cnt, vals, nmea_vals);
-    //int c2 = decodeVarint(buf, cnt, vals, nmea_vals);
-    //for (int i=0; i<c2; i++) printf(" %d", vals[i]);
-    //printf("\r\n");
-    return cnt;
-}
+// Geofences, each a const array of {lat, lon} in minutes*1E4 as in NMEAfix, e.g. harbour zones to
+// stay out of. The set is empty until fences are configured by adding them with fences.add after
+// fences.init in main, until then the monitor only adds up the distance moved. Entering or exiting
+// one is printed, logged and sent right away.
+FenceSet<8, 256> fences;
+FenceMonitor< decltype(fences) > fenceMon;
 
 // echoGPS reads from the GPS and echoes them to the console, until a \n is encountered or 200ms
 // elapse.
@@ -287,8 +280,8 @@ void printSizes() {
 }
 
 void printLogger() {
-    printf("Logger state: size=%d count=%d free=%d first=%d next=%d\r\n",
-            logger.total, logger.count(), logger.size()-logger.count(), logger.first, logger.next);
+    printf("Logger state: size=%d count=%d free=%d first=%d next=%d\r\n", logger.size(),
+            logger.count(), logger.size()-logger.count(), logger.readers[0].pos.addr, logger.next.addr);
 }
 
 
@@ -304,9 +297,9 @@ void printGPS() {
     printf("   %d.%06dN/S %d.%06dE/W %d.%dm %d.%02dkn %d.%02ddeg\r\n",
             lat_int, lat_frac, lon_int, lon_frac, fix.alt/10, fix.alt%10,
             fix.knots/100, fix.knots%100, fix.course/100, fix.course%100);
-    printf("   %d.%02dmph %d.%02ddeg %d:%02d\r\n",
+    printf("   %d.%02dmph %d.%02ddeg %d:%02d %d.%03dkm\r\n",
             track.speed/447, track.speed*100/447%100, track.course/100, track.course%100,
-            track.time/60, track.time%60);
+            track.time/60, track.time%60, track.distance/1000, track.distance%1000);
     printf("   %d sats, HDOP:%d.%02d\r\n",
             fix.sats, fix.hdop/100, fix.hdop%100);
 }
@@ -361,8 +354,8 @@ reinit:
     printLogger();
 
     printf("LoRa radio =====\r\n");
-    if (!radio.init(61, 0xcb, lora_conf, 432600)) goto reinit;
-    radio.txPower(20); // <================================== !
+    if (!radio.init(61, 0xcb, *RateCtl::conf(RateCtl::homeSF), 432600)) goto reinit;
+    radio.txPower(RateCtl::maxPow);
     printf("Noise: %ddB\r\n", radio.noiseFloor());
 
     // switch uart baud rate to 9600
@@ -391,21 +384,29 @@ int main () {
 
     printf("Starting main loop =====\r\n");
 
-    uint32_t gps_tx_interval = gps_tx_target; // current interval in ms
-    //uint32_t gps_tx_last = 0;                 // tick of last tx
     NMEAfix gps_fix;                          // last fix
     uint32_t gps_fix_last = 0;                // tick of last fix
     uint32_t gps_log_last = 0;                // tick of last time we logged GPS coords
     uint32_t disp_last = 0;                   // tick of last display
+    uint32_t link_last = 0;                   // tick of last link statistics printed
     uint8_t hr = 0;                           // current heart rate, 0 if none
     uint8_t hr_spin = 0;
     uint8_t gps_spin = 0;
     uint8_t rf_spin = 0;
-    int8_t rx_margin = -100;
-    int16_t gw_rssi = 0;
-    int8_t gw_margin = -100;
     int16_t noise = radio.noiseFloor();
-    uint8_t radioState = 0; // 0=idle, 1=busy
+    Uplink< decltype(radio), decltype(logger), FixFields > uplink;
+    uint32_t dropped = logger.readers[0].dropped;
+    uint8_t session = EEPROM::read32(eeprom_session) + 1; // new session at each boot
+    EEPROM::write32(eeprom_session, session);
+    uplink.init(radio, logger, 4, session, 432600, ticks); // we're node 4
+    uplink.duty.init(ticks, tx_duty);
+    uplink.interval = gps_tx_target;
+    uplink.fecK = tx_fec;
+    TrackSimplifier< LogEntry > simplifier; // fixes to log, the newest one goes out live anyway
+    simplifier.init(gps_simplify);
+    fences.init();
+    fenceMon.init(fences, fence_hyst);
+    bool fence_event = false;                 // a fence was entered or exited since the last log
 
     constexpr int knotsNum = 10;      // number of readings to keep
     uint16_t knotsHist[knotsNum];     // last N readings for min/max
@@ -422,12 +423,28 @@ int main () {
             if (new_fix && nmea.valid) {
                 gps_fix = nmea.fix;
                 gps_fix_last = ticks;
+                track.addPoint(nmea.fix); // at the full fix rate for the distance
+                if (fenceMon.update(nmea.fix.lat, nmea.fix.lon)) {
+                    for (int f=0; f<fences.nFences; f++) {
+                        if (fenceMon.entered & (1u << f)) printf("Fence %d entered\r\n", f);
+                        if (fenceMon.exited & (1u << f)) printf("Fence %d exited\r\n", f);
+                    }
+                    fence_event = true;
+                }
 
                 if (ticks - gps_log_last > 950) {
                     gps_log_last = gps_fix_last;
-                    track.addPoint(nmea.fix);
-                    LogEntry le = { nmea.fix, hr };
-                    logger.pushEntry(le);
+                    LogEntry le = { nmea.fix, hr }, kept;
+                    if (gps_simplify == 0) logger.pushEntry(le);
+                    else if (simplifier.add(le, le.fix.lat, le.fix.lon, kept))
+                        logger.pushEntry(kept);
+                    uplink.latest(le, ticks);
+                    if (fence_event) {
+                        // log the fix even if the simplifier would drop it and send it now
+                        if (simplifier.flush(kept)) logger.pushEntry(kept);
+                        uplink.hurry(ticks);
+                        fence_event = false;
+                    }
 
                     for (int i=0; i<knotsNum-1; i++) knotsHist[i] = knotsHist[i+1];
                     knotsHist[knotsNum-1] = nmea.fix.knots;
@@ -443,64 +460,50 @@ int main () {
             memset(&gps_fix, 0, sizeof(gps_fix));
         }
 
+        // Background flash erase
+        logger.poll();
+
         // TX on radio
         if (logger.count() > 20) txOn = true;
         if (logger.count() == 0) txOn = false;
         txOn = true;
-        if (txOn && radioState == 0 && logger.count() > 0) {
-            uint8_t packet[64];
-            packet[0] = 0x80 + 4; // gps packet type
-            LogEntry le;
-            if (!logger.firstEntry(&le)) continue;
-            int cnt = nmeaMakePacket(le.fix, hr, packet+1, 120);
-            radio.addInfo(packet+1+cnt);
-            cnt += 3; // total length with packet type and 2 info bytes
-            uint8_t hdr = (1<<5) + 4; // request ack, we're node 4
-            radio.send(hdr, packet, cnt);
-            radioState = 1;
-            printf("** sent %d bytes\r\n", cnt);
+        if (logger.readers[0].dropped != dropped) {
+            // the log lost entries that may be in flight
+            dropped = logger.readers[0].dropped;
+            uplink.win.restart();
         }
+        if (txOn && uplink.send(ticks))
+            printf("** sent #%d: %d fixes%s in %d bytes at SF%d, %d in flight, %dms airtime, "
+                    "%ds budget left\r\n", uplink.seq, uplink.fixes,
+                    uplink.live ? " (live)" : uplink.isParity ? " (parity)" : "", uplink.len,
+                    uplink.txSF, uplink.win.n, uplink.airtime/1000, uplink.duty.credit/1000000);
 
         // Check for ACK on radio
-        if (radioState == 1) {
-            uint8_t ackBuf[10];
-            int ack = radio.getAck(ackBuf, 10);
-            if (ack >= 0) {
-                noise = radio.noiseFloor();
-                radioState = 0;
-                if (ack == 0) {
-                    // no ACK, quickly retry if first failure, else exponential back-off
-                    if (gps_tx_interval == gps_tx_target) gps_tx_interval /= 10;
-                    //else gps_tx_interval *= 2;
-                    if (gps_tx_interval > 10*gps_tx_target) gps_tx_interval = 10*gps_tx_target;
-                    printf("** TIMEOUT, new interval=%dms\r\n", gps_tx_interval);
-                } else {
-                    // got ACK, use target interval
-                    gps_tx_interval = gps_tx_target;
-                    if (++rf_spin >= sizeof(spinner)-1) rf_spin = 0;
-                    logger.shiftEntry();
-                    if (logger.count() == 0) logger.save();
-                }
-
-                if (ack >= 3) {
-                    int fei = 128 * (int)(int8_t)(ackBuf[ack-1]);
-                    gw_margin = (int16_t)(ackBuf[ack-2] & 0x3f);
-                    gw_rssi = ack > 3 ? -(int16_t)(ackBuf[ack-3]) : 0;
-                    rx_margin = radio.margin;
-                    printf("*** ACK from %x: %ddB (%ddBm) %dHz, local RX %ddB (%ddBm) %dHz, corr %dHz noise: %ddB\r\n",
-                        ackBuf[0]&0x1f, gw_margin, gw_rssi, fei, rx_margin, radio.rssi, radio.fei,
-                        radio.actFreq-radio.nomFreq, noise);
-                    gfx.setFont(&FreeSans10px7b);
-                    gfx.setCursor(0, 28);
-                    gfx.printf("#");
-                } else {
-                    gw_rssi = 0;
-                    gw_margin = -100;
-                    rx_margin = -100;
-                }
+        int ack = uplink.poll(ticks);
+        if (ack >= 0) {
+            noise = radio.noiseFloor();
+            // the uplink backs off after a lost ACK by itself, see uplink.h
+            if (ack == 0)
+                printf("** TIMEOUT, %d in a row\r\n", uplink.rate.timeouts);
+            else if (++rf_spin >= sizeof(spinner)-1)
+                rf_spin = 0;
+            if (ack >= 3) {
+                int fei = 128 * (int)(int8_t)(uplink.ack[ack-1]);
+                printf("*** ACK from %x: %ddB (%ddBm) %dHz, local RX %ddB (%ddBm) %dHz, corr %dHz noise: %ddB, SF%d @%ddBm\r\n",
+                    uplink.ack[0]&0x1f, uplink.gwMargin, uplink.gwRssi, fei, uplink.rxMargin,
+                    radio.rssi, radio.fei, radio.actFreq-radio.nomFreq, noise, uplink.txSF, uplink.rate.pow);
+                gfx.setFont(&FreeSans10px7b);
+                gfx.setCursor(0, 28);
+                gfx.printf("#");
             }
         }
 
+        // print the distributions of the link by SF once a minute
+        if (ticks - link_last > 60000) {
+            link_last = ticks;
+            LinkStats::print("SF", uplink.links, RateCtl::maxSF-RateCtl::minSF+1, RateCtl::minSF);
+        }
+
         // Handle BLE
         uint8_t new_hr = ble_heart_rate();
         if (new_hr != 0) hr = new_hr;
@@ -508,6 +511,7 @@ int main () {
         // Display
         if (ticks - disp_last > 500) {
             int batV = batVoltage();
+            if (batV < bat_low) logger.flushIdle(); // don't lose buffered entries on brown-out
             // logo
             gfx.setFont(&FreeSans10px7b);
             gfx.setCursor(127-msgLen, 63);
@@ -580,8 +584,13 @@ int main () {
             // radio info
             gfx.setFont(&FreeSans10px7b);
             gfx.setCursor(7, 28);
-            if (rx_margin != -100) {
-                gfx.printf("%2d/%2ddB %c", rx_margin, gw_margin, spinner[rf_spin]);
+            LinkStats &link = uplink.links[uplink.txSF-RateCtl::minSF];
+            if (link.margin.n > 0) {
+                // margin 90% and 50% of the packets at this SF got
+                gfx.printf("%2d/%2ddB %c", link.margin.quantile(10), link.margin.quantile(50),
+                    spinner[rf_spin]);
+            } else if (uplink.rxMargin != -100) {
+                gfx.printf("%2d/%2ddB %c", uplink.rxMargin, uplink.gwMargin, spinner[rf_spin]);
             } else {
                 gfx.printf("%4ddB %c", noise, spinner[rf_spin]);
             }
@@ -589,7 +598,7 @@ int main () {
             // tracker info
             gfx.setFont(&FreeSans10px7b);
             gfx.setCursor(0, 53);
-            gfx.printf("%dfl", logger.count());
+            gfx.printf("%dfl %ds", logger.count(), uplink.duty.credit/1000000);
 
             gfx.writeFastHLine(0,  0, 128, 1);
             gfx.writeFastHLine(0,  1, 128, 1);
@@ -0,0 +1,770 @@
+// Copyright (c) 2018 by Thorsten von Eicken
+//
+// Track benchmark, runs the track simplifier (gps/simplify.h) on the host over synthetic paddling
+// tracks with GPS noise and reports for several maximum errors how many fixes are kept, the
+// compression ratio, the largest actual distance of a dropped fix from the simplified track and
+// the time per fix. It also compares the fixed-point distance of gps/geo.h with the great-circle
+// distance in double precision, on random pairs of positions and on the tracks' lengths, checks
+// the sin, cos, atan2 and square root of gps/fixmath.h against libm over their whole input range
+// (sin and cos at every 251st angle, atan2 at every small vector) and geoDistance and courseTo on
+// random pairs, and times all of them against libm, keeping in mind that the host has an FPU and
+// the M0+ doesn't. Last it times FenceSet (gps/fence.h) against pointInPolygon, on single
+// fences of more and more vertices and on a harbour with a few dozen fences, and has FenceMonitor
+// watch the harbour's fences on a tour at 4Hz, checking its events against evaluating every fence
+// at every fix. Recorded tracks can
+// be added as files in the CSV format gwhost prints (node, kind, date, time, lat, lon, ... with
+// lat and lon in degrees*1E6), the fixes of the first node in each file are used.
+//
+// Usage: trackbench [file...]
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "gps/simplify.h"
+#include "gps/geo.h"
+#include "gps/fence.h"
+
+static constexpr double m2r = 3.14159265359 / 180 / 60 / 10000; // minutes*1E4 to radians
+static constexpr double unit = 0.1852; // meters per 1E-4 minutes of latitude
+static constexpr double pi = 3.14159265358979;
+static constexpr double b2r = 2 * pi / 4294967296.0; // binary angle to radians
+
+static constexpr int maxFixes = 150000;
+static int32_t lats[maxFixes], lons[maxFixes]; // track in minutes*1E4
+static int nFixes;
+static int keptIdx[maxFixes];                   // indexes of the fixes kept
+static int nKept;
+
+static uint64_t hostNsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ===== Synthetic tracks
+
+static uint32_t seed = 1;
+
+static double uniform() {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return (seed & 0xffffff) / (double)0x1000000;
+}
+
+static double gauss() { // Irwin-Hall approximation
+    double s = 0;
+    for (int i=0; i<12; i++) s += uniform();
+    return s - 6;
+}
+
+// Paddler integrates a course at 1Hz and adds GPS noise that wanders like a real receiver's.
+struct Paddler {
+    double x, y;        // true position in m east and north of the start
+    double nx, ny;      // GPS error in m
+    double noise;       // standard deviation of the error's steps in m
+
+    void init(double n) {
+        x = y = nx = ny = 0;
+        noise = n;
+    }
+
+    // step moves speed m/s for a second on course degrees and logs a fix.
+    void step(double course, double speed) {
+        x += speed * sin(course * 3.14159265359 / 180);
+        y += speed * cos(course * 3.14159265359 / 180);
+        nx = nx*0.95 + gauss()*noise;
+        ny = ny*0.95 + gauss()*noise;
+        if (nFixes >= maxFixes) return;
+        double lat0 = 21*600000.0;
+        lats[nFixes] = (int32_t)(lat0 + (y+ny) / unit);
+        lons[nFixes] = (int32_t)(-157*600000.0 + (x+nx) / unit / cos(lat0*m2r));
+        nFixes++;
+    }
+};
+
+static Paddler pad;
+
+// straight legs of 20 minutes each at 2.2m/s
+static void straightLegs() {
+    static const double courses[] = { 45, 135, 225, 300 };
+    for (int l=0; l<4; l++)
+        for (int s=0; s<1200; s++) pad.step(courses[l] + gauss()*2, 2.2);
+}
+
+// following a coastline, the course swings by 40 degrees every few minutes
+static void coastline() {
+    for (int s=0; s<3600; s++) pad.step(90 + 40*sin(s/50.0) + 15*sin(s/13.0), 2.0);
+}
+
+// three laps of a triangle of buoys 500m apart with tight turns around them
+static void raceCourse() {
+    for (int lap=0; lap<3; lap++)
+        for (int leg=0; leg<3; leg++) {
+            double course = 30 + leg*120;
+            for (int s=0; s<200; s++) pad.step(course, 2.5);
+            for (int s=0; s<12; s++) pad.step(course + s*10, 2.0); // the turn
+        }
+}
+
+// out along a straight line and back along the same line
+static void outAndBack() {
+    for (int s=0; s<900; s++) pad.step(10, 2.2);
+    for (int s=0; s<10; s++) pad.step(10 + s*18, 1.0);
+    for (int s=0; s<900; s++) pad.step(190, 2.2);
+}
+
+// drifting while resting, slowly and in no particular direction
+static void drifting() {
+    double c = 0;
+    for (int s=0; s<1800; s++) {
+        c += gauss()*20;
+        pad.step(c, 0.1);
+    }
+}
+
+// ===== Recorded tracks
+
+// readTrack reads the fixes of the first node in a gwhost CSV file and returns false if there are
+// none.
+static bool readTrack(const char *name) {
+    FILE *f = fopen(name, "r");
+    if (!f) {
+        printf("cannot open %s\n", name);
+        return false;
+    }
+    char line[200];
+    int node0 = -1;
+    while (fgets(line, sizeof(line), f) && nFixes < maxFixes) {
+        int node, date, tm, lat, lon;
+        char kind[8];
+        if (sscanf(line, "%d,%7[a-z],%d,%d,%d,%d", &node, kind, &date, &tm, &lat, &lon) != 6)
+            continue;
+        if (strcmp(kind, "fix") != 0) continue;
+        if (node0 < 0) node0 = node;
+        if (node != node0) continue;
+        lats[nFixes] = (int64_t)lat * 3 / 5; // degrees*1E6 to minutes*1E4
+        lons[nFixes] = (int64_t)lon * 3 / 5;
+        nFixes++;
+    }
+    fclose(f);
+    return nFixes > 0;
+}
+
+// ===== Benchmark
+
+// segDist returns the distance in m of fix i from the segment between fixes a and b.
+static double segDist(int i, int a, int b) {
+    double c = cos(lats[a] * m2r);
+    double px = (lons[i] - lons[a]) * c * unit, py = (lats[i] - lats[a]) * unit;
+    double dx = (lons[b] - lons[a]) * c * unit, dy = (lats[b] - lats[a]) * unit;
+    double len2 = dx*dx + dy*dy;
+    double t = len2 > 0 ? (px*dx + py*dy) / len2 : 0;
+    if (t < 0) t = 0;
+    if (t > 1) t = 1;
+    px -= t*dx;
+    py -= t*dy;
+    return sqrt(px*px + py*py);
+}
+
+// refDistance returns the great-circle distance in m with Vincenty's formula on a 6371km sphere,
+// as geoDistance in fence.h does but in double all the way.
+static double refDistance(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) {
+    double rlat1 = lat1 * m2r, rlat2 = lat2 * m2r, dlon = (lon1 - lon2) * m2r;
+    double num1 = cos(rlat2) * sin(dlon);
+    double num2 = cos(rlat1) * sin(rlat2) - sin(rlat1) * cos(rlat2) * cos(dlon);
+    double denom = sin(rlat1) * sin(rlat2) + cos(rlat1) * cos(rlat2) * cos(dlon);
+    return 6371000 * atan2(sqrt(num1*num1 + num2*num2), denom);
+}
+
+// benchLength compares the length of the track added up fix by fix both ways.
+static void benchLength() {
+    double ref = 0;
+    uint64_t mm = 0;
+    for (int i=1; i<nFixes; i++) {
+        ref += refDistance(lats[i-1], lons[i-1], lats[i], lons[i]);
+        mm += stepDistance(lats[i-1], lons[i-1], lats[i], lons[i]);
+    }
+    printf("  length %.1fm, fixed-point %.1fm, %+.4f%%\n", ref, mm/1000.0,
+        ref > 0 ? (mm/1000.0 - ref) / ref * 100 : 0);
+}
+
+// benchDistance compares stepDistance to the double reference on random pairs of positions
+// at latitudes up to 80 degrees, for each distance band, and times both.
+static void benchDistance() {
+    static const double bands[] = { 1, 10, 100, 1000, 10000 };
+    static constexpr int pairs = 100000;
+    static int32_t p[pairs][4];
+    printf("== distance between random positions, %d pairs per band\n", pairs);
+    for (int b=0; b<5; b++) {
+        for (int i=0; i<pairs; i++) {
+            double lat = (uniform()*160 - 80) * geoDeg, lon = (uniform()*360 - 180) * geoDeg;
+            double d = bands[b] * (0.5 + uniform()), c = uniform() * 2 * 3.14159265359;
+            p[i][0] = lat;
+            p[i][1] = lon;
+            p[i][2] = lat + d * cos(c) / 0.185325;
+            p[i][3] = lon + d * sin(c) / 0.185325 / cos(lat * m2r);
+        }
+        double maxRel = 0, maxAbs = 0, sum = 0;
+        for (int i=0; i<pairs; i++) {
+            double ref = refDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+            double got = stepDistance(p[i][0], p[i][1], p[i][2], p[i][3]) / 1000.0;
+            if (fabs(got - ref) > maxAbs) maxAbs = fabs(got - ref);
+            if (ref > 0 && fabs(got - ref) / ref > maxRel) maxRel = fabs(got - ref) / ref;
+        }
+        uint64_t t0 = hostNsecs();
+        for (int i=0; i<pairs; i++) sum += refDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t1 = hostNsecs();
+        uint32_t s = 0;
+        for (int i=0; i<pairs; i++) s += stepDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t2 = hostNsecs();
+        printf("  %5.0fm: max error %.4f%% or %.0fmm, double %3.0fns, fixed-point %3.0fns%s\n",
+            bands[b], maxRel*100, maxAbs*1000, (double)(t1-t0)/pairs, (double)(t2-t1)/pairs,
+            sum + s > 0 ? "" : " "); // use the sums so they aren't optimized away
+    }
+    printf("\n");
+}
+
+// ===== Fixed-point math
+
+// angleErr returns the difference in radians of the binary angle a from r radians.
+static double angleErr(uint32_t a, double r) {
+    double d = (int32_t)(a - (uint32_t)(int64_t)llround(r / b2r)) * b2r;
+    return fabs(d);
+}
+
+// benchFixmath checks fixSinCos, fixAtan2 and isqrt64 against libm and times them.
+static void benchFixmath() {
+    printf("== fixed-point math against libm\n");
+    // sin and cos at every 251st angle, which hits every part of the table steps
+    double maxSin = 0;
+    for (uint64_t a=0; a < (uint64_t)1 << 32; a += 251) {
+        int32_t s, c;
+        fixSinCos(a, s, c);
+        double es = fabs(s - sin(a * b2r) * fixOne), ec = fabs(c - cos(a * b2r) * fixOne);
+        if (es > maxSin) maxSin = es;
+        if (ec > maxSin) maxSin = ec;
+    }
+    // atan2 of every vector up to 512 and of random ones of any size
+    double maxAtan = 0;
+    for (int y=-512; y<=512; y++)
+        for (int x=-512; x<=512; x++) {
+            double e = angleErr(fixAtan2(y, x), x || y ? atan2(y, x) : 0);
+            if (e > maxAtan) maxAtan = e;
+        }
+    for (int i=0; i<1000000; i++) {
+        int sh = uniform() * 60;
+        int64_t y = (uniform() - 0.5) * 2 * ((int64_t)1 << sh);
+        int64_t x = (uniform() - 0.5) * 2 * ((int64_t)1 << sh);
+        double e = angleErr(fixAtan2(y, x), x || y ? atan2((double)y, (double)x) : 0);
+        if (e > maxAtan) maxAtan = e;
+    }
+    // square roots of every 24-bit value, of the values next to every 40-bit square and of
+    // random 64-bit ones
+    int sqrtErrs = 0;
+    for (uint64_t v=0; v < 1u<<24; v++) {
+        uint64_t r = isqrt64(v);
+        if (r*r > v || v - r*r > 2*r) sqrtErrs++;
+    }
+    for (uint64_t r=1; r < 1u<<20; r++) {
+        if (isqrt64(r*r) != r || isqrt64(r*r-1) != r-1) sqrtErrs++;
+    }
+    for (int i=0; i<1000000; i++) {
+        uint64_t v = (uint64_t)(uniform() * 16777216) << 40 | (uint64_t)(uniform() * 16777216) << 16 |
+            (uint64_t)(uniform() * 65536);
+        uint64_t r = isqrt64(v);
+        if (r*r > v || v - r*r > 2*r) sqrtErrs++;
+    }
+    printf("  sin/cos max error %.1fE-9, atan2 max error %.1fE-9rad, isqrt64 %d wrong%s\n",
+        maxSin / fixOne * 1E9, maxAtan * 1E9, sqrtErrs,
+        maxSin / fixOne > 3E-9 || maxAtan > 2E-8 || sqrtErrs ? "  ERR" : "");
+
+    // timing on the same random inputs
+    static constexpr int n = 1000000;
+    static uint32_t angles[n];
+    static int32_t ys[n], xs[n];
+    static uint64_t vs[n];
+    for (int i=0; i<n; i++) {
+        angles[i] = uniform() * 4294967296.0;
+        ys[i] = (uniform() - 0.5) * 2E9;
+        xs[i] = (uniform() - 0.5) * 2E9;
+        vs[i] = (uint64_t)(uniform() * 16777216) << 36 | (uint64_t)(uniform() * 16777216) << 12;
+    }
+    double sum = 0;
+    int64_t isum = 0;
+    uint64_t t0 = hostNsecs();
+    for (int i=0; i<n; i++) sum += sin(angles[i] * b2r) + cos(angles[i] * b2r);
+    uint64_t t1 = hostNsecs();
+    for (int i=0; i<n; i++) {
+        int32_t s, c;
+        fixSinCos(angles[i], s, c);
+        isum += s + c;
+    }
+    uint64_t t2 = hostNsecs();
+    for (int i=0; i<n; i++) sum += atan2((double)ys[i], (double)xs[i]);
+    uint64_t t3 = hostNsecs();
+    for (int i=0; i<n; i++) isum += fixAtan2(ys[i], xs[i]);
+    uint64_t t4 = hostNsecs();
+    for (int i=0; i<n; i++) sum += sqrt((double)vs[i]);
+    uint64_t t5 = hostNsecs();
+    for (int i=0; i<n; i++) isum += isqrt64(vs[i]);
+    uint64_t t6 = hostNsecs();
+    printf("  sin+cos: libm %3.0fns, fixed-point %3.0fns\n", (double)(t1-t0)/n, (double)(t2-t1)/n);
+    printf("  atan2:   libm %3.0fns, fixed-point %3.0fns\n", (double)(t3-t2)/n, (double)(t4-t3)/n);
+    printf("  sqrt:    libm %3.0fns, fixed-point %3.0fns%s\n", (double)(t5-t4)/n,
+        (double)(t6-t5)/n, sum + isum != 0 ? "" : " "); // use the sums so they aren't optimized away
+    printf("\n");
+}
+
+// refCourse returns the initial great-circle course in degrees in double precision.
+static double refCourse(int32_t lat1, int32_t lon1, int32_t lat2, int32_t lon2) {
+    double rlat1 = lat1 * m2r, rlat2 = lat2 * m2r, dlon = (lon2 - lon1) * m2r;
+    double c = atan2(sin(dlon) * cos(rlat2),
+        cos(rlat1) * sin(rlat2) - sin(rlat1) * cos(rlat2) * cos(dlon)) * 180 / pi;
+    return c < 0 ? c + 360 : c;
+}
+
+// benchGeo compares geoDistance and courseTo to the double reference on random pairs of
+// positions at latitudes up to 80 degrees, for each distance band, and times both.
+static void benchGeo() {
+    static const double bands[] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+    static constexpr int pairs = 100000;
+    static int32_t p[pairs][4];
+    printf("== great-circle distance and course between random positions, %d pairs per band\n",
+        pairs);
+    for (int b=0; b<7; b++) {
+        for (int i=0; i<pairs; i++) {
+            double lat = (uniform()*160 - 80) * pi / 180, lon = (uniform()*360 - 180) * pi / 180;
+            double d = bands[b] * (0.5 + uniform()) / 6371000, c = uniform() * 2 * pi;
+            double lat2 = asin(sin(lat) * cos(d) + cos(lat) * sin(d) * cos(c));
+            double lon2 = lon + atan2(sin(c) * sin(d) * cos(lat), cos(d) - sin(lat) * sin(lat2));
+            if (lon2 > pi) lon2 -= 2 * pi;
+            if (lon2 < -pi) lon2 += 2 * pi;
+            p[i][0] = llround(lat / m2r);
+            p[i][1] = llround(lon / m2r);
+            p[i][2] = llround(lat2 / m2r);
+            p[i][3] = llround(lon2 / m2r);
+        }
+        double maxDist = 0, maxRel = 0, maxCourse = 0;
+        for (int i=0; i<pairs; i++) {
+            double ref = refDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+            double e = fabs(geoDistance(p[i][0], p[i][1], p[i][2], p[i][3]) - ref);
+            if (e > maxDist) maxDist = e;
+            if (ref > 0 && e / ref > maxRel) maxRel = e / ref;
+            double c = courseTo(p[i][0], p[i][1], p[i][2], p[i][3]) / 100.0;
+            c = fabs(c - refCourse(p[i][0], p[i][1], p[i][2], p[i][3]));
+            if (c > 180) c = 360 - c;
+            if (c > maxCourse) maxCourse = c;
+        }
+        double sum = 0;
+        uint32_t s = 0;
+        uint64_t t0 = hostNsecs();
+        for (int i=0; i<pairs; i++) sum += refDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t1 = hostNsecs();
+        for (int i=0; i<pairs; i++) s += geoDistance(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t2 = hostNsecs();
+        for (int i=0; i<pairs; i++) sum += refCourse(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t3 = hostNsecs();
+        for (int i=0; i<pairs; i++) s += courseTo(p[i][0], p[i][1], p[i][2], p[i][3]);
+        uint64_t t4 = hostNsecs();
+        printf("  %8.0fm: distance max error %.2fm %.4f%%, course max error %.3fdeg, "
+            "double %3.0f+%3.0fns, fixed-point %3.0f+%3.0fns%s\n", bands[b], maxDist, maxRel*100,
+            maxCourse, (double)(t1-t0)/pairs, (double)(t3-t2)/pairs, (double)(t2-t1)/pairs,
+            (double)(t4-t3)/pairs, sum + s > 0 ? "" : " ");
+    }
+    printf("\n");
+}
+
+// ===== Geofences
+
+static constexpr int maxVerts = 4096;
+static int32_t verts[maxVerts][2];      // fences, {lat, lon} in minutes*1E4
+static int nVerts;
+static float fLats[maxVerts], fLons[maxVerts]; // the same in degrees for pointInPolygon
+
+// starFence adds a fence of n vertices around lat, lon with a radius wandering between r/2 and
+// r meters, with bays and headlands and some jaggedness, and returns its first vertex.
+static int starFence(double lat, double lon, double r, int n) {
+    int first = nVerts;
+    double a = uniform() * 2 * pi, ph = uniform() * 2 * pi;
+    for (int i=0; i<n && nVerts<maxVerts; i++, nVerts++) {
+        double rr = r * (0.75 + 0.2*sin(3*a + ph) + 0.05*uniform());
+        a += 2 * pi / n;
+        verts[nVerts][0] = lat + rr * cos(a) / unit;
+        verts[nVerts][1] = lon + rr * sin(a) / unit / cos(lat * m2r);
+    }
+    for (int i=first; i<nVerts; i++) {
+        fLats[i] = verts[i][0] / 600000.0;
+        fLons[i] = verts[i][1] / 600000.0;
+    }
+    return first;
+}
+
+// laneFence adds a fence that's a lane w meters wide along a meters from lat, lon on course c.
+static int laneFence(double lat, double lon, double c, double l, double w) {
+    int first = nVerts;
+    double cl = cos(lat * m2r), s = sin(c * pi / 180), co = cos(c * pi / 180);
+    double pts[4][2] = { { -w/2, 0 }, { w/2, 0 }, { w/2, l }, { -w/2, l } }; // across, along
+    for (int i=0; i<4; i++, nVerts++) {
+        verts[nVerts][0] = lat + (pts[i][1]*co - pts[i][0]*s) / unit;
+        verts[nVerts][1] = lon + (pts[i][1]*s + pts[i][0]*co) / unit / cl;
+        fLats[nVerts] = verts[nVerts][0] / 600000.0;
+        fLons[nVerts] = verts[nVerts][1] / 600000.0;
+    }
+    return first;
+}
+
+// refContains is pointInPolygon in double on the integer vertices, to check FenceSet with.
+static bool refContains(int first, int n, int32_t lat, int32_t lon) {
+    bool odd = false;
+    for (int i=0, j=n-1; i<n; j=i++) {
+        double yi = verts[first+i][0], yj = verts[first+j][0];
+        double xi = verts[first+i][1], xj = verts[first+j][1];
+        if (((yi < lat && yj >= lat) || (yj < lat && yi >= lat)) && (xi <= lon || xj <= lon))
+            odd ^= xi + (lat - yi) / (yj - yi) * (xj - xi) < lon;
+    }
+    return odd;
+}
+
+// onEdge returns true if lat, lon is exactly on an edge of the fence, where either answer is
+// right.
+static bool onEdge(int first, int n, int32_t lat, int32_t lon) {
+    for (int i=0, j=n-1; i<n; j=i++) {
+        int64_t y1 = verts[first+i][0], y2 = verts[first+j][0];
+        int64_t x1 = verts[first+i][1], x2 = verts[first+j][1];
+        if ((lat - y1) * (lat - y2) > 0 || (lon - x1) * (lon - x2) > 0) continue;
+        if ((x2 - x1) * (lat - y1) == (y2 - y1) * (lon - x1)) return true;
+    }
+    return false;
+}
+
+// benchFenceSizes times FenceSet against pointInPolygon on a single fence of each size, at
+// random positions in and around it, and checks that both agree with the double reference except
+// exactly on an edge, pointInPolygon's floats are off by up to a meter. The set has room for up
+// to 128 slabs so the index keeps up with the vertices.
+static void benchFenceSizes() {
+    static const int sizes[] = { 4, 16, 64, 256, 1024 };
+    static constexpr int queries = 100000;
+    static int32_t q[queries][2];
+    printf("== one fence of 2km, %d positions in and around it\n", queries);
+    for (int z=0; z<5; z++) {
+        int n = sizes[z];
+        nVerts = 0;
+        double lat0 = 21*600000.0, lon0 = -157*600000.0;
+        int first = starFence(lat0, lon0, 2000, n);
+        static FenceSet<1, 8192, 128> fs;
+        fs.init();
+        if (fs.add(verts + first, n) < 0) printf("  fence doesn't fit  ERR\n");
+        for (int i=0; i<queries; i++) {
+            q[i][0] = lat0 + (uniform()*2 - 1) * 2200 / unit;
+            q[i][1] = lon0 + (uniform()*2 - 1) * 2200 / unit / cos(lat0 * m2r);
+        }
+        int wrong = 0, fWrong = 0, in = 0;
+        for (int i=0; i<queries; i++) {
+            bool ref = refContains(first, n, q[i][0], q[i][1]);
+            in += ref;
+            bool edge = onEdge(first, n, q[i][0], q[i][1]);
+            wrong += fs.contains(0, q[i][0], q[i][1]) != ref && !edge;
+            fWrong += pointInPolygon(n, fLons+first, fLats+first, q[i][1] / 600000.0f,
+                q[i][0] / 600000.0f) != ref && !edge;
+        }
+        int sum = 0;
+        uint64_t t0 = hostNsecs();
+        for (int i=0; i<queries; i++)
+            sum += pointInPolygon(n, fLons+first, fLats+first, q[i][1] / 600000.0f,
+                q[i][0] / 600000.0f);
+        uint64_t t1 = hostNsecs();
+        for (int i=0; i<queries; i++) sum += fs.contains(0, q[i][0], q[i][1]);
+        uint64_t t2 = hostNsecs();
+        printf("  %4d vertices, %2d slabs: %2d%% inside, pointInPolygon %5.0fns %d wrong, "
+            "FenceSet %3.0fns %d wrong%s\n", n, fs.fences[0].slabs, in * 100 / queries,
+            (double)(t1-t0)/queries, fWrong, (double)(t2-t1)/queries, wrong,
+            wrong ? "  ERR" : sum ? "" : " ");
+    }
+    printf("\n");
+}
+
+// harbour adds the fences of a harbour around the start of the synthetic tracks: a coastline,
+// mooring fields and reefs to stay out of, a race course and shipping lanes, 30 in all.
+static void harbour(FenceSet<32, 2048> &fs, int *first, int *n) {
+    nVerts = 0;
+    fs.init();
+    double lat0 = 21*600000.0, lon0 = -157*600000.0, km = 1000 / unit;
+    int f = 0;
+    first[f] = starFence(lat0 + 6*km, lon0, 4000, 400);        // an island to the north
+    n[f++] = 400;
+    for (int i=0; i<20; i++) {                                  // moorings and reefs
+        int v = 12 + (int)(uniform() * 30);
+        first[f] = starFence(lat0 + (uniform()*10 - 5) * km, lon0 + (uniform()*10 - 5) * km,
+            100 + uniform() * 300, v);
+        n[f++] = v;
+    }
+    first[f] = starFence(lat0 - 1*km, lon0 + 1*km, 800, 6);     // the race course
+    n[f++] = 6;
+    for (int i=0; i<8; i++) {                                   // shipping lanes
+        first[f] = laneFence(lat0 + (uniform()*10 - 5) * km, lon0 - 6*km, 60 + uniform()*60,
+            14000, 300);
+        n[f++] = 4;
+    }
+    for (int i=0; i<f; i++)
+        if (fs.add(verts + first[i], n[i]) < 0) printf("  fence %d doesn't fit  ERR\n", i);
+}
+
+// benchHarbour times the fences of a harbour at every fix of the synthetic tracks, as the
+// tracker would check them at each fix.
+static void benchHarbour() {
+    static FenceSet<32, 2048> fs;
+    int first[32], n[32];
+    harbour(fs, first, n);
+    nFixes = 0;
+    pad.init(0.3);
+    straightLegs();
+    coastline();
+    raceCourse();
+    outAndBack();
+    int wrong = 0, inside = 0, sum = 0;
+    for (int i=0; i<nFixes; i++) {
+        uint32_t in = fs.inside(lats[i], lons[i]);
+        for (int f=0; f<fs.nFences; f++)
+            wrong += ((in >> f) & 1) != refContains(first[f], n[f], lats[i], lons[i]) &&
+                !onEdge(first[f], n[f], lats[i], lons[i]);
+        inside += in != 0;
+    }
+    uint64_t t0 = hostNsecs();
+    for (int i=0; i<nFixes; i++)
+        for (int f=0; f<fs.nFences; f++)
+            sum += pointInPolygon(n[f], fLons+first[f], fLats+first[f], lons[i] / 600000.0f,
+                lats[i] / 600000.0f);
+    uint64_t t1 = hostNsecs();
+    for (int i=0; i<nFixes; i++) sum += fs.inside(lats[i], lons[i]);
+    uint64_t t2 = hostNsecs();
+    printf("== harbour: %d fences, %d vertices, %d edge entries, %d bytes of RAM\n", fs.nFences,
+        nVerts, fs.nEdges, (int)sizeof(fs));
+    printf("  %d fixes, %d%% in a fence: pointInPolygon %5.0fns, FenceSet %3.0fns per fix, "
+        "%d wrong%s\n", nFixes, inside * 100 / nFixes, (double)(t1-t0)/nFixes,
+        (double)(t2-t1)/nFixes, wrong, wrong ? "  ERR" : sum ? "" : " ");
+    printf("\n");
+}
+
+// refDist returns the signed distance in 1E-4 minutes of latitude of lat, lon from the nearest
+// edge of the fence, positive inside, with the longitudes scaled by cosLat as FenceMonitor does,
+// in double.
+static double refDist(int first, int n, int32_t lat, int32_t lon, double cosLat) {
+    double best = 1E30;
+    for (int i=0, j=n-1; i<n; j=i++) {
+        double ax = (verts[first+j][1] - lon) * cosLat, ay = verts[first+j][0] - lat;
+        double bx = (verts[first+i][1] - lon) * cosLat, by = verts[first+i][0] - lat;
+        double dx = bx - ax, dy = by - ay, len2 = dx*dx + dy*dy;
+        double t = len2 > 0 ? -(ax*dx + ay*dy) / len2 : 0;
+        if (t < 0) t = 0;
+        if (t > 1) t = 1;
+        double d = sqrt((ax + t*dx) * (ax + t*dx) + (ay + t*dy) * (ay + t*dy));
+        if (d < best) best = d;
+    }
+    return refContains(first, n, lat, lon) ? best : -best;
+}
+
+// paddleTo paddles at 4Hz to lat, lon with courseTo.
+static void paddleTo(int32_t lat, int32_t lon) {
+    while (nFixes < maxFixes && geoDistance(lats[nFixes-1], lons[nFixes-1], lat, lon) > 5)
+        pad.step(courseTo(lats[nFixes-1], lons[nFixes-1], lat, lon) / 100.0, 2.2/4);
+}
+
+// tour paddles from one waypoint to the next through the harbour's moorings and shipping lanes,
+// then right along the edges of the race course, where the GPS noise crosses them back and
+// forth, and last drifts in open water for an hour.
+static void tour(int course) {
+    static const double wps[][2] = { // km north and east of the start
+        { -1, 1 }, { -2.5, 3 }, { 0, 4.5 }, { 2, 2 }, { 1, -3 }, { -3, -4 }, { -4, 0 }, { 0, 0 },
+    };
+    double lat0 = 21*600000.0, lon0 = -157*600000.0, km = 1000 / unit;
+    pad.step(0, 0);
+    for (unsigned w=0; w<sizeof(wps)/sizeof(wps[0]); w++)
+        paddleTo(lat0 + wps[w][0] * km, lon0 + wps[w][1] * km / cos(lat0 * m2r));
+    for (int i=0; i<=6; i++) paddleTo(verts[course + i%6][0], verts[course + i%6][1]);
+    paddleTo(lat0 - 12*km, lon0 - 12*km / cos(lat0 * m2r));
+    for (int s=0; s<14400 && nFixes<maxFixes; s++) pad.step(uniform() * 360, 0.1/4);
+}
+
+// benchMonitor runs FenceMonitor over the tour and compares its events with a hysteresis on the
+// double distances of every fence at every fix, and the time it takes with checking every fence
+// at every fix.
+static void benchMonitor() {
+    static constexpr int hyst = 10;
+    static FenceSet<32, 2048> fs;
+    int first[32], n[32];
+    harbour(fs, first, n);
+    nFixes = 0;
+    pad.init(0.3);
+    tour(first[21]); // the race course
+    // the reference events, at 1 per fence and fix
+    static uint8_t refEvent[maxFixes][32];
+    double cosLat = cos(lats[0] * m2r), h = hyst * 10000 / 1852;
+    uint32_t in = 0;
+    int refEvents = 0;
+    for (int i=0; i<nFixes; i++)
+        for (int f=0; f<fs.nFences; f++) {
+            double d = refDist(first[f], n[f], lats[i], lons[i], cosLat);
+            d = d < 0 ? -floor(-d) : floor(d); // FenceMonitor rounds down too
+            refEvent[i][f] = 0;
+            if (i == 0) {
+                if (d > 0) in |= 1u << f;
+            } else if ((in >> f & 1) && d < -h) {
+                in &= ~(1u << f);
+                refEvent[i][f] = 'x';
+            } else if (!(in >> f & 1) && d > h) {
+                in |= 1u << f;
+                refEvent[i][f] = 'e';
+            }
+            refEvents += refEvent[i][f] != 0;
+        }
+    FenceMonitor< FenceSet<32, 2048> > mon;
+    mon.init(fs, hyst);
+    static uint8_t event[maxFixes][32];
+    int events = 0, busy = 0;
+    for (int i=0; i<nFixes; i++) {
+        uint32_t evals = mon.evals;
+        mon.update(lats[i], lons[i]);
+        busy += mon.evals != evals;
+        for (int f=0; f<fs.nFences; f++) {
+            event[i][f] = mon.entered >> f & 1 ? 'e' : mon.exited >> f & 1 ? 'x' : 0;
+            events += event[i][f] != 0;
+        }
+    }
+    // an event is wrong if the other side doesn't have it within 2 fixes, the distances are
+    // rounded differently so one that's right at hyst can come a fix sooner or later
+    int wrong = 0;
+    for (int i=0; i<nFixes; i++)
+        for (int f=0; f<fs.nFences; f++) {
+            if (event[i][f] == refEvent[i][f]) continue;
+            for (int k=0; k<2; k++) {
+                uint8_t e = k ? event[i][f] : refEvent[i][f];
+                if (e == 0) continue;
+                bool found = false;
+                for (int j=i-2; j<=i+2; j++)
+                    if (j >= 0 && j < nFixes && (k ? refEvent : event)[j][f] == e) found = true;
+                wrong += !found;
+            }
+        }
+    // time it, with the open water at the end separately
+    int open = nFixes - 14400, sum = 0;
+    int flips = 0;
+    for (int i=1; i<nFixes; i++)
+        flips += __builtin_popcount(fs.inside(lats[i], lons[i]) ^ fs.inside(lats[i-1], lons[i-1]));
+    uint64_t t0 = hostNsecs();
+    for (int i=0; i<nFixes; i++) sum += fs.inside(lats[i], lons[i]);
+    uint64_t t1 = hostNsecs();
+    mon.init(fs, hyst);
+    for (int i=0; i<open; i++) sum += mon.update(lats[i], lons[i]);
+    uint64_t t2 = hostNsecs();
+    uint32_t evals = mon.evals;
+    for (int i=open; i<nFixes; i++) sum += mon.update(lats[i], lons[i]);
+    uint64_t t3 = hostNsecs();
+    printf("== tour of the harbour at 4Hz: %d fixes, events %dm past the edges\n", nFixes, hyst);
+    printf("  %d events (%d edge crossings), %d wrong, fences evaluated at %d%% of the fixes, "
+        "%.2f per fix%s\n", events, flips, wrong, busy * 100 / nFixes, (double)mon.evals / nFixes,
+        wrong || events != refEvents ? "  ERR" : "");
+    printf("  every fence at every fix %3.0fns, FenceMonitor %3.0fns per fix in the harbour, "
+        "%3.0fns in open water with %.4f evaluations per fix%s\n", (double)(t1-t0)/nFixes,
+        (double)(t2-t1)/open, (double)(t3-t2)/(nFixes-open), (double)(mon.evals-evals)/(nFixes-open),
+        sum ? "" : " ");
+    printf("\n");
+}
+
+// bench runs the simplifier over the track with each of the maximum errors.
+static void bench(const char *name) {
+    static const int errs[] = { 2, 5, 10, 20 };
+    printf("== %s: %d fixes\n", name, nFixes);
+    for (int e=0; e<4; e++) {
+        TrackSimplifier<int> simp;
+        simp.init(errs[e]);
+        nKept = 0;
+        int out;
+        uint64_t t0 = hostNsecs();
+        for (int i=0; i<nFixes; i++)
+            if (simp.add(i, lats[i], lons[i], out)) keptIdx[nKept++] = out;
+        if (simp.flush(out)) keptIdx[nKept++] = out;
+        uint64_t ns = hostNsecs() - t0;
+
+        double maxErr = 0;
+        for (int k=0; k+1<nKept; k++)
+            for (int i=keptIdx[k]+1; i<keptIdx[k+1]; i++) {
+                double d = segDist(i, keptIdx[k], keptIdx[k+1]);
+                if (d > maxErr) maxErr = d;
+            }
+        bool ok = nKept > 0 && keptIdx[0] == 0 && keptIdx[nKept-1] == nFixes-1 &&
+            maxErr <= errs[e];
+        printf("  max %2dm: %5d kept, %5.1f:1, max error %5.2fm, %3.0fns/fix%s\n", errs[e],
+            nKept, nKept ? (double)nFixes/nKept : 0, maxErr, nFixes ? (double)ns/nFixes : 0,
+            ok ? "" : "  ERR");
+    }
+    benchLength();
+    printf("\n");
+}
+
+// benchJump checks that a jump of more than 6km right after the first fix, as a GPS makes after
+// a cold start, keeps only fixes that came in, in order, starting with the first and ending with
+// the last.
+static void benchJump() {
+    static const double jumps[] = { 100, 10000, 50000 }; // m
+    printf("== jump after the first fix\n");
+    for (int j=0; j<3; j++) {
+        nFixes = 0;
+        pad.init(0.3);
+        pad.step(0, 0);
+        pad.x += jumps[j];
+        straightLegs();
+        TrackSimplifier<int> simp;
+        simp.init(5);
+        nKept = 0;
+        int out;
+        for (int i=0; i<nFixes; i++)
+            if (simp.add(i+1, lats[i], lons[i], out)) keptIdx[nKept++] = out; // 0 is T()
+        if (simp.flush(out)) keptIdx[nKept++] = out;
+        bool ok = nKept > 1 && keptIdx[0] == 1 && keptIdx[nKept-1] == nFixes;
+        for (int k=1; k<nKept; k++)
+            if (keptIdx[k] <= keptIdx[k-1]) ok = false;
+        printf("  %5.0fm: %d kept, 2nd kept is fix %d%s\n", jumps[j], nKept,
+            nKept > 1 ? keptIdx[1] - 1 : -1, ok ? "" : "  ERR");
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    printf("===== Track simplifier benchmark, 1Hz fixes with ~1m of wandering GPS noise\n\n");
+    if (argc > 1) {
+        for (int a=1; a<argc; a++) {
+            nFixes = 0;
+            if (readTrack(argv[a])) bench(argv[a]);
+        }
+        return 0;
+    }
+
+    static const struct {
+        const char *name;
+        void (*run)();
+    } tracks[] = {
+        { "straight legs", straightLegs },
+        { "coastline", coastline },
+        { "race course", raceCourse },
+        { "out and back", outAndBack },
+        { "drifting", drifting },
+    };
+    for (unsigned t=0; t<sizeof(tracks)/sizeof(tracks[0]); t++) {
+        nFixes = 0;
+        pad.init(0.3);
+        tracks[t].run();
+        bench(tracks[t].name);
+    }
+    benchJump();
+    benchDistance();
+    benchFixmath();
+    benchGeo();
+    benchFenceSizes();
+    benchHarbour();
+    benchMonitor();
+    return 0;
+}